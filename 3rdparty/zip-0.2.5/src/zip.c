@@ -26,16 +26,30 @@
 
 #else
 
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <unistd.h> // needed for symlink()
+#if defined(__linux__)
+#include <sys/syscall.h> // copy_file_range and fallocate, without _GNU_SOURCE
+#define ZIP_FALLOC_FL_KEEP_SIZE 0x01 // FALLOC_FL_KEEP_SIZE of linux/falloc.h
+#endif
 #define STRCLONE(STR) ((STR) ? strdup(STR) : NULL)
 
 #endif
 
 #ifdef __MINGW32__
+#include <io.h>
 #include <sys/types.h>
 #include <unistd.h>
 #endif
 
+#ifndef USE_EXTERNAL_MZCRC
+// miniz's byte-at-a-time mz_crc32 is replaced by the one defined below,
+// unless the embedder already supplies their own.
+#define USE_EXTERNAL_MZCRC
+#define ZIP_CRC32_IMPL
+#endif
+
 #include "miniz.h"
 #include "zip.h"
 
@@ -53,6 +67,68 @@
 #define fileno _fileno
 #endif
 
+#if defined(_WIN32) || defined(__WIN32__) || defined(_MSC_VER) ||              \
+    defined(__MINGW32__)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+typedef HANDLE zip_thread_t;
+typedef CRITICAL_SECTION zip_mutex_t;
+typedef CONDITION_VARIABLE zip_cond_t;
+
+#define ZIP_THREAD_PROC(name, arg) static DWORD WINAPI name(LPVOID arg)
+#define ZIP_THREAD_RETURN return 0
+
+#define zip_mutex_init(m) InitializeCriticalSection(m)
+#define zip_mutex_destroy(m) DeleteCriticalSection(m)
+#define zip_mutex_lock(m) EnterCriticalSection(m)
+#define zip_mutex_unlock(m) LeaveCriticalSection(m)
+#define zip_cond_init(c) InitializeConditionVariable(c)
+#define zip_cond_destroy(c) ((void)(c))
+#define zip_cond_wait(c, m) SleepConditionVariableCS((c), (m), INFINITE)
+#define zip_cond_broadcast(c) WakeAllConditionVariable(c)
+#define zip_thread_create(t, proc, arg)                                        \
+  ((*(t) = CreateThread(NULL, 0, (proc), (arg), 0, NULL)) == NULL)
+#define zip_thread_join(t)                                                     \
+  (WaitForSingleObject((t), INFINITE), CloseHandle(t))
+
+typedef INIT_ONCE zip_once_t;
+#define ZIP_ONCE_INIT INIT_ONCE_STATIC_INIT
+#define ZIP_ONCE_PROC(name)                                                    \
+  static BOOL CALLBACK name(PINIT_ONCE once, PVOID param, PVOID *context)
+#define ZIP_ONCE_RETURN                                                        \
+  (void)once, (void)param, (void)context;                                      \
+  return TRUE
+#define zip_once(o, proc) InitOnceExecuteOnce((o), (proc), NULL, NULL)
+
+#else
+#include <pthread.h>
+
+typedef pthread_t zip_thread_t;
+typedef pthread_mutex_t zip_mutex_t;
+typedef pthread_cond_t zip_cond_t;
+
+#define ZIP_THREAD_PROC(name, arg) static void *name(void *arg)
+#define ZIP_THREAD_RETURN return NULL
+
+#define zip_mutex_init(m) pthread_mutex_init((m), NULL)
+#define zip_mutex_destroy(m) pthread_mutex_destroy(m)
+#define zip_mutex_lock(m) pthread_mutex_lock(m)
+#define zip_mutex_unlock(m) pthread_mutex_unlock(m)
+#define zip_cond_init(c) pthread_cond_init((c), NULL)
+#define zip_cond_destroy(c) pthread_cond_destroy(c)
+#define zip_cond_wait(c, m) pthread_cond_wait((c), (m))
+#define zip_cond_broadcast(c) pthread_cond_broadcast(c)
+#define zip_thread_create(t, proc, arg) pthread_create((t), NULL, (proc), (arg))
+#define zip_thread_join(t) pthread_join((t), NULL)
+
+typedef pthread_once_t zip_once_t;
+#define ZIP_ONCE_INIT PTHREAD_ONCE_INIT
+#define ZIP_ONCE_PROC(name) static void name(void)
+#define ZIP_ONCE_RETURN return
+#define zip_once(o, proc) pthread_once((o), (proc))
+#endif
+
 #ifndef HAS_DEVICE
 #define HAS_DEVICE(P) 0
 #endif
@@ -81,6 +157,268 @@
 #define UNX_IFCHR 0020000  /* Unix character special   (not Amiga) */
 #define UNX_IFIFO 0010000  /* Unix fifo    (BCC, not MSC or Amiga) */
 
+#define ZIP_CRC32_POLY 0xedb88320u
+
+#ifdef ZIP_CRC32_IMPL
+
+#if (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) ||            \
+     defined(_M_IX86)) &&                                                      \
+    (defined(_MSC_VER) || defined(__clang__) ||                                \
+     (defined(__GNUC__) && __GNUC__ >= 5)) &&                                  \
+    !defined(__TINYC__)
+#define ZIP_CRC32_CLMUL
+#include <smmintrin.h>
+#include <wmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define ZIP_TARGET_CLMUL
+#else
+#include <cpuid.h>
+#define ZIP_TARGET_CLMUL __attribute__((target("pclmul,sse4.1")))
+#endif
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define ZIP_CRC32_ARMV8
+#include <arm_acle.h>
+#endif
+
+static mz_uint32 zip_crc32_table[16][256];
+static mz_uint32 (*zip_crc32_kernel)(mz_uint32 crc, const mz_uint8 *p,
+                                     size_t len);
+static zip_once_t zip_crc32_once = ZIP_ONCE_INIT;
+
+#define ZIP_READ_LE32(p)                                                       \
+  ((mz_uint32)(p)[0] | ((mz_uint32)(p)[1] << 8) | ((mz_uint32)(p)[2] << 16) |  \
+   ((mz_uint32)(p)[3] << 24))
+
+// The kernels take and return the inverted CRC, as the hardware does.
+static mz_uint32 zip_crc32_slice16(mz_uint32 crc, const mz_uint8 *p,
+                                   size_t len) {
+  const mz_uint32(*t)[256] = (const mz_uint32(*)[256])zip_crc32_table;
+
+  while (len >= 16) {
+    mz_uint32 a = crc ^ ZIP_READ_LE32(p), b = ZIP_READ_LE32(p + 4),
+              c = ZIP_READ_LE32(p + 8), d = ZIP_READ_LE32(p + 12);
+    crc = t[15][a & 0xff] ^ t[14][(a >> 8) & 0xff] ^ t[13][(a >> 16) & 0xff] ^
+          t[12][a >> 24] ^ t[11][b & 0xff] ^ t[10][(b >> 8) & 0xff] ^
+          t[9][(b >> 16) & 0xff] ^ t[8][b >> 24] ^ t[7][c & 0xff] ^
+          t[6][(c >> 8) & 0xff] ^ t[5][(c >> 16) & 0xff] ^ t[4][c >> 24] ^
+          t[3][d & 0xff] ^ t[2][(d >> 8) & 0xff] ^ t[1][(d >> 16) & 0xff] ^
+          t[0][d >> 24];
+    p += 16;
+    len -= 16;
+  }
+  while (len--) {
+    crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+  }
+  return crc;
+}
+
+#ifdef ZIP_CRC32_CLMUL
+// Folds 64 bytes at a time with carry-less multiplication, then reduces to 32
+// bits with Barrett reduction. See Intel's "Fast CRC Computation for Generic
+// Polynomials Using PCLMULQDQ Instruction", the constants are the ones used
+// by zlib and Chromium for the reflected gzip polynomial.
+ZIP_TARGET_CLMUL
+static mz_uint32 zip_crc32_clmul(mz_uint32 crc, const mz_uint8 *p,
+                                 size_t len) {
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+  size_t n = len & ~(size_t)15;
+
+  if (len < 64) {
+    return zip_crc32_slice16(crc, p, len);
+  }
+  len -= n;
+
+  x1 = _mm_loadu_si128((const __m128i *)(const void *)(p + 0x00));
+  x2 = _mm_loadu_si128((const __m128i *)(const void *)(p + 0x10));
+  x3 = _mm_loadu_si128((const __m128i *)(const void *)(p + 0x20));
+  x4 = _mm_loadu_si128((const __m128i *)(const void *)(p + 0x30));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+  x0 = _mm_set_epi32(0x00000001, (int)0xc6e41596, 0x00000001, 0x54442bd4);
+  p += 64;
+  n -= 64;
+
+  while (n >= 64) {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+    y5 = _mm_loadu_si128((const __m128i *)(const void *)(p + 0x00));
+    y6 = _mm_loadu_si128((const __m128i *)(const void *)(p + 0x10));
+    y7 = _mm_loadu_si128((const __m128i *)(const void *)(p + 0x20));
+    y8 = _mm_loadu_si128((const __m128i *)(const void *)(p + 0x30));
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+    p += 64;
+    n -= 64;
+  }
+
+  // Fold the four lanes into one.
+  x0 = _mm_set_epi32(0x00000000, (int)0xccaa009e, 0x00000001, 0x751997d0);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+  while (n >= 16) {
+    x2 = _mm_loadu_si128((const __m128i *)(const void *)p);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    p += 16;
+    n -= 16;
+  }
+
+  // Fold 128 bits down to 64.
+  x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+  x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+  x1 = _mm_srli_si128(x1, 8);
+  x1 = _mm_xor_si128(x1, x2);
+  x0 = _mm_set_epi32(0, 0, 0x00000001, 0x63cd6124);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, x3);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  // Barrett reduction to 32 bits.
+  x0 = _mm_set_epi32(0x00000001, (int)0xf7011641, 0x00000001, (int)0xdb710641);
+  x2 = _mm_and_si128(x1, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+  x2 = _mm_and_si128(x2, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  crc = (mz_uint32)_mm_extract_epi32(x1, 1);
+
+  return zip_crc32_slice16(crc, p, len);
+}
+
+static int zip_crc32_has_clmul(void) {
+  unsigned int ecx = 0;
+#ifdef _MSC_VER
+  int regs[4];
+  __cpuid(regs, 1);
+  ecx = (unsigned int)regs[2];
+#else
+  unsigned int eax = 0, ebx = 0, edx = 0;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    return 0;
+  }
+#endif
+  // PCLMULQDQ and SSE4.1
+  return (ecx & (1u << 1)) && (ecx & (1u << 19));
+}
+#endif
+
+#ifdef ZIP_CRC32_ARMV8
+static mz_uint32 zip_crc32_armv8(mz_uint32 crc, const mz_uint8 *p,
+                                 size_t len) {
+  while (len && ((size_t)p & 7)) {
+    crc = __crc32b(crc, *p++);
+    len--;
+  }
+  while (len >= 8) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    crc = __crc32d(crc, v);
+    p += 8;
+    len -= 8;
+  }
+  while (len--) {
+    crc = __crc32b(crc, *p++);
+  }
+  return crc;
+}
+#endif
+
+ZIP_ONCE_PROC(zip_crc32_init) {
+  mz_uint32 c;
+  int i, j;
+
+  for (i = 0; i < 256; i++) {
+    c = (mz_uint32)i;
+    for (j = 0; j < 8; j++) {
+      c = (c & 1) ? (c >> 1) ^ ZIP_CRC32_POLY : c >> 1;
+    }
+    zip_crc32_table[0][i] = c;
+  }
+  for (i = 0; i < 256; i++) {
+    c = zip_crc32_table[0][i];
+    for (j = 1; j < 16; j++) {
+      c = (c >> 8) ^ zip_crc32_table[0][c & 0xff];
+      zip_crc32_table[j][i] = c;
+    }
+  }
+
+  zip_crc32_kernel = zip_crc32_slice16;
+#if defined(ZIP_CRC32_CLMUL)
+  if (zip_crc32_has_clmul()) {
+    zip_crc32_kernel = zip_crc32_clmul;
+  }
+#elif defined(ZIP_CRC32_ARMV8)
+  zip_crc32_kernel = zip_crc32_armv8;
+#endif
+  ZIP_ONCE_RETURN;
+}
+
+mz_ulong mz_crc32(mz_ulong crc, const mz_uint8 *ptr, size_t buf_len) {
+  if (!ptr) {
+    return MZ_CRC32_INIT;
+  }
+  zip_once(&zip_crc32_once, zip_crc32_init);
+  return ~zip_crc32_kernel(~(mz_uint32)crc, ptr, buf_len) & 0xffffffffu;
+}
+
+#endif // ZIP_CRC32_IMPL
+
+// Multiply a and b modulo the CRC polynomial, bit-reflected.
+static mz_uint32 zip_crc32_multmodp(mz_uint32 a, mz_uint32 b) {
+  mz_uint32 m = (mz_uint32)1 << 31, p = 0;
+  for (;;) {
+    if (a & m) {
+      p ^= b;
+      if ((a & (m - 1)) == 0) {
+        break;
+      }
+    }
+    m >>= 1;
+    b = (b & 1) ? (b >> 1) ^ ZIP_CRC32_POLY : b >> 1;
+  }
+  return p;
+}
+
+// x^(8n) modulo the CRC polynomial, i.e. the shift by n zero bytes.
+static mz_uint32 zip_crc32_x8nmodp(mz_uint64 n) {
+  mz_uint32 p = (mz_uint32)1 << 31, sq = (mz_uint32)1 << 23;
+  while (n) {
+    if (n & 1) {
+      p = zip_crc32_multmodp(sq, p);
+    }
+    sq = zip_crc32_multmodp(sq, sq);
+    n >>= 1;
+  }
+  return p;
+}
+
+uint32_t zip_crc32(uint32_t crc, const void *buf, size_t len) {
+  return (uint32_t)mz_crc32(crc, (const mz_uint8 *)buf, len);
+}
+
+uint32_t zip_crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+  return zip_crc32_multmodp(zip_crc32_x8nmodp(len2), crc1) ^ crc2;
+}
+
+
 struct zip_entry_t {
   ssize_t index;
   char *name;
@@ -91,32 +429,90 @@ struct zip_entry_t {
   mz_uint8 header[MZ_ZIP_LOCAL_DIR_HEADER_SIZE];
   mz_uint64 header_offset;
   mz_uint16 method;
+  mz_uint level;
   mz_zip_writer_add_state state;
-  tdefl_compressor comp;
+  tdefl_compressor *comp; // allocated by the first deflated entry
+  mz_uint8 *sample;       // data held back, see zip_entry_sample
+  size_t sample_len;
+  int strategy;           // MZ_DEFAULT_STRATEGY, MZ_RLE etc.
   mz_uint32 external_attr;
   time_t m_time;
 };
 
+struct zip_entry_reader_t {
+  struct zip_t *zip;
+  mz_zip_reader_extract_iter_state *iter;
+  mz_bool eof;
+  struct zip_entry_reader_t *next;
+};
+
+struct zip_index_t {
+  size_t mask;
+  mz_uint32 *exact;  // slot -> file index + 1, 0 marks an empty slot
+  mz_uint32 *folded; // same, keyed on the ASCII lower-cased name
+};
+
+struct zip_name_set_t {
+  size_t mask;
+  const char **slots; // requested names, NULL marks an empty slot
+};
+
+struct zip_extent_t {
+  mz_uint64 ofs;  // local header offset
+  mz_uint64 size; // local header, data and data descriptor
+  mz_uint32 index;
+};
+
+struct zip_space_t {
+  struct zip_extent_t *extents; // file indices [0, len), in file order
+  size_t len;
+  mz_uint64 start; // where entries begin, after any prefix such as a stub
+};
+
+struct zip_commit_t {
+  size_t entries;         // commit after this many new entries, 0 never
+  mz_uint64 bytes;        // or after the archive grew by this many bytes
+  time_t seconds;         // or when this much time passed since the last
+  size_t pending;         // entries added since the last commit
+  mz_uint64 archive_size; // where the data ended at the last commit
+  time_t time;            // when the last commit happened
+};
+
 struct zip_t {
   mz_zip_archive archive;
   mz_uint level;
   struct zip_entry_t entry;
+  struct zip_entry_reader_t *readers;
+  struct zip_index_t *index;
+  void *map; // read-only mapping of the archive, see zip_open_mmap
+  size_t map_size;
+  zip_mutex_t lock; // guards readers
+  mz_uint8 *wbuf;   // pending appends to the archive file, see zip_file_write
+  size_t wbuf_size;
+  size_t wbuf_len;
+  mz_uint64 wbuf_ofs;
+  mz_uint8 *io_buf; // reused to read and extract files, see zip_io_buffer
+  size_t io_buf_size;
+  struct zip_space_t *space;  // where entries lie, see zip_space_update
+  struct zip_commit_t commit; // see zip_set_autocommit
+  int store_threshold;        // see zip_set_store_threshold, 0 the default
+  struct zip_rule_t *rules;   // see zip_set_policy, patterns stored after them
+  size_t rules_len;
 };
 
 enum zip_modify_t {
   MZ_KEEP = 0,
   MZ_DELETE = 1,
-  MZ_MOVE = 2,
 };
 
 struct zip_entry_mark_t {
   ssize_t file_index;
   enum zip_modify_t type;
   mz_uint64 m_local_header_ofs;
-  size_t lf_length;
+  mz_uint64 lf_length;
 };
 
-static const char *const zip_errlist[30] = {
+static const char *const zip_errlist[32] = {
     NULL,
     "not initialized\0",
     "invalid entry name\0",
@@ -147,11 +543,13 @@ static const char *const zip_errlist[30] = {
     "fseek error\0",
     "fread error\0",
     "fwrite error\0",
+    "crc32 mismatch\0",
+    "corrupt entry data\0",
 };
 
 const char *zip_strerror(int errnum) {
   errnum = -errnum;
-  if (errnum <= 0 || errnum >= 30) {
+  if (errnum <= 0 || errnum >= 32) {
     return NULL;
   }
 
@@ -264,24 +662,6 @@ static char *zip_name_normalize(char *name, char *const nname, size_t len) {
   return nname;
 }
 
-static mz_bool zip_name_match(const char *name1, const char *name2) {
-  char *nname2 = NULL;
-
-#ifdef ZIP_RAW_ENTRYNAME
-  nname2 = STRCLONE(name2);
-#else
-  nname2 = zip_strrpl(name2, strlen(name2), '\\', '/');
-#endif
-
-  if (!nname2) {
-    return MZ_FALSE;
-  }
-
-  mz_bool res = (strcmp(name1, nname2) == 0) ? MZ_TRUE : MZ_FALSE;
-  CLEANUP(nname2);
-  return res;
-}
-
 static int zip_archive_truncate(mz_zip_archive *pzip) {
   mz_zip_internal_state *pState = pzip->m_pState;
   mz_uint64 file_size = pzip->m_archive_size;
@@ -297,6 +677,178 @@ static int zip_archive_truncate(mz_zip_archive *pzip) {
   return 0;
 }
 
+// Finds where the data of an entry starts, past its local header.
+static int zip_entry_data_offset(mz_zip_archive *pzip,
+                                 const mz_zip_archive_file_stat *stats,
+                                 mz_uint64 *data_ofs) {
+  mz_uint8 header[MZ_ZIP_LOCAL_DIR_HEADER_SIZE];
+
+  if (pzip->m_pRead(pzip->m_pIO_opaque, stats->m_local_header_ofs, header,
+                    sizeof(header)) != sizeof(header)) {
+    return ZIP_EFREAD;
+  }
+  if (MZ_READ_LE32(header) != MZ_ZIP_LOCAL_DIR_HEADER_SIG) {
+    return ZIP_ENOHDR;
+  }
+
+  *data_ofs = stats->m_local_header_ofs + MZ_ZIP_LOCAL_DIR_HEADER_SIZE +
+              MZ_READ_LE16(header + MZ_ZIP_LDH_FILENAME_LEN_OFS) +
+              MZ_READ_LE16(header + MZ_ZIP_LDH_EXTRA_LEN_OFS);
+  if (*data_ofs + stats->m_comp_size > pzip->m_archive_size) {
+    return ZIP_EFREAD;
+  }
+  return 0;
+}
+
+// Tells the kernel a file is read or written once, front to back.
+static void zip_file_advise(MZ_FILE *stream) {
+#if defined(POSIX_FADV_SEQUENTIAL)
+  int fd = fileno(stream);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_NOREUSE);
+#else
+  (void)stream;
+#endif
+}
+
+/*
+ * Extracts an entry into a file. Compressed data is read bufsize bytes at a
+ * time and inflated into a ring of bufsize bytes which is written out
+ * whenever it fills, where miniz would read 8 KB and write 32 KB at a time.
+ * bufsize is a power of two, at least TINFL_LZ_DICT_SIZE, and buf holds
+ * twice as much.
+ */
+static int zip_archive_extract_file(mz_zip_archive *pzip, mz_uint index,
+                                    const char *path, mz_uint8 *buf,
+                                    size_t bufsize) {
+  mz_zip_archive_file_stat stats;
+  tinfl_decompressor inflator;
+  tinfl_status status = TINFL_STATUS_NEEDS_MORE_INPUT;
+  const mz_uint8 *in = buf;
+  mz_uint8 *out = buf + bufsize;
+  mz_uint64 ofs = 0, remaining = 0, written = 0;
+  size_t in_avail = 0, out_ofs = 0, in_size = 0, out_size = 0;
+  mz_uint32 crc = MZ_CRC32_INIT;
+  MZ_FILE *stream = NULL;
+  int err = 0;
+
+  if (!mz_zip_reader_file_stat(pzip, index, &stats)) {
+    return ZIP_ENOENT;
+  }
+  if (stats.m_is_encrypted || !stats.m_is_supported ||
+      (stats.m_method != 0 && stats.m_method != MZ_DEFLATED)) {
+    return ZIP_EINVENTTYPE;
+  }
+  if ((err = zip_entry_data_offset(pzip, &stats, &ofs)) < 0) {
+    return err;
+  }
+  remaining = stats.m_comp_size;
+
+  if (!(stream = MZ_FOPEN(path, "wb"))) {
+    return ZIP_EOPNFILE;
+  }
+  zip_file_advise(stream);
+#if defined(__linux__) && defined(SYS_fallocate) && defined(__LP64__)
+  // Reserve the file up front, so it is laid out in few extents. Unlike
+  // posix_fallocate this never falls back to writing zeros, and the size
+  // only grows as data is written. The size comes from the archive, so no
+  // more is reserved than the compressed data could inflate to.
+  if (stats.m_uncomp_size) {
+    syscall(SYS_fallocate, fileno(stream), ZIP_FALLOC_FL_KEEP_SIZE, (off_t)0,
+            (off_t)MZ_MIN(stats.m_uncomp_size,
+                          stats.m_method ? stats.m_comp_size * 1032
+                                         : stats.m_comp_size));
+  }
+#endif
+
+  // A mapped or in-memory archive is inflated in place.
+  if (pzip->m_pState->m_pMem && remaining <= (size_t)-1) {
+    in = (const mz_uint8 *)pzip->m_pState->m_pMem + ofs;
+    in_avail = (size_t)remaining;
+    remaining = 0;
+  }
+
+  tinfl_init(&inflator);
+  for (;;) {
+    if (!in_avail && remaining) {
+      in_avail = (size_t)MZ_MIN(remaining, (mz_uint64)bufsize);
+      in = buf;
+      if (pzip->m_pRead(pzip->m_pIO_opaque, ofs, buf, in_avail) != in_avail) {
+        err = ZIP_EFREAD;
+        break;
+      }
+      ofs += in_avail;
+      remaining -= in_avail;
+    }
+
+    if (!stats.m_method) {
+      if (!in_avail) {
+        break;
+      }
+      if (fwrite(in, 1, in_avail, stream) != in_avail) {
+        err = ZIP_EFWRITE;
+        break;
+      }
+      crc = (mz_uint32)mz_crc32(crc, in, in_avail);
+      written += in_avail;
+      in_avail = 0;
+      continue;
+    }
+
+    in_size = in_avail;
+    out_size = bufsize - out_ofs;
+    status = tinfl_decompress(&inflator, in, &in_size, out, out + out_ofs,
+                              &out_size,
+                              remaining ? TINFL_FLAG_HAS_MORE_INPUT : 0);
+    in += in_size;
+    in_avail -= in_size;
+    crc = (mz_uint32)mz_crc32(crc, out + out_ofs, out_size);
+    out_ofs += out_size;
+
+    if (out_ofs == bufsize || status == TINFL_STATUS_DONE) {
+      if (fwrite(out, 1, out_ofs, stream) != out_ofs) {
+        err = ZIP_EFWRITE;
+        break;
+      }
+      written += out_ofs;
+      out_ofs = 0;
+    }
+    if (status == TINFL_STATUS_DONE) {
+      break;
+    }
+    if (status < 0 || (status == TINFL_STATUS_NEEDS_MORE_INPUT &&
+                       !in_avail && !remaining)) {
+      // Corrupt or truncated deflate stream
+      err = ZIP_ECORRUPT;
+      break;
+    }
+  }
+
+  if (!err && written != stats.m_uncomp_size) {
+    err = ZIP_ECORRUPT;
+  }
+#ifndef MINIZ_DISABLE_ZIP_READER_CRC32_CHECKS
+  if (!err && crc != stats.m_crc32) {
+    err = ZIP_ECRC32;
+  }
+#endif
+
+  if (MZ_FCLOSE(stream) == EOF && !err) {
+    err = ZIP_EFWRITE;
+  }
+  if (err) {
+    // Don't leave a partial or unverified file behind.
+    remove(path);
+  }
+
+#if !defined(MINIZ_NO_TIME) && !defined(MINIZ_NO_STDIO)
+  if (!err) {
+    mz_zip_set_file_times(path, stats.m_time, stats.m_time);
+  }
+#endif
+  return err;
+}
+
 static int zip_archive_extract(mz_zip_archive *zip_archive, const char *dir,
                                int (*on_extract)(const char *filename,
                                                  void *arg),
@@ -308,6 +860,7 @@ static int zip_archive_extract(mz_zip_archive *zip_archive, const char *dir,
   mz_zip_archive_file_stat info;
   size_t dirlen = 0, filename_size = MZ_ZIP_MAX_ARCHIVE_FILENAME_SIZE;
   mz_uint32 xattr = 0;
+  mz_uint8 *buf = NULL;
 
   memset(path, 0, sizeof(path));
   memset(symlink_to, 0, sizeof(symlink_to));
@@ -337,6 +890,14 @@ static int zip_archive_extract(mz_zip_archive *zip_archive, const char *dir,
   if (filename_size > MAX_PATH - dirlen) {
     filename_size = MAX_PATH - dirlen;
   }
+
+  // One buffer serves every entry.
+  buf = (mz_uint8 *)malloc(2 * ZIP_IO_BUFFER_SIZE);
+  if (!buf) {
+    err = ZIP_EOOMEM;
+    goto out;
+  }
+
   // Get and print information about each file in the archive.
   n = mz_zip_reader_get_num_files(zip_archive);
   for (i = 0; i < n; ++i) {
@@ -389,9 +950,10 @@ static int zip_archive_extract(mz_zip_archive *zip_archive, const char *dir,
 #endif
     } else {
       if (!mz_zip_reader_is_file_a_directory(zip_archive, i)) {
-        if (!mz_zip_reader_extract_to_file(zip_archive, i, path, 0)) {
+        err = zip_archive_extract_file(zip_archive, i, path, buf,
+                                       ZIP_IO_BUFFER_SIZE);
+        if (err < 0) {
           // Cannot extract zip archive to file
-          err = ZIP_ENOFILE;
           goto out;
         }
       }
@@ -417,6 +979,7 @@ static int zip_archive_extract(mz_zip_archive *zip_archive, const char *dir,
   }
 
 out:
+  CLEANUP(buf);
   // Close the archive, freeing any resources it was using
   if (!mz_zip_reader_end(zip_archive)) {
     // Cannot end zip reader
@@ -425,331 +988,468 @@ out:
   return err;
 }
 
-static inline void zip_archive_finalize(mz_zip_archive *pzip) {
-  mz_zip_writer_finalize_archive(pzip);
-  zip_archive_truncate(pzip);
+static void zip_readers_detach(struct zip_t *zip) {
+  struct zip_entry_reader_t *reader = zip->readers;
+  while (reader) {
+    struct zip_entry_reader_t *next = reader->next;
+    if (reader->iter) {
+      mz_zip_reader_extract_iter_free(reader->iter);
+      reader->iter = NULL;
+    }
+    reader->zip = NULL;
+    reader->next = NULL;
+    reader = next;
+  }
+  zip->readers = NULL;
 }
 
-static ssize_t zip_entry_mark(struct zip_t *zip,
-                              struct zip_entry_mark_t *entry_mark,
-                              const ssize_t n, char *const entries[],
-                              const size_t len) {
-  ssize_t i = 0;
-  ssize_t err = 0;
-  if (!zip || !entry_mark || !entries) {
-    return ZIP_ENOINIT;
+static mz_uint32 zip_index_hash(const char *name, size_t len, int fold) {
+  // FNV-1a
+  mz_uint32 h = 2166136261u;
+  size_t i;
+  for (i = 0; i < len; ++i) {
+    h ^= (mz_uint8)(fold ? MZ_TOLOWER(name[i]) : name[i]);
+    h *= 16777619u;
   }
+  return h;
+}
 
-  mz_zip_archive_file_stat file_stat;
-  mz_uint64 d_pos = ~0UL;
-  for (i = 0; i < n; ++i) {
-    if ((err = zip_entry_openbyindex(zip, i))) {
-      return (ssize_t)err;
-    }
+static const char *zip_index_name(mz_zip_archive *pzip, mz_uint file_index,
+                                  size_t *len) {
+  const mz_uint8 *p = mz_zip_get_cdh(pzip, file_index);
+  *len = MZ_READ_LE16(p + MZ_ZIP_CDH_FILENAME_LEN_OFS);
+  return (const char *)p + MZ_ZIP_CENTRAL_DIR_HEADER_SIZE;
+}
 
-    mz_bool name_matches = MZ_FALSE;
-    {
-      size_t j;
-      for (j = 0; j < len; ++j) {
-        if (zip_name_match(zip->entry.name, entries[j])) {
-          name_matches = MZ_TRUE;
-          break;
-        }
-      }
-    }
-    if (name_matches) {
-      entry_mark[i].type = MZ_DELETE;
-    } else {
-      entry_mark[i].type = MZ_KEEP;
+static ssize_t zip_index_probe(mz_zip_archive *pzip, const mz_uint32 *slots,
+                               size_t mask, const char *name, size_t len,
+                               int fold, size_t *slot) {
+  mz_uint flags = fold ? 0 : MZ_ZIP_FLAG_CASE_SENSITIVE;
+  size_t i = zip_index_hash(name, len, fold) & mask;
+  for (; slots[i]; i = (i + 1) & mask) {
+    size_t n = 0;
+    const char *other = zip_index_name(pzip, slots[i] - 1, &n);
+    if (n == len && mz_zip_string_equal(name, other, (mz_uint)len, flags)) {
+      break;
     }
+  }
+  *slot = i;
+  return slots[i] ? (ssize_t)(slots[i] - 1) : -1;
+}
 
-    if (!mz_zip_reader_file_stat(&zip->archive, i, &file_stat)) {
-      return ZIP_ENOENT;
-    }
+static void zip_index_free(struct zip_t *zip) {
+  if (zip->index) {
+    CLEANUP(zip->index->exact);
+    CLEANUP(zip->index->folded);
+    CLEANUP(zip->index);
+  }
+}
 
-    zip_entry_close(zip);
+static struct zip_index_t *zip_index_build(struct zip_t *zip) {
+  mz_zip_archive *pzip = &(zip->archive);
+  struct zip_index_t *index = NULL;
+  size_t size = 16, slot = 0;
+  mz_uint i;
 
-    entry_mark[i].m_local_header_ofs = file_stat.m_local_header_ofs;
-    entry_mark[i].file_index = (ssize_t)-1;
-    entry_mark[i].lf_length = 0;
-    if ((entry_mark[i].type) == MZ_DELETE &&
-        (d_pos > entry_mark[i].m_local_header_ofs)) {
-      d_pos = entry_mark[i].m_local_header_ofs;
-    }
+  while (size < (size_t)pzip->m_total_files * 2) {
+    size <<= 1;
   }
 
-  for (i = 0; i < n; ++i) {
-    if ((entry_mark[i].m_local_header_ofs > d_pos) &&
-        (entry_mark[i].type != MZ_DELETE)) {
-      entry_mark[i].type = MZ_MOVE;
+  index = (struct zip_index_t *)calloc(1, sizeof(struct zip_index_t));
+  if (!index) {
+    return NULL;
+  }
+  index->mask = size - 1;
+  index->exact = (mz_uint32 *)calloc(size, sizeof(mz_uint32));
+  index->folded = (mz_uint32 *)calloc(size, sizeof(mz_uint32));
+  if (!index->exact || !index->folded) {
+    CLEANUP(index->exact);
+    CLEANUP(index->folded);
+    CLEANUP(index);
+    return NULL;
+  }
+
+  // Insert in central directory order and keep the first of any duplicate
+  // names, which is what the linear scan would find.
+  for (i = 0; i < pzip->m_total_files; ++i) {
+    size_t len = 0;
+    const char *name = zip_index_name(pzip, i, &len);
+    if (zip_index_probe(pzip, index->exact, index->mask, name, len, 0,
+                        &slot) < 0) {
+      index->exact[slot] = (mz_uint32)i + 1;
+    }
+    if (zip_index_probe(pzip, index->folded, index->mask, name, len, 1,
+                        &slot) < 0) {
+      index->folded[slot] = (mz_uint32)i + 1;
     }
   }
-  return err;
+
+  return index;
 }
 
-static ssize_t zip_index_next(mz_uint64 *local_header_ofs_array,
-                              ssize_t cur_index) {
-  ssize_t new_index = 0, i;
-  for (i = cur_index - 1; i >= 0; --i) {
-    if (local_header_ofs_array[cur_index] > local_header_ofs_array[i]) {
-      new_index = i + 1;
-      return new_index;
+static ssize_t zip_index_locate(struct zip_t *zip, const char *name,
+                                int case_sensitive) {
+  mz_zip_archive *pzip = &(zip->archive);
+  size_t len = strlen(name), slot = 0;
+
+  if (!zip->index) {
+    // Built on the first lookup by name, so archives that are only walked
+    // by index or extracted as a whole never pay for it.
+    zip->index = zip_index_build(zip);
+    if (!zip->index) {
+      return (ssize_t)mz_zip_reader_locate_file(
+          pzip, name, NULL, case_sensitive ? MZ_ZIP_FLAG_CASE_SENSITIVE : 0);
     }
   }
-  return new_index;
+
+  if (len > MZ_UINT16_MAX) {
+    return -1;
+  }
+
+  return zip_index_probe(pzip,
+                         case_sensitive ? zip->index->exact
+                                        : zip->index->folded,
+                         zip->index->mask, name, len, !case_sensitive, &slot);
 }
 
-static ssize_t zip_sort(mz_uint64 *local_header_ofs_array, ssize_t cur_index) {
-  ssize_t nxt_index = zip_index_next(local_header_ofs_array, cur_index);
+// Entry names compare with backslashes taken as slashes, like the names
+// entries are opened with.
+static char zip_name_char(char c) {
+#ifdef ZIP_RAW_ENTRYNAME
+  return c;
+#else
+  return c == '\\' ? '/' : c;
+#endif
+}
 
-  if (nxt_index != cur_index) {
-    mz_uint64 temp = local_header_ofs_array[cur_index];
-    ssize_t i;
-    for (i = cur_index; i > nxt_index; i--) {
-      local_header_ofs_array[i] = local_header_ofs_array[i - 1];
-    }
-    local_header_ofs_array[nxt_index] = temp;
+static mz_uint32 zip_name_set_hash(const char *name, size_t len) {
+  // FNV-1a
+  mz_uint32 h = 2166136261u;
+  size_t i;
+  for (i = 0; i < len; ++i) {
+    h ^= (mz_uint8)zip_name_char(name[i]);
+    h *= 16777619u;
   }
-  return nxt_index;
+  return h;
 }
 
-static int zip_index_update(struct zip_entry_mark_t *entry_mark,
-                            ssize_t last_index, ssize_t nxt_index) {
-  ssize_t j;
-  for (j = 0; j < last_index; j++) {
-    if (entry_mark[j].file_index >= nxt_index) {
-      entry_mark[j].file_index += 1;
+static mz_bool zip_name_set_equal(const char *name1, const char *name2,
+                                  size_t len) {
+  size_t i;
+  for (i = 0; i < len; ++i) {
+    if (name2[i] == '\0' ||
+        zip_name_char(name1[i]) != zip_name_char(name2[i])) {
+      return MZ_FALSE;
     }
   }
-  entry_mark[nxt_index].file_index = last_index;
-  return 0;
+  return name2[len] == '\0';
 }
 
-static int zip_entry_finalize(struct zip_t *zip,
-                              struct zip_entry_mark_t *entry_mark,
-                              const ssize_t n) {
-
-  ssize_t i = 0;
-  mz_uint64 *local_header_ofs_array = (mz_uint64 *)calloc(n, sizeof(mz_uint64));
-  if (!local_header_ofs_array) {
-    return ZIP_EOOMEM;
+// Returns the slot of name, or of the empty slot it would go into.
+static size_t zip_name_set_probe(const struct zip_name_set_t *set,
+                                 const char *name, size_t len) {
+  size_t i = zip_name_set_hash(name, len) & set->mask;
+  for (; set->slots[i]; i = (i + 1) & set->mask) {
+    if (zip_name_set_equal(name, set->slots[i], len)) {
+      break;
+    }
   }
+  return i;
+}
 
-  for (i = 0; i < n; ++i) {
-    local_header_ofs_array[i] = entry_mark[i].m_local_header_ofs;
-    ssize_t index = zip_sort(local_header_ofs_array, i);
+// Hashes the names to look for once, so matching every entry of an archive
+// against them costs one probe per entry and no allocations.
+static int zip_name_set_init(struct zip_name_set_t *set,
+                             char *const entries[], size_t len) {
+  size_t size = 16, i;
 
-    if (index != i) {
-      zip_index_update(entry_mark, i, index);
-    }
-    entry_mark[i].file_index = index;
+  while (size < len * 2) {
+    size <<= 1;
   }
-
-  size_t *length = (size_t *)calloc(n, sizeof(size_t));
-  if (!length) {
-    CLEANUP(local_header_ofs_array);
+  set->mask = size - 1;
+  set->slots = (const char **)calloc(size, sizeof(const char *));
+  if (!set->slots) {
     return ZIP_EOOMEM;
   }
-  for (i = 0; i < n - 1; i++) {
-    length[i] =
-        (size_t)(local_header_ofs_array[i + 1] - local_header_ofs_array[i]);
-  }
-  length[n - 1] =
-      (size_t)(zip->archive.m_archive_size - local_header_ofs_array[n - 1]);
-
-  for (i = 0; i < n; i++) {
-    entry_mark[i].lf_length = length[entry_mark[i].file_index];
+  for (i = 0; i < len; ++i) {
+    if (entries[i]) {
+      set->slots[zip_name_set_probe(set, entries[i], strlen(entries[i]))] =
+          entries[i];
+    }
   }
-
-  CLEANUP(length);
-  CLEANUP(local_header_ofs_array);
   return 0;
 }
 
-static ssize_t zip_entry_set(struct zip_t *zip,
-                             struct zip_entry_mark_t *entry_mark, ssize_t n,
-                             char *const entries[], const size_t len) {
-  ssize_t err = 0;
+static mz_bool zip_name_set_contains(const struct zip_name_set_t *set,
+                                     const char *name, size_t len) {
+  return set->slots[zip_name_set_probe(set, name, len)] != NULL;
+}
 
-  if ((err = zip_entry_mark(zip, entry_mark, n, entries, len)) < 0) {
-    return err;
-  }
-  if ((err = zip_entry_finalize(zip, entry_mark, n)) < 0) {
-    return err;
-  }
-  return 0;
+static void zip_name_set_free(struct zip_name_set_t *set) {
+  CLEANUP(set->slots);
 }
 
-static ssize_t zip_file_move(MZ_FILE *m_pFile, const mz_uint64 to,
-                             const mz_uint64 from, const size_t length,
-                             mz_uint8 *move_buf, const size_t capacity_size) {
-  if (length > capacity_size) {
-    return ZIP_ECAPSIZE;
-  }
-  if (MZ_FSEEK64(m_pFile, from, SEEK_SET)) {
-    return ZIP_EFSEEK;
-  }
-  if (fread(move_buf, 1, length, m_pFile) != length) {
-    return ZIP_EFREAD;
-  }
-  if (MZ_FSEEK64(m_pFile, to, SEEK_SET)) {
-    return ZIP_EFSEEK;
+// Returns the buffer zip_entry_fwrite, zip_entry_fread and deleting entries
+// work through. It holds two halves of *size bytes, for compressed and
+// inflated data.
+static mz_uint8 *zip_io_buffer(struct zip_t *zip, size_t *size) {
+  if (!zip->io_buf_size) {
+    zip->io_buf_size = ZIP_IO_BUFFER_SIZE;
   }
-  if (fwrite(move_buf, 1, length, m_pFile) != length) {
-    return ZIP_EFWRITE;
+  if (!zip->io_buf) {
+    zip->io_buf = (mz_uint8 *)malloc(2 * zip->io_buf_size);
   }
-  return (ssize_t)length;
+  *size = zip->io_buf_size;
+  return zip->io_buf;
 }
 
-static ssize_t zip_files_move(MZ_FILE *m_pFile, mz_uint64 writen_num,
-                              mz_uint64 read_num, size_t length) {
-  ssize_t n = 0;
-  const size_t page_size = 1 << 12; // 4K
-  mz_uint8 *move_buf = (mz_uint8 *)calloc(1, page_size);
-  if (!move_buf) {
-    return ZIP_EOOMEM;
-  }
+static inline void zip_archive_finalize(mz_zip_archive *pzip) {
+  mz_zip_writer_finalize_archive(pzip);
+  zip_archive_truncate(pzip);
+}
 
-  ssize_t moved_length = 0;
-  ssize_t move_count = 0;
-  while ((mz_int64)length > 0) {
-    move_count = (length >= page_size) ? page_size : length;
-    n = zip_file_move(m_pFile, writen_num, read_num, move_count, move_buf,
-                      page_size);
-    if (n < 0) {
-      moved_length = n;
-      goto cleanup;
-    }
+static ssize_t zip_entry_mark(struct zip_t *zip,
+                              struct zip_entry_mark_t *entry_mark,
+                              const ssize_t n, char *const entries[],
+                              const size_t len) {
+  struct zip_name_set_t set;
+  mz_zip_archive_file_stat file_stat;
+  ssize_t i = 0;
+  int err = 0;
+  if (!zip || !entry_mark || !entries) {
+    return ZIP_ENOINIT;
+  }
 
-    if (n != move_count) {
-      goto cleanup;
+  if ((err = zip_name_set_init(&set, entries, len)) < 0) {
+    return err;
+  }
+
+  for (i = 0; i < n; ++i) {
+    size_t namelen = 0;
+    const char *name = zip_index_name(&zip->archive, (mz_uint)i, &namelen);
+
+    if (!mz_zip_reader_file_stat(&zip->archive, (mz_uint)i, &file_stat)) {
+      err = ZIP_ENOENT;
+      break;
     }
 
-    writen_num += move_count;
-    read_num += move_count;
-    length -= move_count;
-    moved_length += move_count;
+    entry_mark[i].type =
+        zip_name_set_contains(&set, name, namelen) ? MZ_DELETE : MZ_KEEP;
+    entry_mark[i].m_local_header_ofs = file_stat.m_local_header_ofs;
+    entry_mark[i].file_index = i;
+    entry_mark[i].lf_length = 0;
   }
 
-cleanup:
-  CLEANUP(move_buf);
-  return moved_length;
+  zip_name_set_free(&set);
+  return err;
+}
+
+static int zip_entry_mark_cmp(const void *a, const void *b) {
+  mz_uint64 x = ((const struct zip_entry_mark_t *)a)->m_local_header_ofs;
+  mz_uint64 y = ((const struct zip_entry_mark_t *)b)->m_local_header_ofs;
+  return (x > y) - (x < y);
 }
 
-static int zip_central_dir_move(mz_zip_internal_state *pState, int begin,
-                                int end, int entry_num) {
-  if (begin == entry_num) {
+static int zip_entry_finalize(struct zip_t *zip,
+                              struct zip_entry_mark_t *entry_mark,
+                              const ssize_t n) {
+  ssize_t i = 0;
+
+  if (n <= 0) {
     return 0;
   }
 
-  size_t l_size = 0;
-  size_t r_size = 0;
-  mz_uint32 d_size = 0;
-  mz_uint8 *next = NULL;
-  mz_uint8 *deleted = &MZ_ZIP_ARRAY_ELEMENT(
-      &pState->m_central_dir, mz_uint8,
-      MZ_ZIP_ARRAY_ELEMENT(&pState->m_central_dir_offsets, mz_uint32, begin));
-  l_size = (size_t)(deleted - (mz_uint8 *)(pState->m_central_dir.m_p));
-  if (end == entry_num) {
-    r_size = 0;
-  } else {
-    next = &MZ_ZIP_ARRAY_ELEMENT(
-        &pState->m_central_dir, mz_uint8,
-        MZ_ZIP_ARRAY_ELEMENT(&pState->m_central_dir_offsets, mz_uint32, end));
-    r_size = pState->m_central_dir.m_size -
-             (mz_uint32)(next - (mz_uint8 *)(pState->m_central_dir.m_p));
-    d_size = (mz_uint32)(next - deleted);
-  }
-
-  if (next && l_size == 0) {
-    memmove(pState->m_central_dir.m_p, next, r_size);
-    pState->m_central_dir.m_p = MZ_REALLOC(pState->m_central_dir.m_p, r_size);
-    {
-      int i;
-      for (i = end; i < entry_num; i++) {
-        MZ_ZIP_ARRAY_ELEMENT(&pState->m_central_dir_offsets, mz_uint32, i) -=
-            d_size;
-      }
-    }
+  // Put the entries in file order, each one then spans up to the next local
+  // header and the last one up to the central directory.
+  qsort(entry_mark, (size_t)n, sizeof(struct zip_entry_mark_t),
+        zip_entry_mark_cmp);
+  if (entry_mark[n - 1].m_local_header_ofs > zip->archive.m_archive_size) {
+    return ZIP_ENOHDR;
+  }
+  for (i = 0; i < n - 1; i++) {
+    entry_mark[i].lf_length =
+        entry_mark[i + 1].m_local_header_ofs - entry_mark[i].m_local_header_ofs;
+  }
+  entry_mark[n - 1].lf_length =
+      zip->archive.m_archive_size - entry_mark[n - 1].m_local_header_ofs;
+  return 0;
+}
+
+static ssize_t zip_entry_set(struct zip_t *zip,
+                             struct zip_entry_mark_t *entry_mark, ssize_t n,
+                             char *const entries[], const size_t len) {
+  ssize_t err = 0;
+
+  if ((err = zip_entry_mark(zip, entry_mark, n, entries, len)) < 0) {
+    return err;
+  }
+  if ((err = zip_entry_finalize(zip, entry_mark, n)) < 0) {
+    return err;
+  }
+  return 0;
+}
+
+static ssize_t zip_file_move(MZ_FILE *m_pFile, const mz_uint64 to,
+                             const mz_uint64 from, const size_t length,
+                             mz_uint8 *move_buf, const size_t capacity_size) {
+  if (length > capacity_size) {
+    return ZIP_ECAPSIZE;
+  }
+  if (MZ_FSEEK64(m_pFile, from, SEEK_SET)) {
+    return ZIP_EFSEEK;
+  }
+  if (fread(move_buf, 1, length, m_pFile) != length) {
+    return ZIP_EFREAD;
+  }
+  if (MZ_FSEEK64(m_pFile, to, SEEK_SET)) {
+    return ZIP_EFSEEK;
+  }
+  if (fwrite(move_buf, 1, length, m_pFile) != length) {
+    return ZIP_EFWRITE;
+  }
+  return (ssize_t)length;
+}
+
+// Moves length bytes at from down to to, which is lower. Done front to back,
+// every chunk is read before the write of it can reach unread data.
+static int zip_files_move(struct zip_t *zip, mz_uint64 to, mz_uint64 from,
+                          mz_uint64 length) {
+  MZ_FILE *m_pFile = zip->archive.m_pState->m_pFile;
+  mz_uint8 *move_buf = NULL;
+  size_t capacity = 0;
+  ssize_t n = 0;
+
+  if (fflush(m_pFile)) {
+    return ZIP_EFWRITE;
   }
 
-  if (next && l_size * r_size != 0) {
-    memmove(deleted, next, r_size);
-    {
-      int i;
-      for (i = end; i < entry_num; i++) {
-        MZ_ZIP_ARRAY_ELEMENT(&pState->m_central_dir_offsets, mz_uint32, i) -=
-            d_size;
+#if defined(__linux__) && defined(SYS_copy_file_range)
+  // The kernel refuses to copy between overlapping ranges of a file, so the
+  // data is moved in steps of at most the distance it travels. Small gaps
+  // would need too many calls and are left to the buffer below.
+  if (from - to >= ZIP_IO_BUFFER_SIZE) {
+    long long in = (long long)from, out = (long long)to;
+    size_t step = (size_t)MZ_MIN(from - to, (mz_uint64)1 << 30);
+    long r = 0;
+
+    while (length > 0) {
+      r = syscall(SYS_copy_file_range, fileno(m_pFile), &in, fileno(m_pFile),
+                  &out, (size_t)MZ_MIN(length, (mz_uint64)step), 0u);
+      if (r < 0 && errno == EINTR) {
+        continue;
       }
+      if (r <= 0) {
+        break;
+      }
+      from += (mz_uint64)r;
+      to += (mz_uint64)r;
+      length -= (mz_uint64)r;
     }
   }
+#endif
 
-  pState->m_central_dir.m_size = l_size + r_size;
+  if (length > 0 && !(move_buf = zip_io_buffer(zip, &capacity))) {
+    return ZIP_EOOMEM;
+  }
+  // Both halves of the buffer are free here.
+  capacity *= 2;
+  while (length > 0) {
+    n = zip_file_move(m_pFile, to, from,
+                      (size_t)MZ_MIN(length, (mz_uint64)capacity), move_buf,
+                      capacity);
+    if (n < 0) {
+      return (int)n;
+    }
+    from += (mz_uint64)n;
+    to += (mz_uint64)n;
+    length -= (mz_uint64)n;
+  }
   return 0;
 }
 
-static int zip_central_dir_delete(mz_zip_internal_state *pState,
-                                  int *deleted_entry_index_array,
-                                  int entry_num) {
-  int i = 0;
-  int begin = 0;
-  int end = 0;
-  int d_num = 0;
-  while (i < entry_num) {
-    while ((i < entry_num) && (!deleted_entry_index_array[i])) {
-      i++;
-    }
-    begin = i;
+// Points the central directory record of file_index at its local header's
+// new offset, which is lower than the old one. Offsets past 4 GB are kept in
+// the zip64 extra field.
+static int zip_central_dir_set_offset(mz_zip_archive *pzip, mz_uint file_index,
+                                      mz_uint64 offset) {
+  mz_uint8 *p = (mz_uint8 *)mz_zip_get_cdh(pzip, file_index);
+  mz_uint8 *extra = NULL, *extra_end = NULL;
 
-    while ((i < entry_num) && (deleted_entry_index_array[i])) {
-      i++;
-    }
-    end = i;
-    zip_central_dir_move(pState, begin, end, entry_num);
+  if (!p) {
+    return ZIP_ENOHDR;
+  }
+  if (MZ_READ_LE32(p + MZ_ZIP_CDH_LOCAL_HEADER_OFS) != MZ_UINT32_MAX) {
+    MZ_WRITE_LE32(p + MZ_ZIP_CDH_LOCAL_HEADER_OFS, (mz_uint32)offset);
+    return 0;
   }
 
-  i = 0;
-  while (i < entry_num) {
-    while ((i < entry_num) && (!deleted_entry_index_array[i])) {
-      i++;
-    }
-    begin = i;
-    if (begin == entry_num) {
-      break;
+  extra = p + MZ_ZIP_CENTRAL_DIR_HEADER_SIZE +
+          MZ_READ_LE16(p + MZ_ZIP_CDH_FILENAME_LEN_OFS);
+  extra_end = extra + MZ_READ_LE16(p + MZ_ZIP_CDH_EXTRA_LEN_OFS);
+  while (extra + 4 <= extra_end) {
+    mz_uint32 field_id = MZ_READ_LE16(extra);
+    mz_uint32 field_size = MZ_READ_LE16(extra + 2);
+    mz_uint8 *field = extra + 4;
+
+    if (field_id == MZ_ZIP64_EXTENDED_INFORMATION_FIELD_HEADER_ID) {
+      if (MZ_READ_LE32(p + MZ_ZIP_CDH_DECOMPRESSED_SIZE_OFS) ==
+          MZ_UINT32_MAX) {
+        field += 8;
+      }
+      if (MZ_READ_LE32(p + MZ_ZIP_CDH_COMPRESSED_SIZE_OFS) == MZ_UINT32_MAX) {
+        field += 8;
+      }
+      if (field + 8 > extra + 4 + field_size || field + 8 > extra_end) {
+        break;
+      }
+      MZ_WRITE_LE64(field, offset);
+      return 0;
     }
-    while ((i < entry_num) && (deleted_entry_index_array[i])) {
-      i++;
+    extra += 4 + field_size;
+  }
+  return ZIP_ENOHDR;
+}
+
+// Drops the records of deleted entries from the central directory in one
+// pass, records are stored in file index order.
+static void zip_central_dir_delete(mz_zip_internal_state *pState,
+                                   const mz_bool *deleted_entry_flag_array,
+                                   int entry_num) {
+  mz_uint8 *central_dir = (mz_uint8 *)pState->m_central_dir.m_p;
+  mz_uint32 *offsets = (mz_uint32 *)pState->m_central_dir_offsets.m_p;
+  size_t writen_num = 0;
+  int i = 0, k = 0;
+
+  for (i = 0; i < entry_num; i++) {
+    size_t begin = offsets[i];
+    size_t end =
+        (i + 1 < entry_num) ? offsets[i + 1] : pState->m_central_dir.m_size;
+    if (deleted_entry_flag_array[i]) {
+      continue;
     }
-    end = i;
-    int k = 0, j;
-    for (j = end; j < entry_num; j++) {
-      MZ_ZIP_ARRAY_ELEMENT(&pState->m_central_dir_offsets, mz_uint32,
-                           begin + k) =
-          (mz_uint32)MZ_ZIP_ARRAY_ELEMENT(&pState->m_central_dir_offsets,
-                                          mz_uint32, j);
-      k++;
+    if (writen_num != begin) {
+      memmove(central_dir + writen_num, central_dir + begin, end - begin);
     }
-    d_num += end - begin;
+    offsets[k++] = (mz_uint32)writen_num;
+    writen_num += end - begin;
   }
 
-  pState->m_central_dir_offsets.m_size =
-      sizeof(mz_uint32) * (entry_num - d_num);
-  return 0;
+  pState->m_central_dir.m_size = writen_num;
+  pState->m_central_dir_offsets.m_size = (size_t)k;
 }
 
 static ssize_t zip_entries_delete_mark(struct zip_t *zip,
                                        struct zip_entry_mark_t *entry_mark,
                                        int entry_num) {
-  mz_uint64 writen_num = 0;
-  mz_uint64 read_num = 0;
-  size_t deleted_length = 0;
-  size_t move_length = 0;
+  mz_uint64 deleted_length = 0;
+  mz_uint64 move_from = 0;
+  mz_uint64 move_length = 0;
   int i = 0;
   size_t deleted_entry_num = 0;
-  ssize_t n = 0;
+  int err = 0;
 
   mz_bool *deleted_entry_flag_array =
-      (mz_bool *)calloc(entry_num, sizeof(mz_bool));
+      (mz_bool *)calloc((size_t)entry_num + 1, sizeof(mz_bool));
   if (deleted_entry_flag_array == NULL) {
     return ZIP_EOOMEM;
   }
@@ -757,51 +1457,44 @@ static ssize_t zip_entries_delete_mark(struct zip_t *zip,
   mz_zip_internal_state *pState = zip->archive.m_pState;
   zip->archive.m_zip_mode = MZ_ZIP_MODE_WRITING;
 
-  if ((!pState->m_pFile) || MZ_FSEEK64(pState->m_pFile, 0, SEEK_SET)) {
+  if (!pState->m_pFile) {
     CLEANUP(deleted_entry_flag_array);
     return ZIP_ENOENT;
   }
 
-  while (i < entry_num) {
-    while ((i < entry_num) && (entry_mark[i].type == MZ_KEEP)) {
-      writen_num += entry_mark[i].lf_length;
-      read_num = writen_num;
-      i++;
-    }
-
-    while ((i < entry_num) && (entry_mark[i].type == MZ_DELETE)) {
-      deleted_entry_flag_array[i] = MZ_TRUE;
-      read_num += entry_mark[i].lf_length;
-      deleted_length += entry_mark[i].lf_length;
-      i++;
-      deleted_entry_num++;
-    }
-
-    while ((i < entry_num) && (entry_mark[i].type == MZ_MOVE)) {
-      move_length += entry_mark[i].lf_length;
-      mz_uint8 *p = &MZ_ZIP_ARRAY_ELEMENT(
-          &pState->m_central_dir, mz_uint8,
-          MZ_ZIP_ARRAY_ELEMENT(&pState->m_central_dir_offsets, mz_uint32, i));
-      if (!p) {
-        CLEANUP(deleted_entry_flag_array);
-        return ZIP_ENOENT;
+  // entry_mark is in file order. Every run of kept entries after a deleted
+  // one slides down by what has been deleted so far, in one move.
+  for (i = 0; i <= entry_num && err == 0; i++) {
+    if (i == entry_num || entry_mark[i].type == MZ_DELETE) {
+      if (deleted_length > 0 && move_length > 0) {
+        err = zip_files_move(zip, move_from - deleted_length, move_from,
+                             move_length);
+      }
+      move_length = 0;
+      if (i < entry_num) {
+        deleted_entry_flag_array[entry_mark[i].file_index] = MZ_TRUE;
+        deleted_length += entry_mark[i].lf_length;
+        deleted_entry_num++;
       }
-      mz_uint32 offset = MZ_READ_LE32(p + MZ_ZIP_CDH_LOCAL_HEADER_OFS);
-      offset -= (mz_uint32)deleted_length;
-      MZ_WRITE_LE32(p + MZ_ZIP_CDH_LOCAL_HEADER_OFS, offset);
-      i++;
+      continue;
     }
 
-    n = zip_files_move(pState->m_pFile, writen_num, read_num, move_length);
-    if (n != (ssize_t)move_length) {
-      CLEANUP(deleted_entry_flag_array);
-      return n;
+    if (move_length == 0) {
+      move_from = entry_mark[i].m_local_header_ofs;
     }
-    writen_num += move_length;
-    read_num += move_length;
+    move_length += entry_mark[i].lf_length;
+    if (deleted_length > 0) {
+      err = zip_central_dir_set_offset(
+          &zip->archive, (mz_uint)entry_mark[i].file_index,
+          entry_mark[i].m_local_header_ofs - deleted_length);
+    }
+  }
+  if (err < 0) {
+    CLEANUP(deleted_entry_flag_array);
+    return err;
   }
 
-  zip->archive.m_archive_size -= (mz_uint64)deleted_length;
+  zip->archive.m_archive_size -= deleted_length;
   zip->archive.m_total_files =
       (mz_uint32)entry_num - (mz_uint32)deleted_entry_num;
 
@@ -811,369 +1504,1192 @@ static ssize_t zip_entries_delete_mark(struct zip_t *zip,
   return (ssize_t)deleted_entry_num;
 }
 
-struct zip_t *zip_open(const char *zipname, int level, char mode) {
-  struct zip_t *zip = NULL;
+static void zip_space_free(struct zip_t *zip) {
+  if (zip->space) {
+    CLEANUP(zip->space->extents);
+    CLEANUP(zip->space);
+  }
+}
 
-  if (!zipname || strlen(zipname) < 1) {
-    // zip_t archive name is empty or NULL
-    goto cleanup;
+// Where entry data ends, the central directory follows.
+static mz_uint64 zip_data_end(mz_zip_archive *pzip) {
+  return pzip->m_zip_mode == MZ_ZIP_MODE_READING
+             ? pzip->m_central_directory_file_ofs
+             : pzip->m_archive_size;
+}
+
+// Size of the data descriptor following an entry's data, found by matching
+// its fields against the central directory record. It may lack the
+// signature and holds 32 or 64-bit sizes, 12 to 24 bytes.
+static mz_uint64 zip_descriptor_size(mz_zip_archive *pzip,
+                                     const mz_zip_archive_file_stat *stats,
+                                     mz_uint64 ofs) {
+  mz_uint8 buf[MZ_ZIP_DATA_DESCRIPTER_SIZE64];
+  const mz_uint8 *p = buf;
+  size_t n = pzip->m_pRead(pzip->m_pIO_opaque, ofs, buf, sizeof(buf));
+  mz_uint64 sig = 0;
+
+  if (n >= 8 && MZ_READ_LE32(buf) == MZ_ZIP_DATA_DESCRIPTOR_ID &&
+      MZ_READ_LE32(buf + 4) == stats->m_crc32) {
+    sig = 4;
+  } else if (n < 4 || MZ_READ_LE32(buf) != stats->m_crc32) {
+    // Not there, assume the largest, the extent is clipped at the next one.
+    return MZ_ZIP_DATA_DESCRIPTER_SIZE64;
+  }
+  p = buf + sig + 4;
+  n -= (size_t)sig + 4;
+
+  // This library writes 64-bit sizes, try those first.
+  if (n >= 16 && MZ_READ_LE64(p) == stats->m_comp_size &&
+      MZ_READ_LE64(p + 8) == stats->m_uncomp_size) {
+    return sig + 20;
+  }
+  if (n >= 8 && MZ_READ_LE32(p) == (mz_uint32)stats->m_comp_size &&
+      MZ_READ_LE32(p + 4) == (mz_uint32)stats->m_uncomp_size) {
+    return sig + 12;
+  }
+  return MZ_ZIP_DATA_DESCRIPTER_SIZE64;
+}
+
+static int zip_entry_extent(mz_zip_archive *pzip, mz_uint index,
+                            struct zip_extent_t *extent) {
+  mz_zip_archive_file_stat stats;
+  mz_uint64 data_ofs = 0;
+  int err = 0;
+
+  if (!mz_zip_reader_file_stat(pzip, index, &stats)) {
+    return ZIP_ENOENT;
+  }
+  if ((err = zip_entry_data_offset(pzip, &stats, &data_ofs)) < 0) {
+    return err;
   }
 
-  if (level < 0)
-    level = MZ_DEFAULT_LEVEL;
-  if ((level & 0xF) > MZ_UBER_COMPRESSION) {
-    // Wrong compression level
-    goto cleanup;
+  extent->ofs = stats.m_local_header_ofs;
+  extent->size = data_ofs + stats.m_comp_size - stats.m_local_header_ofs;
+  extent->index = (mz_uint32)index;
+  if (stats.m_bit_flag & MZ_ZIP_LDH_BIT_FLAG_HAS_LOCATOR) {
+    extent->size +=
+        zip_descriptor_size(pzip, &stats, data_ofs + stats.m_comp_size);
   }
+  return 0;
+}
 
-  zip = (struct zip_t *)calloc((size_t)1, sizeof(struct zip_t));
-  if (!zip)
-    goto cleanup;
+static int zip_extent_cmp(const void *a, const void *b) {
+  mz_uint64 x = ((const struct zip_extent_t *)a)->ofs;
+  mz_uint64 y = ((const struct zip_extent_t *)b)->ofs;
+  return (x > y) - (x < y);
+}
 
-  zip->level = (mz_uint)level;
-  switch (mode) {
-  case 'w':
-    // Create a new archive.
-    if (!mz_zip_writer_init_file_v2(&(zip->archive), zipname, 0,
-                                    MZ_ZIP_FLAG_WRITE_ZIP64)) {
-      // Cannot initialize zip_archive writer
-      goto cleanup;
-    }
-    break;
+// Brings the map of where entries lie up to date with the central directory.
+// It is built on first use from the local headers and extended with the
+// entries added since, bytes no entry covers are holes.
+static int zip_space_update(struct zip_t *zip) {
+  mz_zip_archive *pzip = &(zip->archive);
+  struct zip_space_t *space = zip->space;
+  struct zip_extent_t *extents = NULL;
+  mz_uint64 end = zip_data_end(pzip);
+  size_t i, total = (size_t)pzip->m_total_files;
+  int err = 0;
 
-  case 'r':
-    if (!mz_zip_reader_init_file_v2(
-            &(zip->archive), zipname,
-            zip->level | MZ_ZIP_FLAG_DO_NOT_SORT_CENTRAL_DIRECTORY, 0, 0)) {
-      // An archive file does not exist or cannot initialize
-      // zip_archive reader
-      goto cleanup;
-    }
-    break;
+  if (!space) {
+    mz_uint8 sig[4];
 
-  case 'a':
-  case 'd':
-    if (!mz_zip_reader_init_file_v2_rpb(
-            &(zip->archive), zipname,
-            zip->level | MZ_ZIP_FLAG_DO_NOT_SORT_CENTRAL_DIRECTORY, 0, 0)) {
-      // An archive file does not exist or cannot initialize
-      // zip_archive reader
-      goto cleanup;
+    if (!(space = (struct zip_space_t *)calloc(1, sizeof(*space)))) {
+      return ZIP_EOOMEM;
     }
-    if ((mode == 'a' || mode == 'd')) {
-      if (!mz_zip_writer_init_from_reader_v2_noreopen(&(zip->archive), zipname,
-                                                      0)) {
-        mz_zip_reader_end(&(zip->archive));
-        goto cleanup;
-      }
+    zip->space = space;
+    // Data in front of the first entry belongs to a deleted one if it
+    // starts with a local header, otherwise it is kept as it is.
+    space->start = end;
+    if (pzip->m_pRead(pzip->m_pIO_opaque, 0, sig, sizeof(sig)) ==
+            sizeof(sig) &&
+        MZ_READ_LE32(sig) == MZ_ZIP_LOCAL_DIR_HEADER_SIG) {
+      space->start = 0;
     }
-    break;
-
-  default:
-    goto cleanup;
+  }
+  if (space->len >= total) {
+    return 0;
   }
 
-  return zip;
+  extents = (struct zip_extent_t *)realloc(space->extents,
+                                           total * sizeof(*extents));
+  if (!extents) {
+    return ZIP_EOOMEM;
+  }
+  space->extents = extents;
+  for (i = space->len; i < total; ++i) {
+    if ((err = zip_entry_extent(pzip, (mz_uint)i, &extents[i])) < 0) {
+      return err;
+    }
+  }
+  space->len = total;
 
-cleanup:
-  CLEANUP(zip);
-  return NULL;
+  qsort(extents, total, sizeof(*extents), zip_extent_cmp);
+  for (i = 0; i < total; ++i) {
+    mz_uint64 next = (i + 1 < total) ? extents[i + 1].ofs : end;
+    if (extents[i].ofs + extents[i].size > next) {
+      extents[i].size = next > extents[i].ofs ? next - extents[i].ofs : 0;
+    }
+  }
+  if (space->start > extents[0].ofs) {
+    space->start = extents[0].ofs;
+  }
+  return 0;
 }
 
-void zip_close(struct zip_t *zip) {
-  if (zip) {
-    // Always finalize, even if adding failed for some reason, so we have a
-    // valid central directory.
-    mz_zip_writer_finalize_archive(&(zip->archive));
-    zip_archive_truncate(&(zip->archive));
-    mz_zip_writer_end(&(zip->archive));
-    mz_zip_reader_end(&(zip->archive));
-
-    CLEANUP(zip);
+// Drops deleted entries from the map and renumbers the rest the way the
+// central directory was. The map covers the first space->len entries, so
+// entries it hasn't seen yet keep following them.
+static void zip_space_unlink(struct zip_t *zip, const mz_bool *deleted,
+                             size_t entry_num) {
+  struct zip_space_t *space = zip->space;
+  mz_uint32 *file_index = NULL;
+  size_t i, k = 0;
+  mz_uint32 n = 0;
+
+  if (!space) {
+    return;
+  }
+  if (!(file_index = (mz_uint32 *)malloc(MZ_MAX(entry_num, 1) *
+                                          sizeof(mz_uint32)))) {
+    // Rebuilt when it's needed next.
+    zip_space_free(zip);
+    return;
+  }
+  for (i = 0; i < entry_num; ++i) {
+    file_index[i] = n;
+    n += deleted[i] ? 0 : 1;
+  }
+  for (i = 0; i < space->len; ++i) {
+    if (!deleted[space->extents[i].index]) {
+      space->extents[k] = space->extents[i];
+      space->extents[k].index = file_index[space->extents[k].index];
+      k++;
+    }
   }
+  space->len = k;
+  CLEANUP(file_index);
 }
 
-int zip_is64(struct zip_t *zip) {
-  if (!zip || !zip->archive.m_pState) {
-    // zip_t handler or zip state is not initialized
-    return ZIP_ENOINIT;
+static void *zip_map_file(const char *zipname, size_t *size) {
+  void *view = NULL;
+#if defined(_WIN32) || defined(__WIN32__) || defined(_MSC_VER) ||              \
+    defined(__MINGW32__)
+  LARGE_INTEGER file_size;
+  HANDLE mapping = NULL;
+  HANDLE file = CreateFileA(zipname, GENERIC_READ, FILE_SHARE_READ, NULL,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    return NULL;
   }
-
-  return (int)zip->archive.m_pState->m_zip64;
+  if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0 &&
+      (unsigned long long)file_size.QuadPart <= (size_t)-1) {
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping) {
+      // The view keeps the mapping alive once both handles are closed.
+      view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+      CloseHandle(mapping);
+    }
+  }
+  CloseHandle(file);
+  if (view) {
+    *size = (size_t)file_size.QuadPart;
+  }
+#else
+  struct stat st;
+  int fd = open(zipname, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  if (fstat(fd, &st) == 0 && st.st_size > 0 &&
+      (unsigned long long)st.st_size <= (size_t)-1) {
+    view = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (view == MAP_FAILED) {
+      view = NULL;
+    } else {
+      *size = (size_t)st.st_size;
+    }
+  }
+  close(fd);
+#endif
+  return view;
 }
 
-static int _zip_entry_open(struct zip_t *zip, const char *entryname,
-                           int case_sensitive) {
-  size_t entrylen = 0;
-  mz_zip_archive *pzip = NULL;
-  mz_uint num_alignment_padding_bytes, level;
-  mz_zip_archive_file_stat stats;
-  int err = 0;
-  mz_uint16 dos_time, dos_date;
-  mz_uint32 extra_size = 0;
-  mz_uint8 extra_data[MZ_ZIP64_MAX_CENTRAL_EXTRA_FIELD_SIZE];
-  mz_uint64 local_dir_header_ofs = 0;
+// Positional replacement for mz_zip_file_read_func. It never moves the file
+// offset, so concurrent readers of one handle, or processes sharing the
+// descriptor across fork(), cannot race on it.
+static size_t zip_file_pread_func(void *opaque, mz_uint64 file_ofs, void *buf,
+                                  size_t n) {
+  mz_zip_archive *pzip = (mz_zip_archive *)opaque;
+  size_t done = 0;
+#if defined(_WIN32) || defined(__WIN32__) || defined(_MSC_VER) ||              \
+    defined(__MINGW32__)
+  HANDLE file = (HANDLE)_get_osfhandle(fileno(pzip->m_pState->m_pFile));
+#else
+  int fd = fileno(pzip->m_pState->m_pFile);
+#endif
 
-  if (!zip) {
-    return ZIP_ENOINIT;
+  file_ofs += pzip->m_pState->m_file_archive_start_ofs;
+  if ((mz_int64)file_ofs < 0) {
+    return 0;
   }
 
-  local_dir_header_ofs = zip->archive.m_archive_size;
-
-  if (!entryname) {
-    return ZIP_EINVENTNAME;
-  }
-
-  entrylen = strlen(entryname);
-  if (entrylen == 0) {
-    return ZIP_EINVENTNAME;
+  while (done < n) {
+#if defined(_WIN32) || defined(__WIN32__) || defined(_MSC_VER) ||              \
+    defined(__MINGW32__)
+    OVERLAPPED overlapped;
+    DWORD got = 0;
+    DWORD chunk = (DWORD)MZ_MIN(n - done, (size_t)0x40000000);
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.Offset = (DWORD)(file_ofs + done);
+    overlapped.OffsetHigh = (DWORD)((file_ofs + done) >> 32);
+    if (!ReadFile(file, (mz_uint8 *)buf + done, chunk, &got, &overlapped) ||
+        got == 0) {
+      break;
+    }
+#else
+    ssize_t got =
+        pread(fd, (mz_uint8 *)buf + done, n - done, (off_t)(file_ofs + done));
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      break;
+    }
+#endif
+    done += (size_t)got;
   }
 
-  /*
-    .ZIP File Format Specification Version: 6.3.3
+  return done;
+}
 
-    4.4.17.1 The name of the file, with optional relative path.
-    The path stored MUST not contain a drive or
-    device letter, or a leading slash.  All slashes
-    MUST be forward slashes '/' as opposed to
-    backwards slashes '\' for compatibility with Amiga
-    and UNIX file systems etc.  If input came from standard
-    input, there is no file name field.
-  */
-  if (zip->entry.name) {
-    CLEANUP(zip->entry.name);
-  }
-#ifdef ZIP_RAW_ENTRYNAME
-  zip->entry.name = STRCLONE(entryname);
+static void zip_unmap_file(struct zip_t *zip) {
+  if (zip->map) {
+#if defined(_WIN32) || defined(__WIN32__) || defined(_MSC_VER) ||              \
+    defined(__MINGW32__)
+    UnmapViewOfFile(zip->map);
 #else
-  zip->entry.name = zip_strrpl(entryname, entrylen, '\\', '/');
+    munmap(zip->map, zip->map_size);
 #endif
-
-  if (!zip->entry.name) {
-    // Cannot parse zip entry name
-    return ZIP_EINVENTNAME;
+    zip->map = NULL;
+    zip->map_size = 0;
   }
+}
 
-  pzip = &(zip->archive);
-  if (pzip->m_zip_mode == MZ_ZIP_MODE_READING) {
-    zip->entry.index = (ssize_t)mz_zip_reader_locate_file(
-        pzip, zip->entry.name, NULL,
-        case_sensitive ? MZ_ZIP_FLAG_CASE_SENSITIVE : 0);
-    if (zip->entry.index < (ssize_t)0) {
-      err = ZIP_ENOENT;
-      goto cleanup;
-    }
-
-    if (!mz_zip_reader_file_stat(pzip, (mz_uint)zip->entry.index, &stats)) {
-      err = ZIP_ENOENT;
-      goto cleanup;
-    }
-
-    zip->entry.comp_size = stats.m_comp_size;
-    zip->entry.uncomp_size = stats.m_uncomp_size;
-    zip->entry.uncomp_crc32 = stats.m_crc32;
-    zip->entry.offset = stats.m_central_dir_ofs;
-    zip->entry.header_offset = stats.m_local_header_ofs;
-    zip->entry.method = stats.m_method;
-    zip->entry.external_attr = stats.m_external_attr;
-#ifndef MINIZ_NO_TIME
-    zip->entry.m_time = stats.m_time;
-#endif
+// Writes what the append buffer holds to the archive file.
+static int zip_write_buffer_flush(struct zip_t *zip) {
+  size_t n = zip->wbuf_len;
 
-    return 0;
+  zip->wbuf_len = 0;
+  if (n && mz_zip_file_write_func(&(zip->archive), zip->wbuf_ofs, zip->wbuf,
+                                  n) != n) {
+    return ZIP_EFWRITE;
   }
+  return 0;
+}
 
-  level = zip->level & 0xF;
+// Replacement for mz_zip_file_write_func which coalesces the many small
+// sequential writes of the entry headers and the compressor output into
+// large ones. Only a write which does not continue the buffered run, or does
+// not fit, seeks and writes through to the file.
+static size_t zip_file_write_func(void *opaque, mz_uint64 file_ofs,
+                                  const void *buf, size_t n) {
+  // The archive is the first member of zip_t.
+  struct zip_t *zip = (struct zip_t *)opaque;
+
+  if (zip->wbuf_len && (file_ofs != zip->wbuf_ofs + zip->wbuf_len ||
+                        n > zip->wbuf_size - zip->wbuf_len)) {
+    if (zip_write_buffer_flush(zip) < 0) {
+      return 0;
+    }
+  }
 
-  zip->entry.index = (ssize_t)zip->archive.m_total_files;
-  zip->entry.comp_size = 0;
-  zip->entry.uncomp_size = 0;
-  zip->entry.uncomp_crc32 = MZ_CRC32_INIT;
-  zip->entry.offset = zip->archive.m_archive_size;
-  zip->entry.header_offset = zip->archive.m_archive_size;
-  memset(zip->entry.header, 0, MZ_ZIP_LOCAL_DIR_HEADER_SIZE * sizeof(mz_uint8));
-  zip->entry.method = level ? MZ_DEFLATED : 0;
+  if (!zip->wbuf && n < zip->wbuf_size) {
+    zip->wbuf = (mz_uint8 *)malloc(zip->wbuf_size);
+  }
+  if (!zip->wbuf || n >= zip->wbuf_size) {
+    return mz_zip_file_write_func(opaque, file_ofs, buf, n);
+  }
 
-  // UNIX or APPLE
-#if MZ_PLATFORM == 3 || MZ_PLATFORM == 19
-  // regular file with rw-r--r-- permissions
-  zip->entry.external_attr = (mz_uint32)(0100644) << 16;
-#else
-  zip->entry.external_attr = 0;
-#endif
+  if (!zip->wbuf_len) {
+    zip->wbuf_ofs = file_ofs;
+  }
+  memcpy(zip->wbuf + zip->wbuf_len, buf, n);
+  zip->wbuf_len += n;
+  return n;
+}
 
-  num_alignment_padding_bytes =
-      mz_zip_writer_compute_padding_needed_for_file_alignment(pzip);
+int zip_set_write_buffer(struct zip_t *zip, size_t size) {
+  int err = 0;
 
-  if (!pzip->m_pState || (pzip->m_zip_mode != MZ_ZIP_MODE_WRITING)) {
-    // Invalid zip mode
-    err = ZIP_EINVMODE;
-    goto cleanup;
-  }
-  if (zip->level & MZ_ZIP_FLAG_COMPRESSED_DATA) {
-    // Invalid zip compression level
-    err = ZIP_EINVLVL;
-    goto cleanup;
+  if (!zip) {
+    // zip_t handler is not initialized
+    return ZIP_ENOINIT;
   }
 
-  if (!mz_zip_writer_write_zeros(pzip, zip->entry.offset,
-                                 num_alignment_padding_bytes)) {
-    // Cannot memset zip entry header
-    err = ZIP_EMEMSET;
-    goto cleanup;
+  if (zip->archive.m_pWrite != zip_file_write_func &&
+      zip->archive.m_pWrite != mz_zip_file_write_func) {
+    // Only archive files being written are buffered
+    return ZIP_EINVMODE;
   }
-  local_dir_header_ofs += num_alignment_padding_bytes;
 
-  zip->entry.m_time = time(NULL);
-#ifndef MINIZ_NO_TIME
-  mz_zip_time_t_to_dos_time(zip->entry.m_time, &dos_time, &dos_date);
-#endif
+  err = zip_write_buffer_flush(zip);
+  CLEANUP(zip->wbuf);
+  zip->wbuf_size = size;
+  zip->archive.m_pWrite = size ? zip_file_write_func : mz_zip_file_write_func;
+  return err;
+}
 
-  // ZIP64 header with NULL sizes (sizes will be in the data descriptor, just
-  // after file data)
-  extra_size = mz_zip_writer_create_zip64_extra_data(
-      extra_data, NULL, NULL,
-      (local_dir_header_ofs >= MZ_UINT32_MAX) ? &local_dir_header_ofs : NULL);
+int zip_set_io_buffer(struct zip_t *zip, size_t size) {
+  size_t n = TINFL_LZ_DICT_SIZE;
 
-  if (!mz_zip_writer_create_local_dir_header(
-          pzip, zip->entry.header, entrylen, (mz_uint16)extra_size, 0, 0, 0,
-          zip->entry.method,
-          MZ_ZIP_GENERAL_PURPOSE_BIT_FLAG_UTF8 |
-              MZ_ZIP_LDH_BIT_FLAG_HAS_LOCATOR,
-          dos_time, dos_date)) {
-    // Cannot create zip entry header
-    err = ZIP_EMEMSET;
-    goto cleanup;
+  if (!zip) {
+    // zip_t handler is not initialized
+    return ZIP_ENOINIT;
   }
 
-  zip->entry.header_offset = zip->entry.offset + num_alignment_padding_bytes;
-
-  if (pzip->m_pWrite(pzip->m_pIO_opaque, zip->entry.header_offset,
-                     zip->entry.header,
-                     sizeof(zip->entry.header)) != sizeof(zip->entry.header)) {
-    // Cannot write zip entry header
-    err = ZIP_EMEMSET;
-    goto cleanup;
+  if (!size) {
+    size = ZIP_IO_BUFFER_SIZE;
+  }
+  // Inflating into a ring needs a power of two, which holds the dictionary.
+  while (n < size && n <= ((size_t)-1 >> 2)) {
+    n <<= 1;
   }
 
-  if (pzip->m_file_offset_alignment) {
-    MZ_ASSERT(
-        (zip->entry.header_offset & (pzip->m_file_offset_alignment - 1)) == 0);
+  CLEANUP(zip->io_buf);
+  zip->io_buf_size = n;
+  return 0;
+}
+
+int zip_set_store_threshold(struct zip_t *zip, int percent) {
+  if (!zip) {
+    // zip_t handler is not initialized
+    return ZIP_ENOINIT;
   }
-  zip->entry.offset += num_alignment_padding_bytes + sizeof(zip->entry.header);
 
-  if (pzip->m_pWrite(pzip->m_pIO_opaque, zip->entry.offset, zip->entry.name,
-                     entrylen) != entrylen) {
-    // Cannot write data to zip entry
-    err = ZIP_EWRTENT;
-    goto cleanup;
+  if (percent < 0 || percent > 100) {
+    return ZIP_EINVLVL;
   }
+  // 0 stands for the default in the handler, so off is kept as -1.
+  zip->store_threshold = percent ? percent : -1;
+  return 0;
+}
 
-  zip->entry.offset += entrylen;
+int zip_set_policy(struct zip_t *zip, const struct zip_rule_t *rules,
+                   size_t len) {
+  struct zip_rule_t *copy = NULL;
+  size_t i, size = len * sizeof(struct zip_rule_t);
+  char *p = NULL;
 
-  if (pzip->m_pWrite(pzip->m_pIO_opaque, zip->entry.offset, extra_data,
-                     extra_size) != extra_size) {
-    // Cannot write ZIP64 data to zip entry
-    err = ZIP_EWRTENT;
-    goto cleanup;
+  if (!zip || (!rules && len)) {
+    // zip_t handler is not initialized
+    return ZIP_ENOINIT;
   }
-  zip->entry.offset += extra_size;
 
-  if (level) {
-    zip->entry.state.m_pZip = pzip;
-    zip->entry.state.m_cur_archive_file_ofs = zip->entry.offset;
-    zip->entry.state.m_comp_size = 0;
+  for (i = 0; i < len; ++i) {
+    if (rules[i].level > MZ_UBER_COMPRESSION ||
+        rules[i].strategy < ZIP_STRATEGY_DEFAULT ||
+        rules[i].strategy > ZIP_STRATEGY_FIXED ||
+        (rules[i].max_size && rules[i].max_size < rules[i].min_size)) {
+      // Invalid zip compression level
+      return ZIP_EINVLVL;
+    }
+    size += rules[i].pattern ? strlen(rules[i].pattern) + 1 : 0;
+  }
 
-    if (tdefl_init(&(zip->entry.comp), mz_zip_writer_add_put_buf_callback,
-                   &(zip->entry.state),
-                   (int)tdefl_create_comp_flags_from_zip_params(
-                       (int)level, -15, MZ_DEFAULT_STRATEGY)) !=
-        TDEFL_STATUS_OKAY) {
-      // Cannot initialize the zip compressor
-      err = ZIP_ETDEFLINIT;
-      goto cleanup;
+  // One block, the rules followed by their patterns.
+  if (len && !(copy = (struct zip_rule_t *)malloc(size))) {
+    return ZIP_EOOMEM;
+  }
+  p = (char *)(copy + len);
+  for (i = 0; i < len; ++i) {
+    copy[i] = rules[i];
+    if (rules[i].pattern) {
+      copy[i].pattern = strcpy(p, rules[i].pattern);
+      p += strlen(p) + 1;
     }
   }
 
+  CLEANUP(zip->rules);
+  zip->rules = copy;
+  zip->rules_len = len;
   return 0;
-
-cleanup:
-  CLEANUP(zip->entry.name);
-  return err;
 }
 
-int zip_entry_open(struct zip_t *zip, const char *entryname) {
-  return _zip_entry_open(zip, entryname, 0);
-}
-
-int zip_entry_opencasesensitive(struct zip_t *zip, const char *entryname) {
-  return _zip_entry_open(zip, entryname, 1);
-}
-
-int zip_entry_openbyindex(struct zip_t *zip, size_t index) {
-  mz_zip_archive *pZip = NULL;
-  mz_zip_archive_file_stat stats;
-  mz_uint namelen;
-  const mz_uint8 *pHeader;
-  const char *pFilename;
+int zip_commit(struct zip_t *zip) {
+  mz_zip_archive *pzip = NULL;
+  mz_uint64 archive_size, central_dir_ofs;
+  int err = 0;
 
   if (!zip) {
     // zip_t handler is not initialized
     return ZIP_ENOINIT;
   }
 
-  pZip = &(zip->archive);
-  if (pZip->m_zip_mode != MZ_ZIP_MODE_READING) {
-    // open by index requires readonly mode
+  pzip = &(zip->archive);
+  if (pzip->m_zip_mode != MZ_ZIP_MODE_WRITING || !pzip->m_pState->m_pFile ||
+      zip->entry.name) {
+    // Only archive files being written, between entries, can be committed
     return ZIP_EINVMODE;
   }
 
-  if (index >= (size_t)pZip->m_total_files) {
-    // index out of range
-    return ZIP_EINVIDX;
+  // Write the central directory after the data, as zip_close would, then
+  // carry on writing where the data ends. The next entry overwrites the
+  // directory and the next commit writes it out again behind that entry.
+  archive_size = pzip->m_archive_size;
+  central_dir_ofs = pzip->m_central_directory_file_ofs;
+  if (!mz_zip_writer_finalize_archive(pzip)) {
+    err = ZIP_EWRTDIR;
+  } else if ((err = zip_write_buffer_flush(zip)) < 0 ||
+             MZ_FFLUSH(pzip->m_pState->m_pFile) == EOF) {
+    err = err < 0 ? err : ZIP_EFWRITE;
+  } else if (zip_archive_truncate(pzip) < 0) {
+    // A shorter directory than before leaves the old end behind
+    err = ZIP_EFWRITE;
+  }
+  pzip->m_zip_mode = MZ_ZIP_MODE_WRITING;
+  pzip->m_archive_size = archive_size;
+  pzip->m_central_directory_file_ofs = central_dir_ofs;
+
+  if (err == 0) {
+    zip->commit.pending = 0;
+    zip->commit.archive_size = archive_size;
+    zip->commit.time = time(NULL);
   }
+  return err;
+}
 
-  if (!(pHeader = &MZ_ZIP_ARRAY_ELEMENT(
-            &pZip->m_pState->m_central_dir, mz_uint8,
-            MZ_ZIP_ARRAY_ELEMENT(&pZip->m_pState->m_central_dir_offsets,
-                                 mz_uint32, index)))) {
-    // cannot find header in central directory
-    return ZIP_ENOHDR;
+int zip_set_autocommit(struct zip_t *zip, size_t entries,
+                       unsigned long long bytes, unsigned int seconds) {
+  if (!zip) {
+    // zip_t handler is not initialized
+    return ZIP_ENOINIT;
   }
 
-  namelen = MZ_READ_LE16(pHeader + MZ_ZIP_CDH_FILENAME_LEN_OFS);
-  pFilename = (const char *)pHeader + MZ_ZIP_CENTRAL_DIR_HEADER_SIZE;
+  if (zip->archive.m_zip_mode != MZ_ZIP_MODE_WRITING ||
+      !zip->archive.m_pState->m_pFile) {
+    // Only archive files being written can be committed
+    return ZIP_EINVMODE;
+  }
 
-  /*
-    .ZIP File Format Specification Version: 6.3.3
+  zip->commit.entries = entries;
+  zip->commit.bytes = bytes;
+  zip->commit.seconds = (time_t)seconds;
+  zip->commit.pending = 0;
+  zip->commit.archive_size = zip->archive.m_archive_size;
+  zip->commit.time = time(NULL);
+  return 0;
+}
 
-    4.4.17.1 The name of the file, with optional relative path.
-    The path stored MUST not contain a drive or
-    device letter, or a leading slash.  All slashes
-    MUST be forward slashes '/' as opposed to
-    backwards slashes '\' for compatibility with Amiga
-    and UNIX file systems etc.  If input came from standard
-    input, there is no file name field.
-  */
-  if (zip->entry.name) {
-    CLEANUP(zip->entry.name);
+// Commits once an entry has been added, if the policy set by
+// zip_set_autocommit says it is time to.
+static int zip_autocommit(struct zip_t *zip) {
+  struct zip_commit_t *commit = &zip->commit;
+
+  if (!commit->entries && !commit->bytes && !commit->seconds) {
+    return 0;
   }
-#ifdef ZIP_RAW_ENTRYNAME
-  zip->entry.name = STRCLONE(pFilename);
-#else
-  zip->entry.name = zip_strrpl(pFilename, namelen, '\\', '/');
-#endif
 
-  if (!zip->entry.name) {
-    // local entry name is NULL
-    return ZIP_EINVENTNAME;
+  commit->pending++;
+  if ((commit->entries && commit->pending >= commit->entries) ||
+      (commit->bytes && zip->archive.m_archive_size > commit->archive_size &&
+       zip->archive.m_archive_size - commit->archive_size >= commit->bytes) ||
+      (commit->seconds && time(NULL) - commit->time >= commit->seconds)) {
+    return zip_commit(zip);
   }
+  return 0;
+}
 
-  if (!mz_zip_reader_file_stat(pZip, (mz_uint)index, &stats)) {
-    return ZIP_ENOENT;
+struct zip_t *zip_open(const char *zipname, int level, char mode) {
+  struct zip_t *zip = NULL;
+
+  if (!zipname || strlen(zipname) < 1) {
+    // zip_t archive name is empty or NULL
+    goto cleanup;
   }
 
-  zip->entry.index = (ssize_t)index;
+  if (level < 0)
+    level = MZ_DEFAULT_LEVEL;
+  if ((level & 0xF) > MZ_UBER_COMPRESSION) {
+    // Wrong compression level
+    goto cleanup;
+  }
+
+  zip = (struct zip_t *)calloc((size_t)1, sizeof(struct zip_t));
+  if (!zip)
+    goto cleanup;
+
+  zip->level = (mz_uint)level;
+  switch (mode) {
+  case 'w':
+    // Create a new archive.
+    if (!mz_zip_writer_init_file_v2(&(zip->archive), zipname, 0,
+                                    MZ_ZIP_FLAG_WRITE_ZIP64)) {
+      // Cannot initialize zip_archive writer
+      goto cleanup;
+    }
+    zip_set_write_buffer(zip, ZIP_WRITE_BUFFER_SIZE);
+    break;
+
+  case 'r':
+    if (!mz_zip_reader_init_file_v2(
+            &(zip->archive), zipname,
+            zip->level | MZ_ZIP_FLAG_DO_NOT_SORT_CENTRAL_DIRECTORY, 0, 0)) {
+      // An archive file does not exist or cannot initialize
+      // zip_archive reader
+      goto cleanup;
+    }
+    zip->archive.m_pRead = zip_file_pread_func;
+    break;
+
+  case 'a':
+  case 'd':
+    if (!mz_zip_reader_init_file_v2_rpb(
+            &(zip->archive), zipname,
+            zip->level | MZ_ZIP_FLAG_DO_NOT_SORT_CENTRAL_DIRECTORY, 0, 0)) {
+      // An archive file does not exist or cannot initialize
+      // zip_archive reader
+      goto cleanup;
+    }
+    if ((mode == 'a' || mode == 'd')) {
+      if (!mz_zip_writer_init_from_reader_v2_noreopen(&(zip->archive), zipname,
+                                                      0)) {
+        mz_zip_reader_end(&(zip->archive));
+        goto cleanup;
+      }
+    }
+    if (mode == 'a') {
+      // Deleting entries moves data around with reads and writes, only
+      // appends are buffered.
+      zip_set_write_buffer(zip, ZIP_WRITE_BUFFER_SIZE);
+    }
+    break;
+
+  default:
+    goto cleanup;
+  }
+
+  zip_mutex_init(&zip->lock);
+  return zip;
+
+cleanup:
+  CLEANUP(zip);
+  return NULL;
+}
+
+struct zip_t *zip_open_mmap(const char *zipname, int level) {
+  struct zip_t *zip = NULL;
+
+  if (!zipname || strlen(zipname) < 1) {
+    // zip_t archive name is empty or NULL
+    return NULL;
+  }
+
+  if (level < 0)
+    level = MZ_DEFAULT_LEVEL;
+  if ((level & 0xF) > MZ_UBER_COMPRESSION) {
+    // Wrong compression level
+    return NULL;
+  }
+
+  zip = (struct zip_t *)calloc((size_t)1, sizeof(struct zip_t));
+  if (!zip)
+    return NULL;
+
+  zip->level = (mz_uint)level;
+  zip->map = zip_map_file(zipname, &zip->map_size);
+  if (!zip->map) {
+    goto cleanup;
+  }
+
+  // miniz parses the central directory straight out of the mapping and hands
+  // compressed data to inflate in place, so reads need no system calls.
+  if (!mz_zip_reader_init_mem(
+          &(zip->archive), zip->map, zip->map_size,
+          zip->level | MZ_ZIP_FLAG_DO_NOT_SORT_CENTRAL_DIRECTORY)) {
+    goto cleanup;
+  }
+
+  zip_mutex_init(&zip->lock);
+  return zip;
+
+cleanup:
+  zip_unmap_file(zip);
+  CLEANUP(zip);
+  return NULL;
+}
+
+// Finds the data descriptor of an entry whose data starts at data_ofs, the
+// first one whose compressed size is its distance from data_ofs. Returns its
+// size, or 0 if the file ends first.
+static int zip_descriptor_find(struct zip_t *zip, mz_uint64 data_ofs,
+                               mz_uint64 file_size, mz_uint16 method,
+                               mz_uint32 *uncomp_crc32, mz_uint64 *comp_size,
+                               mz_uint64 *uncomp_size) {
+  size_t size = 0, len, limit, i;
+  mz_uint8 *buf = zip_io_buffer(zip, &size);
+  mz_uint64 ofs = data_ofs;
+
+  if (!buf) {
+    return ZIP_EOOMEM;
+  }
+
+  while (ofs < file_size) {
+    len = (size_t)MZ_MIN((mz_uint64)size, file_size - ofs);
+    if (zip_file_pread_func(&zip->archive, ofs, buf, len) != len) {
+      return ZIP_EFREAD;
+    }
+    // Signatures near the end of the chunk are looked at with the next one,
+    // where all of their descriptor is in the buffer.
+    limit = ofs + len < file_size ? len - MZ_ZIP_DATA_DESCRIPTER_SIZE64 : len;
+    for (i = 0; i < limit; ++i) {
+      const mz_uint8 *p = (const mz_uint8 *)memchr(buf + i, 'P', limit - i);
+      mz_uint64 dist;
+      if (!p) {
+        break;
+      }
+      i = (size_t)(p - buf);
+      dist = ofs + i - data_ofs;
+      if (len - i < MZ_ZIP_DATA_DESCRIPTER_SIZE32 ||
+          MZ_READ_LE32(p) != MZ_ZIP_DATA_DESCRIPTOR_ID) {
+        continue;
+      }
+      // This library writes 64-bit sizes, try those first.
+      if (len - i >= MZ_ZIP_DATA_DESCRIPTER_SIZE64 &&
+          MZ_READ_LE64(p + 8) == dist &&
+          (method || MZ_READ_LE64(p + 16) == dist)) {
+        *uncomp_crc32 = MZ_READ_LE32(p + 4);
+        *comp_size = dist;
+        *uncomp_size = MZ_READ_LE64(p + 16);
+        return MZ_ZIP_DATA_DESCRIPTER_SIZE64;
+      }
+      if (MZ_READ_LE32(p + 8) == dist &&
+          (method || MZ_READ_LE32(p + 12) == dist)) {
+        *uncomp_crc32 = MZ_READ_LE32(p + 4);
+        *comp_size = dist;
+        *uncomp_size = MZ_READ_LE32(p + 12);
+        return MZ_ZIP_DATA_DESCRIPTER_SIZE32;
+      }
+    }
+    ofs += limit;
+  }
+  return 0;
+}
+
+// Reads the sizes from the zip64 extra field of a local header.
+static void zip_local_extra_sizes(const mz_uint8 *extra, mz_uint32 extra_len,
+                                  mz_uint64 *comp_size,
+                                  mz_uint64 *uncomp_size) {
+  while (extra_len >= 4) {
+    mz_uint32 id = MZ_READ_LE16(extra), len = MZ_READ_LE16(extra + 2);
+    if (len + 4 > extra_len) {
+      return;
+    }
+    if (id == MZ_ZIP64_EXTENDED_INFORMATION_FIELD_HEADER_ID && len >= 16) {
+      *uncomp_size = MZ_READ_LE64(extra + 4);
+      *comp_size = MZ_READ_LE64(extra + 12);
+      return;
+    }
+    extra += len + 4;
+    extra_len -= len + 4;
+  }
+}
+
+// Rebuilds the central directory from the local headers, entry after entry
+// up to the first one that is cut short, and leaves the archive ending after
+// that one.
+static int zip_entries_recover(struct zip_t *zip, mz_uint64 file_size) {
+  mz_zip_archive *pzip = &(zip->archive);
+  mz_uint8 header[MZ_ZIP_LOCAL_DIR_HEADER_SIZE];
+  mz_uint8 extra_data[MZ_ZIP64_MAX_CENTRAL_EXTRA_FIELD_SIZE];
+  mz_uint8 *meta = NULL;
+  mz_uint64 ofs = 0;
+  int err = 0;
+
+  meta = (mz_uint8 *)malloc(2 * 0x10000);
+  if (!meta) {
+    return ZIP_EOOMEM;
+  }
+
+  while (ofs + sizeof(header) <= file_size) {
+    mz_uint16 flags, method, namelen, extra_len;
+    mz_uint32 uncomp_crc32, extra_size, external_attr = 0;
+    mz_uint64 data_ofs, comp_size, uncomp_size, end;
+
+    if (zip_file_pread_func(pzip, ofs, header, sizeof(header)) !=
+            sizeof(header) ||
+        MZ_READ_LE32(header) != MZ_ZIP_LOCAL_DIR_HEADER_SIG) {
+      break;
+    }
+    flags = MZ_READ_LE16(header + MZ_ZIP_LDH_BIT_FLAG_OFS);
+    method = MZ_READ_LE16(header + MZ_ZIP_LDH_METHOD_OFS);
+    uncomp_crc32 = MZ_READ_LE32(header + MZ_ZIP_LDH_CRC32_OFS);
+    comp_size = MZ_READ_LE32(header + MZ_ZIP_LDH_COMPRESSED_SIZE_OFS);
+    uncomp_size = MZ_READ_LE32(header + MZ_ZIP_LDH_DECOMPRESSED_SIZE_OFS);
+    namelen = MZ_READ_LE16(header + MZ_ZIP_LDH_FILENAME_LEN_OFS);
+    extra_len = MZ_READ_LE16(header + MZ_ZIP_LDH_EXTRA_LEN_OFS);
+    data_ofs = ofs + sizeof(header) + namelen + extra_len;
+    if (!namelen || data_ofs > file_size ||
+        (flags & MZ_ZIP_GENERAL_PURPOSE_BIT_FLAG_IS_ENCRYPTED) ||
+        zip_file_pread_func(pzip, ofs + sizeof(header), meta,
+                            namelen + extra_len) !=
+            (size_t)(namelen + extra_len)) {
+      break;
+    }
+
+    if (flags & MZ_ZIP_LDH_BIT_FLAG_HAS_LOCATOR) {
+      // The sizes follow the data, which is not inflated to find its end.
+      if ((err = zip_descriptor_find(zip, data_ofs, file_size, method,
+                                     &uncomp_crc32, &comp_size,
+                                     &uncomp_size)) <= 0) {
+        break;
+      }
+      end = data_ofs + comp_size + (mz_uint64)err;
+      err = 0;
+    } else {
+      if (comp_size == MZ_UINT32_MAX || uncomp_size == MZ_UINT32_MAX) {
+        zip_local_extra_sizes(meta + namelen, extra_len, &comp_size,
+                              &uncomp_size);
+      }
+      end = data_ofs + comp_size;
+    }
+    if (end > file_size) {
+      break;
+    }
+
+#if MZ_PLATFORM == 3 || MZ_PLATFORM == 19
+    // Local headers keep no attributes, give them what new entries get.
+    external_attr = (mz_uint32)(0100644) << 16;
+#endif
+    if (meta[namelen - 1] == '/' && !uncomp_size) {
+      external_attr |= MZ_ZIP_DOS_DIR_ATTRIBUTE_BITFLAG;
+    }
+    extra_size = mz_zip_writer_create_zip64_extra_data(
+        extra_data, (uncomp_size >= MZ_UINT32_MAX) ? &uncomp_size : NULL,
+        (comp_size >= MZ_UINT32_MAX) ? &comp_size : NULL,
+        (ofs >= MZ_UINT32_MAX) ? &ofs : NULL);
+    if (!mz_zip_writer_add_to_central_dir(
+            pzip, (const char *)meta, namelen, extra_data,
+            (mz_uint16)extra_size, "", 0, uncomp_size, comp_size,
+            uncomp_crc32, method, flags,
+            MZ_READ_LE16(header + MZ_ZIP_LDH_FILE_TIME_OFS),
+            MZ_READ_LE16(header + MZ_ZIP_LDH_FILE_DATE_OFS), ofs,
+            external_attr, NULL, 0)) {
+      err = ZIP_EWRTDIR;
+      break;
+    }
+    pzip->m_total_files++;
+    ofs = end;
+  }
+
+  pzip->m_archive_size = ofs;
+  CLEANUP(meta);
+  return err;
+}
+
+struct zip_t *zip_open_resume(const char *zipname, int level) {
+  struct zip_t *zip = NULL;
+  MZ_FILE *file = NULL;
+  mz_uint64 file_size = 0;
+  mz_uint8 sig[4];
+
+  // Archives closed properly, or cut short before their last commit was
+  // overwritten, still have a central directory to go by.
+  zip = zip_open(zipname, level, 'a');
+  if (zip) {
+    return zip;
+  }
+
+  if (!zipname || strlen(zipname) < 1) {
+    return NULL;
+  }
+  if (level < 0)
+    level = MZ_DEFAULT_LEVEL;
+  if ((level & 0xF) > MZ_UBER_COMPRESSION) {
+    return NULL;
+  }
+
+  file = MZ_FOPEN(zipname, "r+b");
+  if (!file) {
+    return NULL;
+  }
+  zip = (struct zip_t *)calloc((size_t)1, sizeof(struct zip_t));
+  if (!zip) {
+    MZ_FCLOSE(file);
+    return NULL;
+  }
+
+  zip->level = (mz_uint)level;
+  if (!mz_zip_writer_init_cfile(&(zip->archive), file,
+                                MZ_ZIP_FLAG_WRITE_ZIP64)) {
+    MZ_FCLOSE(file);
+    CLEANUP(zip);
+    return NULL;
+  }
+  // The archive owns the file from now on and closes it with zip_close.
+  zip->archive.m_zip_type = MZ_ZIP_TYPE_FILE;
+  zip->archive.m_pRead = zip_file_pread_func;
+  zip_mutex_init(&zip->lock);
+
+  if (MZ_FSEEK64(file, 0, SEEK_END) == 0) {
+    file_size = (mz_uint64)MZ_FTELL64(file);
+  }
+  // Never take something that is not an archive for an empty one.
+  if (file_size && (zip_file_pread_func(&zip->archive, 0, sig, 4) != 4 ||
+                    MZ_READ_LE32(sig) != MZ_ZIP_LOCAL_DIR_HEADER_SIG)) {
+    goto cleanup;
+  }
+  if (zip_entries_recover(zip, file_size) < 0 || zip_commit(zip) < 0) {
+    goto cleanup;
+  }
+
+  zip_set_write_buffer(zip, ZIP_WRITE_BUFFER_SIZE);
+  return zip;
+
+cleanup:
+  mz_zip_writer_end(&(zip->archive));
+  zip_mutex_destroy(&zip->lock);
+  CLEANUP(zip->io_buf);
+  CLEANUP(zip);
+  return NULL;
+}
+
+void zip_close(struct zip_t *zip) {
+  if (zip) {
+    zip_readers_detach(zip);
+    zip_index_free(zip);
+    zip_space_free(zip);
+    CLEANUP(zip->entry.comp);
+    CLEANUP(zip->entry.sample);
+    CLEANUP(zip->io_buf);
+    CLEANUP(zip->rules);
+    if (zip->archive.m_pWrite == zip_file_write_func) {
+      // The central directory is written in one go anyway.
+      zip_set_write_buffer(zip, 0);
+    }
+
+    // Always finalize, even if adding failed for some reason, so we have a
+    // valid central directory.
+    mz_zip_writer_finalize_archive(&(zip->archive));
+    zip_archive_truncate(&(zip->archive));
+    mz_zip_writer_end(&(zip->archive));
+    mz_zip_reader_end(&(zip->archive));
+    zip_unmap_file(zip);
+    zip_mutex_destroy(&zip->lock);
+
+    CLEANUP(zip);
+  }
+}
+
+int zip_is64(struct zip_t *zip) {
+  if (!zip || !zip->archive.m_pState) {
+    // zip_t handler or zip state is not initialized
+    return ZIP_ENOINIT;
+  }
+
+  return (int)zip->archive.m_pState->m_zip64;
+}
+
+static int _zip_entry_open(struct zip_t *zip, const char *entryname,
+                           int case_sensitive, int raw_method,
+                           int entry_level, int strategy) {
+  size_t entrylen = 0;
+  mz_zip_archive *pzip = NULL;
+  mz_uint num_alignment_padding_bytes, level;
+  mz_zip_archive_file_stat stats;
+  int err = 0;
+  mz_uint16 dos_time, dos_date;
+  mz_uint32 extra_size = 0;
+  mz_uint8 extra_data[MZ_ZIP64_MAX_CENTRAL_EXTRA_FIELD_SIZE];
+  mz_uint64 local_dir_header_ofs = 0;
+
+  if (!zip) {
+    return ZIP_ENOINIT;
+  }
+
+  local_dir_header_ofs = zip->archive.m_archive_size;
+
+  if (!entryname) {
+    return ZIP_EINVENTNAME;
+  }
+
+  entrylen = strlen(entryname);
+  if (entrylen == 0) {
+    return ZIP_EINVENTNAME;
+  }
+
+  /*
+    .ZIP File Format Specification Version: 6.3.3
+
+    4.4.17.1 The name of the file, with optional relative path.
+    The path stored MUST not contain a drive or
+    device letter, or a leading slash.  All slashes
+    MUST be forward slashes '/' as opposed to
+    backwards slashes '\' for compatibility with Amiga
+    and UNIX file systems etc.  If input came from standard
+    input, there is no file name field.
+  */
+  if (zip->entry.name) {
+    CLEANUP(zip->entry.name);
+  }
+#ifdef ZIP_RAW_ENTRYNAME
+  zip->entry.name = STRCLONE(entryname);
+#else
+  zip->entry.name = zip_strrpl(entryname, entrylen, '\\', '/');
+#endif
+
+  if (!zip->entry.name) {
+    // Cannot parse zip entry name
+    return ZIP_EINVENTNAME;
+  }
+
+  pzip = &(zip->archive);
+  if (pzip->m_zip_mode == MZ_ZIP_MODE_READING) {
+    zip->entry.index = zip_index_locate(zip, zip->entry.name, case_sensitive);
+    if (zip->entry.index < (ssize_t)0) {
+      err = ZIP_ENOENT;
+      goto cleanup;
+    }
+
+    if (!mz_zip_reader_file_stat(pzip, (mz_uint)zip->entry.index, &stats)) {
+      err = ZIP_ENOENT;
+      goto cleanup;
+    }
+
+    zip->entry.comp_size = stats.m_comp_size;
+    zip->entry.uncomp_size = stats.m_uncomp_size;
+    zip->entry.uncomp_crc32 = stats.m_crc32;
+    zip->entry.offset = stats.m_central_dir_ofs;
+    zip->entry.header_offset = stats.m_local_header_ofs;
+    zip->entry.method = stats.m_method;
+    zip->entry.external_attr = stats.m_external_attr;
+#ifndef MINIZ_NO_TIME
+    zip->entry.m_time = stats.m_time;
+#endif
+
+    return 0;
+  }
+
+  // Raw entries (raw_method >= 0) are written as given, already compressed
+  // with raw_method, so never go through the compressor. The others take
+  // the archive's level unless given their own (entry_level >= 0).
+  level = raw_method >= 0  ? 0
+          : entry_level >= 0 ? (mz_uint)entry_level
+                             : zip->level & 0xF;
+
+  zip->entry.index = (ssize_t)zip->archive.m_total_files;
+  zip->entry.comp_size = 0;
+  zip->entry.uncomp_size = 0;
+  zip->entry.uncomp_crc32 = MZ_CRC32_INIT;
+  zip->entry.sample_len = 0;
+  zip->entry.offset = zip->archive.m_archive_size;
+  zip->entry.header_offset = zip->archive.m_archive_size;
+  memset(zip->entry.header, 0, MZ_ZIP_LOCAL_DIR_HEADER_SIZE * sizeof(mz_uint8));
+  zip->entry.method =
+      raw_method < 0 ? (level ? MZ_DEFLATED : 0) : (mz_uint16)raw_method;
+  zip->entry.level = level;
+  zip->entry.strategy = strategy;
+
+  // UNIX or APPLE
+#if MZ_PLATFORM == 3 || MZ_PLATFORM == 19
+  // regular file with rw-r--r-- permissions
+  zip->entry.external_attr = (mz_uint32)(0100644) << 16;
+#else
+  zip->entry.external_attr = 0;
+#endif
+
+  num_alignment_padding_bytes =
+      mz_zip_writer_compute_padding_needed_for_file_alignment(pzip);
+
+  if (!pzip->m_pState || (pzip->m_zip_mode != MZ_ZIP_MODE_WRITING)) {
+    // Invalid zip mode
+    err = ZIP_EINVMODE;
+    goto cleanup;
+  }
+  if (zip->level & MZ_ZIP_FLAG_COMPRESSED_DATA) {
+    // Invalid zip compression level
+    err = ZIP_EINVLVL;
+    goto cleanup;
+  }
+
+  if (!mz_zip_writer_write_zeros(pzip, zip->entry.offset,
+                                 num_alignment_padding_bytes)) {
+    // Cannot memset zip entry header
+    err = ZIP_EMEMSET;
+    goto cleanup;
+  }
+  local_dir_header_ofs += num_alignment_padding_bytes;
+
+  zip->entry.m_time = time(NULL);
+#ifndef MINIZ_NO_TIME
+  mz_zip_time_t_to_dos_time(zip->entry.m_time, &dos_time, &dos_date);
+#endif
+
+  // ZIP64 header with NULL sizes (sizes will be in the data descriptor, just
+  // after file data)
+  extra_size = mz_zip_writer_create_zip64_extra_data(
+      extra_data, NULL, NULL,
+      (local_dir_header_ofs >= MZ_UINT32_MAX) ? &local_dir_header_ofs : NULL);
+
+  if (!mz_zip_writer_create_local_dir_header(
+          pzip, zip->entry.header, entrylen, (mz_uint16)extra_size, 0, 0, 0,
+          zip->entry.method,
+          MZ_ZIP_GENERAL_PURPOSE_BIT_FLAG_UTF8 |
+              MZ_ZIP_LDH_BIT_FLAG_HAS_LOCATOR,
+          dos_time, dos_date)) {
+    // Cannot create zip entry header
+    err = ZIP_EMEMSET;
+    goto cleanup;
+  }
+
+  zip->entry.header_offset = zip->entry.offset + num_alignment_padding_bytes;
+
+  if (pzip->m_pWrite(pzip->m_pIO_opaque, zip->entry.header_offset,
+                     zip->entry.header,
+                     sizeof(zip->entry.header)) != sizeof(zip->entry.header)) {
+    // Cannot write zip entry header
+    err = ZIP_EMEMSET;
+    goto cleanup;
+  }
+
+  if (pzip->m_file_offset_alignment) {
+    MZ_ASSERT(
+        (zip->entry.header_offset & (pzip->m_file_offset_alignment - 1)) == 0);
+  }
+  zip->entry.offset += num_alignment_padding_bytes + sizeof(zip->entry.header);
+
+  if (pzip->m_pWrite(pzip->m_pIO_opaque, zip->entry.offset, zip->entry.name,
+                     entrylen) != entrylen) {
+    // Cannot write data to zip entry
+    err = ZIP_EWRTENT;
+    goto cleanup;
+  }
+
+  zip->entry.offset += entrylen;
+
+  if (pzip->m_pWrite(pzip->m_pIO_opaque, zip->entry.offset, extra_data,
+                     extra_size) != extra_size) {
+    // Cannot write ZIP64 data to zip entry
+    err = ZIP_EWRTENT;
+    goto cleanup;
+  }
+  zip->entry.offset += extra_size;
+
+  if (level) {
+    zip->entry.state.m_pZip = pzip;
+    zip->entry.state.m_cur_archive_file_ofs = zip->entry.offset;
+    zip->entry.state.m_comp_size = 0;
+
+    if (!zip->entry.comp) {
+      // Readers never compress, so the compressor is only allocated here and
+      // then reused by every later entry until the archive is closed.
+      zip->entry.comp = (tdefl_compressor *)malloc(sizeof(tdefl_compressor));
+      if (!zip->entry.comp) {
+        err = ZIP_EOOMEM;
+        goto cleanup;
+      }
+    }
+
+    if (tdefl_init(zip->entry.comp, mz_zip_writer_add_put_buf_callback,
+                   &(zip->entry.state),
+                   (int)tdefl_create_comp_flags_from_zip_params(
+                       (int)level, -15, strategy)) !=
+        TDEFL_STATUS_OKAY) {
+      // Cannot initialize the zip compressor
+      err = ZIP_ETDEFLINIT;
+      goto cleanup;
+    }
+  }
+
+  return 0;
+
+cleanup:
+  CLEANUP(zip->entry.name);
+  return err;
+}
+
+int zip_entry_open(struct zip_t *zip, const char *entryname) {
+  return _zip_entry_open(zip, entryname, 0, -1, -1, MZ_DEFAULT_STRATEGY);
+}
+
+int zip_entry_opencasesensitive(struct zip_t *zip, const char *entryname) {
+  return _zip_entry_open(zip, entryname, 1, -1, -1, MZ_DEFAULT_STRATEGY);
+}
+
+int zip_entry_open_level(struct zip_t *zip, const char *entryname, int level,
+                         int strategy) {
+  if (level > MZ_UBER_COMPRESSION || strategy < ZIP_STRATEGY_DEFAULT ||
+      strategy > ZIP_STRATEGY_FIXED) {
+    // Invalid zip compression level
+    return ZIP_EINVLVL;
+  }
+  return _zip_entry_open(zip, entryname, 0, -1, level, strategy);
+}
+
+int zip_entry_openbyindex(struct zip_t *zip, size_t index) {
+  mz_zip_archive *pZip = NULL;
+  mz_zip_archive_file_stat stats;
+  mz_uint namelen;
+  const mz_uint8 *pHeader;
+  const char *pFilename;
+
+  if (!zip) {
+    // zip_t handler is not initialized
+    return ZIP_ENOINIT;
+  }
+
+  pZip = &(zip->archive);
+  if (pZip->m_zip_mode != MZ_ZIP_MODE_READING) {
+    // open by index requires readonly mode
+    return ZIP_EINVMODE;
+  }
+
+  if (index >= (size_t)pZip->m_total_files) {
+    // index out of range
+    return ZIP_EINVIDX;
+  }
+
+  if (!(pHeader = &MZ_ZIP_ARRAY_ELEMENT(
+            &pZip->m_pState->m_central_dir, mz_uint8,
+            MZ_ZIP_ARRAY_ELEMENT(&pZip->m_pState->m_central_dir_offsets,
+                                 mz_uint32, index)))) {
+    // cannot find header in central directory
+    return ZIP_ENOHDR;
+  }
+
+  namelen = MZ_READ_LE16(pHeader + MZ_ZIP_CDH_FILENAME_LEN_OFS);
+  pFilename = (const char *)pHeader + MZ_ZIP_CENTRAL_DIR_HEADER_SIZE;
+
+  /*
+    .ZIP File Format Specification Version: 6.3.3
+
+    4.4.17.1 The name of the file, with optional relative path.
+    The path stored MUST not contain a drive or
+    device letter, or a leading slash.  All slashes
+    MUST be forward slashes '/' as opposed to
+    backwards slashes '\' for compatibility with Amiga
+    and UNIX file systems etc.  If input came from standard
+    input, there is no file name field.
+  */
+  if (zip->entry.name) {
+    CLEANUP(zip->entry.name);
+  }
+#ifdef ZIP_RAW_ENTRYNAME
+  zip->entry.name = STRCLONE(pFilename);
+#else
+  zip->entry.name = zip_strrpl(pFilename, namelen, '\\', '/');
+#endif
+
+  if (!zip->entry.name) {
+    // local entry name is NULL
+    return ZIP_EINVENTNAME;
+  }
+
+  if (!mz_zip_reader_file_stat(pZip, (mz_uint)index, &stats)) {
+    return ZIP_ENOENT;
+  }
+
+  zip->entry.index = (ssize_t)index;
   zip->entry.comp_size = stats.m_comp_size;
   zip->entry.uncomp_size = stats.m_uncomp_size;
   zip->entry.uncomp_crc32 = stats.m_crc32;
@@ -1185,422 +2701,2298 @@ int zip_entry_openbyindex(struct zip_t *zip, size_t index) {
   zip->entry.m_time = stats.m_time;
 #endif
 
-  return 0;
+  return 0;
+}
+
+static int zip_entry_sample_flush(struct zip_t *zip);
+
+// Closes the entry being written, without committing the archive.
+static int zip_entry_finish(struct zip_t *zip) {
+  mz_zip_archive *pzip = NULL;
+  mz_uint level;
+  tdefl_status done;
+  mz_uint16 entrylen;
+  mz_uint16 dos_time = 0, dos_date = 0;
+  int err = 0;
+  mz_uint8 *pExtra_data = NULL;
+  mz_uint32 extra_size = 0;
+  mz_uint8 extra_data[MZ_ZIP64_MAX_CENTRAL_EXTRA_FIELD_SIZE];
+  mz_uint8 local_dir_footer[MZ_ZIP_DATA_DESCRIPTER_SIZE64];
+  mz_uint32 local_dir_footer_size = MZ_ZIP_DATA_DESCRIPTER_SIZE64;
+
+  if (!zip) {
+    // zip_t handler is not initialized
+    err = ZIP_ENOINIT;
+    goto cleanup;
+  }
+
+  pzip = &(zip->archive);
+  if (pzip->m_zip_mode == MZ_ZIP_MODE_READING) {
+    goto cleanup;
+  }
+
+  if ((err = zip_entry_sample_flush(zip)) < 0) {
+    goto cleanup;
+  }
+  level = zip->entry.level;
+  if (level) {
+    done = tdefl_compress_buffer(zip->entry.comp, "", 0, TDEFL_FINISH);
+    if (done != TDEFL_STATUS_DONE && done != TDEFL_STATUS_OKAY) {
+      // Cannot flush compressed buffer
+      err = ZIP_ETDEFLBUF;
+      goto cleanup;
+    }
+    zip->entry.comp_size = zip->entry.state.m_comp_size;
+    zip->entry.offset = zip->entry.state.m_cur_archive_file_ofs;
+    zip->entry.method = MZ_DEFLATED;
+  }
+
+  entrylen = (mz_uint16)strlen(zip->entry.name);
+#ifndef MINIZ_NO_TIME
+  mz_zip_time_t_to_dos_time(zip->entry.m_time, &dos_time, &dos_date);
+#endif
+
+  MZ_WRITE_LE32(local_dir_footer + 0, MZ_ZIP_DATA_DESCRIPTOR_ID);
+  MZ_WRITE_LE32(local_dir_footer + 4, zip->entry.uncomp_crc32);
+  MZ_WRITE_LE64(local_dir_footer + 8, zip->entry.comp_size);
+  MZ_WRITE_LE64(local_dir_footer + 16, zip->entry.uncomp_size);
+
+  if (pzip->m_pWrite(pzip->m_pIO_opaque, zip->entry.offset, local_dir_footer,
+                     local_dir_footer_size) != local_dir_footer_size) {
+    // Cannot write zip entry header
+    err = ZIP_EWRTHDR;
+    goto cleanup;
+  }
+  zip->entry.offset += local_dir_footer_size;
+
+  pExtra_data = extra_data;
+  extra_size = mz_zip_writer_create_zip64_extra_data(
+      extra_data,
+      (zip->entry.uncomp_size >= MZ_UINT32_MAX) ? &zip->entry.uncomp_size
+                                                : NULL,
+      (zip->entry.comp_size >= MZ_UINT32_MAX) ? &zip->entry.comp_size : NULL,
+      (zip->entry.header_offset >= MZ_UINT32_MAX) ? &zip->entry.header_offset
+                                                  : NULL);
+
+  if ((entrylen) && (zip->entry.name[entrylen - 1] == '/') &&
+      !zip->entry.uncomp_size) {
+    /* Set DOS Subdirectory attribute bit. */
+    zip->entry.external_attr |= MZ_ZIP_DOS_DIR_ATTRIBUTE_BITFLAG;
+  }
+
+  if (!mz_zip_writer_add_to_central_dir(
+          pzip, zip->entry.name, entrylen, pExtra_data, (mz_uint16)extra_size,
+          "", 0, zip->entry.uncomp_size, zip->entry.comp_size,
+          zip->entry.uncomp_crc32, zip->entry.method,
+          MZ_ZIP_GENERAL_PURPOSE_BIT_FLAG_UTF8 |
+              MZ_ZIP_LDH_BIT_FLAG_HAS_LOCATOR,
+          dos_time, dos_date, zip->entry.header_offset,
+          zip->entry.external_attr, NULL, 0)) {
+    // Cannot write to zip central dir
+    err = ZIP_EWRTDIR;
+    goto cleanup;
+  }
+
+  pzip->m_total_files++;
+  pzip->m_archive_size = zip->entry.offset;
+
+cleanup:
+  if (zip) {
+    zip->entry.m_time = 0;
+    CLEANUP(zip->entry.name);
+  }
+  return err;
+}
+
+/*
+ * Drops the entry being written after a failed write. Nothing of it is
+ * recorded and the archive ends where the entry started, whatever part of
+ * it reached the file is overwritten or cut off later.
+ */
+static void zip_entry_abort(struct zip_t *zip) {
+  mz_uint64 start = zip->entry.header_offset;
+
+  if (zip->wbuf_len && zip->wbuf_ofs + zip->wbuf_len > start) {
+    zip->wbuf_len = start > zip->wbuf_ofs ? (size_t)(start - zip->wbuf_ofs) : 0;
+  }
+  zip->archive.m_archive_size = start;
+  zip->entry.sample_len = 0;
+  zip->entry.m_time = 0;
+  CLEANUP(zip->entry.name);
+}
+
+int zip_entry_close(struct zip_t *zip) {
+  int err = zip_entry_finish(zip);
+
+  if (err == 0 && zip->archive.m_zip_mode == MZ_ZIP_MODE_WRITING) {
+    err = zip_autocommit(zip);
+  }
+  return err;
+}
+
+const char *zip_entry_name(struct zip_t *zip) {
+  if (!zip) {
+    // zip_t handler is not initialized
+    return NULL;
+  }
+
+  return zip->entry.name;
+}
+
+ssize_t zip_entry_index(struct zip_t *zip) {
+  if (!zip) {
+    // zip_t handler is not initialized
+    return (ssize_t)ZIP_ENOINIT;
+  }
+
+  return zip->entry.index;
+}
+
+int zip_entry_isdir(struct zip_t *zip) {
+  if (!zip) {
+    // zip_t handler is not initialized
+    return ZIP_ENOINIT;
+  }
+
+  if (zip->entry.index < (ssize_t)0) {
+    // zip entry is not opened
+    return ZIP_EINVIDX;
+  }
+
+  return (int)mz_zip_reader_is_file_a_directory(&zip->archive,
+                                                (mz_uint)zip->entry.index);
+}
+
+unsigned long long zip_entry_size(struct zip_t *zip) {
+  return zip_entry_uncomp_size(zip);
+}
+
+unsigned long long zip_entry_uncomp_size(struct zip_t *zip) {
+  return zip ? zip->entry.uncomp_size : 0;
+}
+
+unsigned long long zip_entry_comp_size(struct zip_t *zip) {
+  return zip ? zip->entry.comp_size : 0;
+}
+
+unsigned int zip_entry_crc32(struct zip_t *zip) {
+  return zip ? zip->entry.uncomp_crc32 : 0;
+}
+
+static int zip_entry_write_data(struct zip_t *zip, const void *buf,
+                                size_t bufsize) {
+  mz_zip_archive *pzip = &(zip->archive);
+
+  if ((pzip->m_pWrite(pzip->m_pIO_opaque, zip->entry.offset, buf, bufsize) !=
+       bufsize)) {
+    // Cannot write buffer
+    return ZIP_EWRTENT;
+  }
+  zip->entry.offset += bufsize;
+  zip->entry.comp_size += bufsize;
+  return 0;
+}
+
+/*
+ * Entries are sampled over their first ZIP_PROBE_SIZE bytes to tell whether
+ * deflating them pays, see zip_set_store_threshold. Shorter samples cost
+ * little to deflate whatever they hold and are not looked at.
+ */
+#define ZIP_PROBE_SIZE (64 * 1024)
+#define ZIP_PROBE_MIN (4 * 1024)
+
+// log2(x) for x >= 1, in 16.16 fixed point.
+static mz_uint32 zip_log2_fixed(mz_uint32 x) {
+  mz_uint32 result = 0, bit;
+  mz_uint64 y = x;
+
+  while (y >= 2) {
+    y >>= 1;
+    result += 1 << 16;
+  }
+  // Square the mantissa, in 2.30 fixed point, once per fractional bit.
+  y = ((mz_uint64)x << 30) >> (result >> 16);
+  for (bit = 1 << 15; bit; bit >>= 1) {
+    y = (y * y) >> 30;
+    if (y >= (mz_uint64)2 << 30) {
+      y >>= 1;
+      result |= bit;
+    }
+  }
+  return result;
+}
+
+static mz_bool zip_probe_put(const void *buf, int len, void *user) {
+  (void)buf;
+  *(size_t *)user += (size_t)len;
+  return MZ_TRUE;
+}
+
+/*
+ * Tells whether deflating data would save less than percent of it, judging
+ * by a sample of its start. Bytes spread evenly over all values are
+ * deflated at level 1 to find out, anything else is taken to compress.
+ * comp is left in an undefined state.
+ */
+static mz_bool zip_probe_incompressible(tdefl_compressor *comp,
+                                        const mz_uint8 *buf, size_t len,
+                                        int percent) {
+  mz_uint32 counts[256];
+  mz_uint64 bits;
+  size_t i, out = 0;
+
+  len = MZ_MIN(len, (size_t)ZIP_PROBE_SIZE);
+  if (len < ZIP_PROBE_MIN) {
+    return MZ_FALSE;
+  }
+
+  // Order-0 entropy of the sample, times its length.
+  memset(counts, 0, sizeof(counts));
+  for (i = 0; i < len; ++i) {
+    counts[buf[i]]++;
+  }
+  bits = (mz_uint64)len * zip_log2_fixed((mz_uint32)len);
+  for (i = 0; i < 256; ++i) {
+    if (counts[i]) {
+      bits -= (mz_uint64)counts[i] * zip_log2_fixed(counts[i]);
+    }
+  }
+  // Under 7.5 bits a byte, Huffman coding alone saves enough.
+  if (bits < (mz_uint64)len * (15 << 15)) {
+    return MZ_FALSE;
+  }
+
+  if (tdefl_init(comp, zip_probe_put, &out,
+                 (int)tdefl_create_comp_flags_from_zip_params(
+                     1, -15, MZ_DEFAULT_STRATEGY)) != TDEFL_STATUS_OKAY ||
+      tdefl_compress_buffer(comp, buf, len, TDEFL_FINISH) !=
+          TDEFL_STATUS_DONE) {
+    return MZ_FALSE;
+  }
+  return (mz_uint64)out * 100 > (mz_uint64)len * (mz_uint64)(100 - percent);
+}
+
+static int zip_store_threshold(struct zip_t *zip) {
+  return zip->store_threshold ? zip->store_threshold : ZIP_STORE_THRESHOLD;
+}
+
+/*
+ * Turns the entry being written, which holds no data yet, into a stored one
+ * by rewriting the method in its local header. The header is usually still
+ * in the write buffer.
+ */
+static int zip_entry_store(struct zip_t *zip) {
+  mz_zip_archive *pzip = &(zip->archive);
+  mz_uint64 ofs = zip->entry.header_offset;
+  size_t size = sizeof(zip->entry.header);
+
+  zip->entry.level = 0;
+  zip->entry.method = 0;
+  MZ_WRITE_LE16(zip->entry.header + MZ_ZIP_LDH_VERSION_NEEDED_OFS, 0);
+  MZ_WRITE_LE16(zip->entry.header + MZ_ZIP_LDH_METHOD_OFS, 0);
+
+  if (zip->wbuf_len && ofs >= zip->wbuf_ofs &&
+      ofs + size <= zip->wbuf_ofs + zip->wbuf_len) {
+    memcpy(zip->wbuf + (size_t)(ofs - zip->wbuf_ofs), zip->entry.header, size);
+    return 0;
+  }
+  if (pzip->m_pWrite(pzip->m_pIO_opaque, ofs, zip->entry.header, size) !=
+      size) {
+    return ZIP_EWRTHDR;
+  }
+  return 0;
+}
+
+/*
+ * Looks at the first data written to a freshly opened, deflated entry and
+ * stores the entry instead if deflating would not pay. Returns 1 if it did.
+ */
+static int zip_entry_probe(struct zip_t *zip, const mz_uint8 *buf,
+                           size_t len) {
+  int percent = zip_store_threshold(zip);
+  int err = 0;
+
+  if (percent < 0 || len < ZIP_PROBE_MIN) {
+    return 0;
+  }
+  if (zip_probe_incompressible(zip->entry.comp, buf, len, percent)) {
+    return (err = zip_entry_store(zip)) < 0 ? err : 1;
+  }
+
+  // The trial left the compressor to be set up again for the entry.
+  if (tdefl_init(zip->entry.comp, mz_zip_writer_add_put_buf_callback,
+                 &(zip->entry.state),
+                 (int)tdefl_create_comp_flags_from_zip_params(
+                     (int)zip->entry.level, -15, zip->entry.strategy)) !=
+      TDEFL_STATUS_OKAY) {
+    return ZIP_ETDEFLINIT;
+  }
+  return 0;
+}
+
+// Deflates or stores data of the entry being written, as it is set up to.
+static int zip_entry_put(struct zip_t *zip, const mz_uint8 *buf,
+                         size_t bufsize) {
+  tdefl_status status;
+
+  if (!zip->entry.level) {
+    return zip_entry_write_data(zip, buf, bufsize);
+  }
+  status = tdefl_compress_buffer(zip->entry.comp, buf, bufsize, TDEFL_NO_FLUSH);
+  if (status != TDEFL_STATUS_DONE && status != TDEFL_STATUS_OKAY) {
+    // Cannot compress buffer
+    return ZIP_ETDEFLBUF;
+  }
+  return 0;
+}
+
+// Probes and writes out what zip_entry_sample held back.
+static int zip_entry_sample_flush(struct zip_t *zip) {
+  size_t len = zip->entry.sample_len;
+  int err = 0;
+
+  if (!len) {
+    return 0;
+  }
+  zip->entry.sample_len = 0;
+  if ((err = zip_entry_probe(zip, zip->entry.sample, len)) < 0) {
+    return err;
+  }
+  return zip_entry_put(zip, zip->entry.sample, len);
+}
+
+/*
+ * Holds back the first data written to a deflated entry until there is
+ * ZIP_PROBE_SIZE of it, or the entry is closed, so that an entry written in
+ * small pieces is probed the same as one written in one go.
+ */
+static int zip_entry_sample(struct zip_t *zip, const mz_uint8 *buf,
+                            size_t bufsize) {
+  size_t n = 0;
+  int err = 0;
+
+  if (!zip->entry.sample_len && bufsize >= ZIP_PROBE_SIZE) {
+    if ((err = zip_entry_probe(zip, buf, bufsize)) < 0) {
+      return err;
+    }
+    return zip_entry_put(zip, buf, bufsize);
+  }
+
+  if (!zip->entry.sample &&
+      !(zip->entry.sample = (mz_uint8 *)malloc(ZIP_PROBE_SIZE))) {
+    return ZIP_EOOMEM;
+  }
+  n = MZ_MIN(bufsize, ZIP_PROBE_SIZE - zip->entry.sample_len);
+  memcpy(zip->entry.sample + zip->entry.sample_len, buf, n);
+  zip->entry.sample_len += n;
+  if (zip->entry.sample_len < ZIP_PROBE_SIZE) {
+    return 0;
+  }
+  if ((err = zip_entry_sample_flush(zip)) < 0) {
+    return err;
+  }
+  return n < bufsize ? zip_entry_put(zip, buf + n, bufsize - n) : 0;
+}
+
+int zip_entry_write(struct zip_t *zip, const void *buf, size_t bufsize) {
+  mz_bool sampling;
+
+  if (!zip) {
+    // zip_t handler is not initialized
+    return ZIP_ENOINIT;
+  }
+
+  if (buf && bufsize > 0) {
+    sampling = zip->entry.level &&
+               zip->archive.m_zip_mode == MZ_ZIP_MODE_WRITING &&
+               (!zip->entry.uncomp_size || zip->entry.sample_len) &&
+               zip_store_threshold(zip) >= 0;
+    zip->entry.uncomp_size += bufsize;
+    zip->entry.uncomp_crc32 = (mz_uint32)mz_crc32(
+        zip->entry.uncomp_crc32, (const mz_uint8 *)buf, bufsize);
+
+    if (sampling) {
+      return zip_entry_sample(zip, (const mz_uint8 *)buf, bufsize);
+    }
+    return zip_entry_put(zip, (const mz_uint8 *)buf, bufsize);
+  }
+
+  return 0;
+}
+
+int zip_entry_write_raw(struct zip_t *zip, const char *entryname,
+                        const void *buf, size_t bufsize, uint32_t crc32,
+                        unsigned long long uncomp_size) {
+  int err = 0;
+
+  if (!zip) {
+    // zip_t handler is not initialized
+    return ZIP_ENOINIT;
+  }
+
+  if (zip->archive.m_zip_mode != MZ_ZIP_MODE_WRITING) {
+    // Invalid zip mode
+    return ZIP_EINVMODE;
+  }
+
+  if ((err = _zip_entry_open(zip, entryname, 0, MZ_DEFLATED, -1,
+                             MZ_DEFAULT_STRATEGY)) < 0) {
+    return err;
+  }
+
+  if (buf && bufsize > 0) {
+    err = zip_entry_write_data(zip, buf, bufsize);
+  }
+
+  if (err < 0) {
+    // Part of the data is missing, so the entry is dropped rather than
+    // recorded with the caller's checksum and size.
+    zip_entry_abort(zip);
+    return err;
+  }
+
+  zip->entry.uncomp_crc32 = crc32;
+  zip->entry.uncomp_size = uncomp_size;
+
+  return zip_entry_close(zip);
+}
+
+// Appends size bytes of src, starting at ofs, to the current entry of zip.
+static int zip_entry_copy_data(struct zip_t *zip, mz_zip_archive *src,
+                               mz_uint64 ofs, mz_uint64 size) {
+  mz_zip_archive *pzip = &(zip->archive);
+  mz_uint8 *buf = NULL;
+  size_t n = 0, bufsize = 0;
+  int err = 0;
+
+  if (src->m_pState->m_pMem && size <= (size_t)-1) {
+    return zip_entry_write_data(
+        zip, (const mz_uint8 *)src->m_pState->m_pMem + ofs, (size_t)size);
+  }
+
+#if defined(__linux__) && defined(SYS_copy_file_range)
+  // Between two files let the kernel move the bytes, possibly sharing extents
+  // on filesystems which support it.
+  if (src->m_pState->m_pFile && pzip->m_zip_type == MZ_ZIP_TYPE_FILE &&
+      pzip->m_pState->m_pFile) {
+    long long in = (long long)ofs, out = (long long)zip->entry.offset;
+    long r = 0;
+
+    // Everything before out must have reached the file.
+    if ((err = zip_write_buffer_flush(zip)) < 0 ||
+        fflush(pzip->m_pState->m_pFile)) {
+      return err < 0 ? err : ZIP_EFWRITE;
+    }
+    while (size > 0) {
+      r = syscall(SYS_copy_file_range, fileno(src->m_pState->m_pFile), &in,
+                  fileno(pzip->m_pState->m_pFile), &out,
+                  (size_t)MZ_MIN(size, (mz_uint64)1 << 30), 0u);
+      if (r < 0 && errno == EINTR) {
+        continue;
+      }
+      if (r <= 0) {
+        // Not supported here (e.g. across filesystems on older kernels), the
+        // rest is copied below.
+        break;
+      }
+      zip->entry.offset += (mz_uint64)r;
+      zip->entry.comp_size += (mz_uint64)r;
+      ofs += (mz_uint64)r;
+      size -= (mz_uint64)r;
+    }
+  }
+#endif
+
+  if (size > 0 && !(buf = zip_io_buffer(zip, &bufsize))) {
+    return ZIP_EOOMEM;
+  }
+  // Nothing is inflated, both halves of the buffer hold copied bytes.
+  bufsize *= 2;
+  while (size > 0) {
+    n = (size_t)MZ_MIN(size, (mz_uint64)bufsize);
+    if (src->m_pRead(src->m_pIO_opaque, ofs, buf, n) != n) {
+      err = ZIP_EFREAD;
+      break;
+    }
+    if ((err = zip_entry_write_data(zip, buf, n)) < 0) {
+      break;
+    }
+    ofs += n;
+    size -= n;
+  }
+  return err;
+}
+
+int zip_entry_copy(struct zip_t *zip, struct zip_t *src, size_t index,
+                   const char *entryname) {
+  mz_zip_archive *pzip = NULL;
+  mz_zip_archive_file_stat stats;
+  mz_uint64 data_ofs = 0;
+  const char *name = NULL;
+  char *srcname = NULL;
+  size_t len = 0;
+  int err = 0;
+
+  if (!zip || !src) {
+    // zip_t handler is not initialized
+    return ZIP_ENOINIT;
+  }
+
+  pzip = &(src->archive);
+  if (zip->archive.m_zip_mode != MZ_ZIP_MODE_WRITING ||
+      pzip->m_zip_mode != MZ_ZIP_MODE_READING) {
+    // Invalid zip mode
+    return ZIP_EINVMODE;
+  }
+
+  if (index >= (size_t)pzip->m_total_files) {
+    // Invalid index
+    return ZIP_EINVIDX;
+  }
+
+  if (!mz_zip_reader_file_stat(pzip, (mz_uint)index, &stats)) {
+    return ZIP_ENOENT;
+  }
+
+  if (stats.m_is_encrypted || !stats.m_is_supported ||
+      (stats.m_method != 0 && stats.m_method != MZ_DEFLATED)) {
+    // Only entries this library could have written are copied
+    return ZIP_EINVENTTYPE;
+  }
+
+  if ((err = zip_entry_data_offset(pzip, &stats, &data_ofs)) < 0) {
+    return err;
+  }
+
+  if (!entryname) {
+    // The central directory name is not NUL terminated, nor length limited.
+    name = zip_index_name(pzip, (mz_uint)index, &len);
+    if (!(srcname = (char *)malloc(len + 1))) {
+      return ZIP_EOOMEM;
+    }
+    memcpy(srcname, name, len);
+    srcname[len] = '\0';
+    entryname = srcname;
+  }
+
+  err = _zip_entry_open(zip, entryname, 0, (int)stats.m_method, -1,
+                        MZ_DEFAULT_STRATEGY);
+  CLEANUP(srcname);
+  if (err < 0) {
+    return err;
+  }
+
+  zip->entry.external_attr = stats.m_external_attr;
+#ifndef MINIZ_NO_TIME
+  zip->entry.m_time = stats.m_time;
+#endif
+
+  if ((err = zip_entry_copy_data(zip, pzip, data_ofs, stats.m_comp_size)) <
+      0) {
+    // A partial copy must not be recorded with the source's checksum.
+    zip_entry_abort(zip);
+    return err;
+  }
+
+  zip->entry.uncomp_crc32 = stats.m_crc32;
+  zip->entry.uncomp_size = stats.m_uncomp_size;
+
+  return zip_entry_close(zip);
+}
+
+static int zip_file_stat(const char *filename, mz_uint32 *external_attr,
+                         time_t *m_time) {
+  struct MZ_FILE_STAT_STRUCT file_stat;
+  mz_uint16 modes;
+
+  memset((void *)&file_stat, 0, sizeof(struct MZ_FILE_STAT_STRUCT));
+  if (MZ_FILE_STAT(filename, &file_stat) != 0) {
+    // problem getting information - check errno
+    return ZIP_ENOENT;
+  }
+
+#if defined(_WIN32) || defined(__WIN32__) || defined(DJGPP)
+  (void)modes;         // unused
+  (void)external_attr; // unused
+#else
+  /* Initialize with permission bits--which are not implementation-optional */
+  modes = file_stat.st_mode &
+          (S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | S_ISGID | S_ISVTX);
+  if (S_ISDIR(file_stat.st_mode))
+    modes |= UNX_IFDIR;
+  if (S_ISREG(file_stat.st_mode))
+    modes |= UNX_IFREG;
+  if (S_ISLNK(file_stat.st_mode))
+    modes |= UNX_IFLNK;
+  if (S_ISBLK(file_stat.st_mode))
+    modes |= UNX_IFBLK;
+  if (S_ISCHR(file_stat.st_mode))
+    modes |= UNX_IFCHR;
+  if (S_ISFIFO(file_stat.st_mode))
+    modes |= UNX_IFIFO;
+  if (S_ISSOCK(file_stat.st_mode))
+    modes |= UNX_IFSOCK;
+  *external_attr = (modes << 16) | !(file_stat.st_mode & S_IWUSR);
+  if ((file_stat.st_mode & S_IFMT) == S_IFDIR) {
+    *external_attr |= MZ_ZIP_DOS_DIR_ATTRIBUTE_BITFLAG;
+  }
+#endif
+
+  *m_time = file_stat.st_mtime;
+  return 0;
+}
+
+int zip_entry_fwrite(struct zip_t *zip, const char *filename) {
+  int err = 0;
+  size_t n = 0, bufsize = 0;
+  MZ_FILE *stream = NULL;
+  mz_uint8 *buf = NULL;
+
+  if (!zip) {
+    // zip_t handler is not initialized
+    return ZIP_ENOINIT;
+  }
+
+  err = zip_file_stat(filename, &zip->entry.external_attr, &zip->entry.m_time);
+  if (err < 0) {
+    return err;
+  }
+
+  if (!(buf = zip_io_buffer(zip, &bufsize))) {
+    return ZIP_EOOMEM;
+  }
+
+  if (!(stream = MZ_FOPEN(filename, "rb"))) {
+    // Cannot open filename
+    return ZIP_EOPNFILE;
+  }
+  zip_file_advise(stream);
+
+  while ((n = fread(buf, sizeof(mz_uint8), bufsize, stream)) > 0) {
+    if (zip_entry_write(zip, buf, n) < 0) {
+      err = ZIP_EWRTENT;
+      break;
+    }
+  }
+  fclose(stream);
+
+  return err;
+}
+
+static int zip_glob_char(char c) {
+  if (c == '\\') {
+    return '/';
+  }
+  return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+/*
+ * Matches a name against a glob where '*' stands for any run of characters
+ * and '?' for one, ignoring case.
+ */
+static mz_bool zip_glob_match(const char *pattern, const char *name) {
+  const char *star = NULL, *retry = NULL;
+
+  while (*name) {
+    if (*pattern == '*') {
+      star = ++pattern;
+      retry = name;
+    } else if (*pattern &&
+               (*pattern == '?' ||
+                zip_glob_char(*pattern) == zip_glob_char(*name))) {
+      ++pattern;
+      ++name;
+    } else if (star) {
+      // Let the last star swallow one more character.
+      pattern = star;
+      name = ++retry;
+    } else {
+      return MZ_FALSE;
+    }
+  }
+  while (*pattern == '*') {
+    ++pattern;
+  }
+  return !*pattern;
+}
+
+/*
+ * Finds the first rule of a policy a file falls under, see zip_set_policy.
+ * Patterns without a slash are matched against the file's base name.
+ */
+static const struct zip_rule_t *zip_rule_find(const struct zip_rule_t *rules,
+                                              size_t len,
+                                              const char *filename) {
+  struct MZ_FILE_STAT_STRUCT file_stat;
+  const char *base = filename, *p = NULL;
+  mz_bool has_size = MZ_FALSE, sized = MZ_FALSE;
+  mz_uint64 size = 0;
+  size_t i;
+
+  for (p = filename; *p; ++p) {
+    if (*p == '/' || *p == '\\') {
+      base = p + 1;
+    }
+  }
+
+  for (i = 0; i < len; ++i) {
+    if (rules[i].pattern &&
+        !zip_glob_match(rules[i].pattern,
+                        strpbrk(rules[i].pattern, "/\\") ? filename : base)) {
+      continue;
+    }
+    if (rules[i].min_size || rules[i].max_size) {
+      // Only stat the file once a rule depends on its size.
+      if (!sized) {
+        sized = MZ_TRUE;
+        memset((void *)&file_stat, 0, sizeof(struct MZ_FILE_STAT_STRUCT));
+        if (MZ_FILE_STAT(filename, &file_stat) == 0) {
+          has_size = MZ_TRUE;
+          size = (mz_uint64)file_stat.st_size;
+        }
+      }
+      if (!has_size || size < rules[i].min_size ||
+          (rules[i].max_size && size > rules[i].max_size)) {
+        continue;
+      }
+    }
+    return &rules[i];
+  }
+  return NULL;
+}
+
+/*
+ * Opens a new entry compressed the way a rule says, or the archive's way
+ * without one.
+ */
+static int zip_entry_open_rule(struct zip_t *zip, const char *entryname,
+                               const struct zip_rule_t *rule) {
+  if (!rule) {
+    return zip_entry_open(zip, entryname);
+  }
+  return _zip_entry_open(zip, entryname, 0, -1, rule->level, rule->strategy);
+}
+
+/*
+ * Output of a file compressed away from the archive. The compressed bytes
+ * are kept in memory and spilled to a temporary file once they outgrow
+ * ZIP_SPILL_SIZE.
+ */
+#define ZIP_SPILL_SIZE (32 * 1024 * 1024)
+
+struct zip_deflate_job_t {
+  const char *filename;
+  int err;
+  mz_bool has_stat;
+  mz_bool has_data;
+  mz_uint32 external_attr;
+  time_t m_time;
+  mz_uint64 uncomp_size;
+  mz_uint32 uncomp_crc32;
+  mz_uint8 *data;
+  size_t size;
+  size_t capacity;
+  size_t bufsize; // size of the reads, data grows by at least as much
+  MZ_FILE *spill;
+  mz_bool stored; // found not worth deflating, see zip_probe_incompressible
+  const struct zip_rule_t *rule; // how to compress it, see zip_set_policy
+  mz_bool done;
+};
+
+struct zip_deflate_pool_t {
+  zip_mutex_t mutex;
+  zip_cond_t cond;
+  struct zip_deflate_job_t *jobs;
+  size_t len;
+  size_t next;
+  size_t committed;
+  size_t window;
+  mz_uint level;
+  int store_threshold;
+  size_t bufsize; // of each worker's reads, see zip_set_io_buffer
+  const struct zip_rule_t *rules;
+  size_t rules_len;
+};
+
+static mz_bool zip_deflate_job_put(const void *buf, int len, void *user) {
+  struct zip_deflate_job_t *job = (struct zip_deflate_job_t *)user;
+  size_t n = (size_t)len;
+
+  if (job->spill) {
+    return fwrite(buf, 1, n, job->spill) == n;
+  }
+
+  if (job->size + n > ZIP_SPILL_SIZE) {
+    // Too big to keep in memory, move everything to a temporary file
+    if (!(job->spill = tmpfile())) {
+      return MZ_FALSE;
+    }
+    if (fwrite(job->data, 1, job->size, job->spill) != job->size) {
+      return MZ_FALSE;
+    }
+    CLEANUP(job->data);
+    job->size = job->capacity = 0;
+    return fwrite(buf, 1, n, job->spill) == n;
+  }
+
+  if (job->size + n > job->capacity) {
+    size_t capacity = MZ_MAX(job->capacity, job->bufsize);
+    mz_uint8 *data = NULL;
+    while (capacity < job->size + n) {
+      capacity *= 2;
+    }
+    if (!(data = (mz_uint8 *)realloc(job->data, capacity))) {
+      return MZ_FALSE;
+    }
+    job->data = data;
+    job->capacity = capacity;
+  }
+  memcpy(job->data + job->size, buf, n);
+  job->size += n;
+  return MZ_TRUE;
+}
+
+static void zip_deflate_job_run(struct zip_deflate_job_t *job, mz_uint level,
+                                int strategy, int store_threshold,
+                                tdefl_compressor *comp, mz_uint8 *buf,
+                                size_t bufsize) {
+  size_t n = 0;
+  MZ_FILE *stream = NULL;
+  tdefl_status status;
+
+  job->uncomp_crc32 = MZ_CRC32_INIT;
+  if ((job->err = zip_file_stat(job->filename, &job->external_attr,
+                                &job->m_time)) < 0) {
+    return;
+  }
+  job->has_stat = MZ_TRUE;
+
+  if (!(stream = MZ_FOPEN(job->filename, "rb"))) {
+    // Cannot open filename
+    job->err = ZIP_EOPNFILE;
+    return;
+  }
+  zip_file_advise(stream);
+  job->bufsize = bufsize;
+
+  n = fread(buf, sizeof(mz_uint8), bufsize, stream);
+  if (level && store_threshold >= 0 &&
+      zip_probe_incompressible(comp, buf, n, store_threshold)) {
+    level = 0;
+    job->stored = MZ_TRUE;
+  }
+
+  if (level &&
+      tdefl_init(comp, zip_deflate_job_put, job,
+                 (int)tdefl_create_comp_flags_from_zip_params(
+                     (int)level, -15, strategy)) !=
+          TDEFL_STATUS_OKAY) {
+    // Cannot initialize the zip compressor
+    job->err = ZIP_ETDEFLINIT;
+    fclose(stream);
+    return;
+  }
+
+  for (; n > 0; n = fread(buf, sizeof(mz_uint8), bufsize, stream)) {
+    job->uncomp_size += n;
+    job->uncomp_crc32 =
+        (mz_uint32)mz_crc32(job->uncomp_crc32, (const mz_uint8 *)buf, n);
+    if (!level) {
+      if (!zip_deflate_job_put(buf, (int)n, job)) {
+        job->err = ZIP_EWRTENT;
+        break;
+      }
+    } else {
+      status = tdefl_compress_buffer(comp, buf, n, TDEFL_NO_FLUSH);
+      if (status != TDEFL_STATUS_DONE && status != TDEFL_STATUS_OKAY) {
+        job->err = ZIP_EWRTENT;
+        break;
+      }
+    }
+  }
+  fclose(stream);
+
+  if (!job->err && level) {
+    status = tdefl_compress_buffer(comp, "", 0, TDEFL_FINISH);
+    if (status != TDEFL_STATUS_DONE && status != TDEFL_STATUS_OKAY) {
+      // Cannot flush compressed buffer
+      job->err = ZIP_ETDEFLBUF;
+    }
+  }
+  job->has_data = !job->err;
+}
+
+static void zip_deflate_job_free(struct zip_deflate_job_t *job) {
+  CLEANUP(job->data);
+  job->size = job->capacity = 0;
+  if (job->spill) {
+    fclose(job->spill);
+    job->spill = NULL;
+  }
+}
+
+/*
+ * Writes a compressed job into the archive the same way zip_entry_open,
+ * zip_entry_fwrite and zip_entry_close would have done.
+ */
+static int zip_deflate_job_commit(struct zip_t *zip,
+                                  struct zip_deflate_job_t *job,
+                                  mz_uint8 *buf, size_t bufsize) {
+  int err = 0, e;
+  size_t n = 0;
+
+  if ((err = zip_entry_open_rule(zip, job->filename, job->rule)) < 0) {
+    return err;
+  }
+
+  // Files to be deflated in blocks were left for now, when all threads can
+  // work on them.
+  if (job->rule && job->rule->threads > 1) {
+    err = zip_entry_fwrite_parallel(zip, job->filename, job->rule->threads);
+    e = zip_entry_close(zip);
+    return err ? err : e;
+  }
+
+  if (job->has_stat) {
+#if !defined(_WIN32) && !defined(__WIN32__) && !defined(DJGPP)
+    zip->entry.external_attr = job->external_attr;
+#endif
+    zip->entry.m_time = job->m_time;
+  }
+
+  // A job which failed before compressing leaves the entry as opened.
+  if (!job->has_data) {
+    e = zip_entry_close(zip);
+    return job->err ? job->err : e;
+  }
+
+  // The job's output is written as is, it has already been compressed.
+  if (job->stored && zip->entry.level && (err = zip_entry_store(zip)) < 0) {
+    zip_entry_close(zip);
+    return err;
+  }
+  zip->entry.level = 0;
+  if (job->spill) {
+    if (fflush(job->spill) || MZ_FSEEK64(job->spill, 0, SEEK_SET)) {
+      err = ZIP_EFSEEK;
+    }
+    while (!err &&
+           (n = fread(buf, sizeof(mz_uint8), bufsize, job->spill)) > 0) {
+      err = zip_entry_write_data(zip, buf, n);
+    }
+  } else if (job->size) {
+    err = zip_entry_write_data(zip, job->data, job->size);
+  }
+  zip->entry.uncomp_size = job->uncomp_size;
+  zip->entry.uncomp_crc32 = job->uncomp_crc32;
+
+  e = zip_entry_close(zip);
+  return err ? err : e;
+}
+
+ZIP_THREAD_PROC(zip_deflate_worker, arg) {
+  struct zip_deflate_pool_t *pool = (struct zip_deflate_pool_t *)arg;
+  struct zip_deflate_job_t *job = NULL;
+  tdefl_compressor *comp = NULL;
+  mz_uint8 *buf = NULL;
+  // The first read holds the whole sample zip_entry_write would probe.
+  size_t i, bufsize = MZ_MAX(pool->bufsize, (size_t)ZIP_PROBE_SIZE);
+
+  comp = (tdefl_compressor *)malloc(sizeof(tdefl_compressor));
+  buf = (mz_uint8 *)malloc(bufsize);
+
+  for (;;) {
+    zip_mutex_lock(&pool->mutex);
+    // Don't run too far ahead of the entries being written.
+    while (pool->next < pool->len &&
+           pool->next >= pool->committed + pool->window) {
+      zip_cond_wait(&pool->cond, &pool->mutex);
+    }
+    if (pool->next >= pool->len) {
+      zip_mutex_unlock(&pool->mutex);
+      break;
+    }
+    i = pool->next++;
+    zip_mutex_unlock(&pool->mutex);
+
+    job = &pool->jobs[i];
+    job->rule = zip_rule_find(pool->rules, pool->rules_len, job->filename);
+    if (job->rule && job->rule->threads > 1) {
+      // Deflated in blocks when it is committed.
+    } else if (comp && buf) {
+      zip_deflate_job_run(
+          job,
+          job->rule && job->rule->level >= 0 ? (mz_uint)job->rule->level
+                                             : pool->level,
+          job->rule ? job->rule->strategy : MZ_DEFAULT_STRATEGY,
+          pool->store_threshold, comp, buf, bufsize);
+    } else {
+      job->err = ZIP_EOOMEM;
+    }
+
+    zip_mutex_lock(&pool->mutex);
+    job->done = MZ_TRUE;
+    zip_cond_broadcast(&pool->cond);
+    zip_mutex_unlock(&pool->mutex);
+  }
+
+  CLEANUP(buf);
+  CLEANUP(comp);
+  ZIP_THREAD_RETURN;
+}
+
+static int zip_entries_fwrite_serial(struct zip_t *zip,
+                                     const char *const filenames[],
+                                     size_t len) {
+  const struct zip_rule_t *rule = NULL;
+  int err = 0, e;
+  size_t i;
+
+  for (i = 0; i < len; ++i) {
+    rule = zip_rule_find(zip->rules, zip->rules_len, filenames[i]);
+    if ((e = zip_entry_open_rule(zip, filenames[i], rule)) < 0) {
+      err = err ? err : e;
+      continue;
+    }
+    e = rule && rule->threads > 1
+            ? zip_entry_fwrite_parallel(zip, filenames[i], rule->threads)
+            : zip_entry_fwrite(zip, filenames[i]);
+    if (e < 0) {
+      err = err ? err : e;
+    }
+    if ((e = zip_entry_close(zip)) < 0) {
+      err = err ? err : e;
+    }
+  }
+  return err;
+}
+
+int zip_entries_fwrite(struct zip_t *zip, const char *const filenames[],
+                       size_t len, int threads) {
+  int err = 0, e;
+  size_t i, started = 0;
+  struct zip_deflate_pool_t pool;
+  zip_thread_t *workers = NULL;
+  mz_uint8 *buf = NULL;
+
+  if (!zip || (!filenames && len)) {
+    // zip_t handler is not initialized
+    return ZIP_ENOINIT;
+  }
+
+  if (zip->archive.m_zip_mode != MZ_ZIP_MODE_WRITING) {
+    // Invalid zip mode
+    return ZIP_EINVMODE;
+  }
+
+  if (threads <= 1 || len <= 1) {
+    return zip_entries_fwrite_serial(zip, filenames, len);
+  }
+  if (threads > ZIP_MAX_THREADS) {
+    threads = ZIP_MAX_THREADS;
+  }
+  if ((size_t)threads > len) {
+    threads = (int)len;
+  }
+
+  memset(&pool, 0, sizeof(pool));
+  pool.len = len;
+  pool.window = (size_t)threads * 4;
+  pool.level = zip->level & 0xF;
+  pool.store_threshold = zip_store_threshold(zip);
+  pool.rules = zip->rules;
+  pool.rules_len = zip->rules_len;
+  pool.jobs = (struct zip_deflate_job_t *)calloc(
+      len, sizeof(struct zip_deflate_job_t));
+  workers = (zip_thread_t *)calloc((size_t)threads, sizeof(zip_thread_t));
+  // Workers read as much at a time as the handle does, spill files are read
+  // back through the handle's own buffer.
+  buf = zip_io_buffer(zip, &pool.bufsize);
+  if (!pool.jobs || !workers || !buf) {
+    CLEANUP(pool.jobs);
+    CLEANUP(workers);
+    return ZIP_EOOMEM;
+  }
+  for (i = 0; i < len; ++i) {
+    pool.jobs[i].filename = filenames[i];
+  }
+
+  zip_mutex_init(&pool.mutex);
+  zip_cond_init(&pool.cond);
+  for (started = 0; started < (size_t)threads; ++started) {
+    if (zip_thread_create(&workers[started], zip_deflate_worker, &pool)) {
+      break;
+    }
+  }
+
+  if (!started) {
+    err = zip_entries_fwrite_serial(zip, filenames, len);
+  } else {
+    // Entries are committed in input order as soon as they are compressed.
+    for (i = 0; i < len; ++i) {
+      zip_mutex_lock(&pool.mutex);
+      while (!pool.jobs[i].done) {
+        zip_cond_wait(&pool.cond, &pool.mutex);
+      }
+      zip_mutex_unlock(&pool.mutex);
+
+      if ((e = zip_deflate_job_commit(zip, &pool.jobs[i], buf,
+                                      pool.bufsize)) < 0) {
+        err = err ? err : e;
+      }
+      zip_deflate_job_free(&pool.jobs[i]);
+
+      zip_mutex_lock(&pool.mutex);
+      pool.committed = i + 1;
+      zip_cond_broadcast(&pool.cond);
+      zip_mutex_unlock(&pool.mutex);
+    }
+  }
+
+  for (i = 0; i < started; ++i) {
+    zip_thread_join(workers[i]);
+  }
+  zip_cond_destroy(&pool.cond);
+  zip_mutex_destroy(&pool.mutex);
+
+  CLEANUP(pool.jobs);
+  CLEANUP(workers);
+  return err;
+}
+
+/*
+ * One block of a single large file, deflated on its own. The block is
+ * preceded in buf by up to 32 KB of the data before it, which primes the
+ * compressor's dictionary so matches still reach across block boundaries.
+ */
+#define ZIP_BLOCK_SIZE (1024 * 1024)
+
+struct zip_block_job_t {
+  mz_uint8 *buf;
+  size_t dict_len;
+  size_t len;
+  tdefl_flush flush;
+  mz_uint32 uncomp_crc32;
+  mz_uint8 *data;
+  size_t size;
+  size_t capacity;
+  int err;
+  mz_bool done;
+};
+
+struct zip_block_pool_t {
+  zip_mutex_t mutex;
+  zip_cond_t cond;
+  struct zip_block_job_t *jobs;
+  size_t window;
+  size_t next;   // sequence number of the next job a worker takes
+  size_t filled; // number of jobs handed to the workers so far
+  mz_bool eof;
+  mz_uint level;
+  int strategy;
+};
+
+/*
+ * Puts the compressor in the state it would be in after having compressed
+ * dict, without emitting anything: the dictionary and the hash chains the
+ * matcher (normal or level 1 fast path) looks candidates up in.
+ */
+static void zip_tdefl_prime(tdefl_compressor *d, const mz_uint8 *dict,
+                            size_t len) {
+  mz_uint i, hash, n = (mz_uint)MZ_MIN(len, (size_t)TDEFL_LZ_DICT_SIZE);
+
+  dict += len - n;
+  memcpy(d->m_dict, dict, n);
+  memcpy(d->m_dict + TDEFL_LZ_DICT_SIZE, dict,
+         MZ_MIN(n, (mz_uint)TDEFL_MAX_MATCH_LEN - 1));
+
+#if MINIZ_USE_UNALIGNED_LOADS_AND_STORES && MINIZ_LITTLE_ENDIAN
+  if (((d->m_flags & TDEFL_MAX_PROBES_MASK) == 1) &&
+      ((d->m_flags & TDEFL_GREEDY_PARSING_FLAG) != 0) &&
+      ((d->m_flags & (TDEFL_FILTER_MATCHES | TDEFL_FORCE_ALL_RAW_BLOCKS |
+                      TDEFL_RLE_MATCHES)) == 0)) {
+    for (i = 0; i + 2 < n; i++) {
+      mz_uint trigram = (mz_uint)dict[i] | ((mz_uint)dict[i + 1] << 8) |
+                        ((mz_uint)dict[i + 2] << 16);
+      hash = (trigram ^ (trigram >> (24 - (TDEFL_LZ_HASH_BITS - 8)))) &
+             TDEFL_LEVEL1_HASH_SIZE_MASK;
+      d->m_hash[hash] = (mz_uint16)i;
+    }
+  } else
+#endif
+  {
+    hash = n >= 2 ? ((mz_uint)dict[0] << TDEFL_LZ_HASH_SHIFT) ^ dict[1] : 0;
+    for (i = 0; i + 2 < n; i++) {
+      hash = ((hash << TDEFL_LZ_HASH_SHIFT) ^ dict[i + 2]) &
+             (TDEFL_LZ_HASH_SIZE - 1);
+      d->m_next[i & TDEFL_LZ_DICT_SIZE_MASK] = d->m_hash[hash];
+      d->m_hash[hash] = (mz_uint16)i;
+    }
+  }
+
+  d->m_lookahead_pos = n;
+  d->m_dict_size = n;
+}
+
+static mz_bool zip_block_job_put(const void *buf, int len, void *user) {
+  struct zip_block_job_t *job = (struct zip_block_job_t *)user;
+  size_t n = (size_t)len;
+
+  if (job->size + n > job->capacity) {
+    size_t capacity = MZ_MAX(job->capacity, MZ_ZIP_MAX_IO_BUF_SIZE);
+    mz_uint8 *data = NULL;
+    while (capacity < job->size + n) {
+      capacity *= 2;
+    }
+    if (!(data = (mz_uint8 *)realloc(job->data, capacity))) {
+      return MZ_FALSE;
+    }
+    job->data = data;
+    job->capacity = capacity;
+  }
+  memcpy(job->data + job->size, buf, n);
+  job->size += n;
+  return MZ_TRUE;
+}
+
+static void zip_block_job_run(struct zip_block_job_t *job, mz_uint level,
+                              int strategy, tdefl_compressor *comp) {
+  tdefl_status status;
+
+  job->uncomp_crc32 = (mz_uint32)mz_crc32(
+      MZ_CRC32_INIT, job->buf + job->dict_len, job->len);
+
+  if (tdefl_init(comp, zip_block_job_put, job,
+                 (int)tdefl_create_comp_flags_from_zip_params(
+                     (int)level, -15, strategy)) !=
+      TDEFL_STATUS_OKAY) {
+    // Cannot initialize the zip compressor
+    job->err = ZIP_ETDEFLINIT;
+    return;
+  }
+  zip_tdefl_prime(comp, job->buf, job->dict_len);
+
+  // Every block but the last ends on a byte aligned sync flush, so the raw
+  // deflate streams can simply be concatenated.
+  status = tdefl_compress_buffer(comp, job->buf + job->dict_len, job->len,
+                                 job->flush);
+  if (status != TDEFL_STATUS_DONE && status != TDEFL_STATUS_OKAY) {
+    // Cannot compress buffer
+    job->err = ZIP_ETDEFLBUF;
+  }
+}
+
+ZIP_THREAD_PROC(zip_block_worker, arg) {
+  struct zip_block_pool_t *pool = (struct zip_block_pool_t *)arg;
+  struct zip_block_job_t *job = NULL;
+  tdefl_compressor *comp =
+      (tdefl_compressor *)malloc(sizeof(tdefl_compressor));
+
+  zip_mutex_lock(&pool->mutex);
+  for (;;) {
+    while (pool->next == pool->filled && !pool->eof) {
+      zip_cond_wait(&pool->cond, &pool->mutex);
+    }
+    if (pool->next == pool->filled) {
+      break;
+    }
+    job = &pool->jobs[pool->next++ % pool->window];
+    zip_mutex_unlock(&pool->mutex);
+
+    if (comp) {
+      zip_block_job_run(job, pool->level, pool->strategy, comp);
+    } else {
+      job->err = ZIP_EOOMEM;
+    }
+
+    zip_mutex_lock(&pool->mutex);
+    job->done = MZ_TRUE;
+    zip_cond_broadcast(&pool->cond);
+  }
+  zip_mutex_unlock(&pool->mutex);
+
+  CLEANUP(comp);
+  ZIP_THREAD_RETURN;
+}
+
+int zip_entry_fwrite_parallel(struct zip_t *zip, const char *filename,
+                              int threads) {
+  // An empty, final fixed Huffman block, closes a stream ending on a flush.
+  static const mz_uint8 final_block[2] = {0x03, 0x00};
+  int err = 0;
+  size_t i, committed = 0, started = 0;
+  mz_bool reading = MZ_TRUE, finished = MZ_FALSE;
+  MZ_FILE *stream = NULL;
+  struct zip_block_pool_t pool;
+  struct zip_block_job_t *job = NULL, *prev = NULL;
+  zip_thread_t *workers = NULL;
+
+  if (!zip) {
+    // zip_t handler is not initialized
+    return ZIP_ENOINIT;
+  }
+
+  if (zip->archive.m_zip_mode != MZ_ZIP_MODE_WRITING || !zip->entry.name ||
+      zip->entry.uncomp_size) {
+    // No freshly opened entry to write into
+    return ZIP_EINVMODE;
+  }
+
+  if (threads <= 1 || !zip->entry.level) {
+    return zip_entry_fwrite(zip, filename);
+  }
+  // Every thread holds two blocks in flight, allocated up front.
+  if (threads > ZIP_MAX_THREADS) {
+    threads = ZIP_MAX_THREADS;
+  }
+
+  memset(&pool, 0, sizeof(pool));
+  pool.window = (size_t)threads * 2;
+  pool.level = zip->entry.level;
+  pool.strategy = zip->entry.strategy;
+  pool.jobs = (struct zip_block_job_t *)calloc(pool.window,
+                                               sizeof(struct zip_block_job_t));
+  workers = (zip_thread_t *)calloc((size_t)threads, sizeof(zip_thread_t));
+  if (!pool.jobs || !workers) {
+    err = ZIP_EOOMEM;
+    goto cleanup;
+  }
+  for (i = 0; i < pool.window; ++i) {
+    pool.jobs[i].buf = (mz_uint8 *)malloc(TDEFL_LZ_DICT_SIZE + ZIP_BLOCK_SIZE);
+    if (!pool.jobs[i].buf) {
+      err = ZIP_EOOMEM;
+      goto cleanup;
+    }
+  }
+
+  if ((err = zip_file_stat(filename, &zip->entry.external_attr,
+                           &zip->entry.m_time)) < 0) {
+    goto cleanup;
+  }
+  if (!(stream = MZ_FOPEN(filename, "rb"))) {
+    // Cannot open filename
+    err = ZIP_EOPNFILE;
+    goto cleanup;
+  }
+  zip_file_advise(stream);
+
+  // A file not worth deflating is copied as it is, no threads needed.
+  i = fread(pool.jobs[0].buf, sizeof(mz_uint8), ZIP_PROBE_SIZE, stream);
+  if ((err = zip_entry_probe(zip, pool.jobs[0].buf, i)) != 0 ||
+      MZ_FSEEK64(stream, 0, SEEK_SET)) {
+    fclose(stream);
+    stream = NULL;
+    err = err < 0 ? err : zip_entry_fwrite(zip, filename);
+    goto cleanup;
+  }
+
+  zip_mutex_init(&pool.mutex);
+  zip_cond_init(&pool.cond);
+  for (started = 0; started < (size_t)threads; ++started) {
+    if (zip_thread_create(&workers[started], zip_block_worker, &pool)) {
+      break;
+    }
+  }
+  if (!started) {
+    zip_cond_destroy(&pool.cond);
+    zip_mutex_destroy(&pool.mutex);
+    fclose(stream);
+    stream = NULL;
+    err = zip_entry_fwrite(zip, filename);
+    goto cleanup;
+  }
+
+  // The blocks' output is written as is, it has already been compressed.
+  zip->entry.level = 0;
+  zip->entry.uncomp_crc32 = MZ_CRC32_INIT;
+
+  for (;;) {
+    // Keep the workers fed while the oldest block is being waited for.
+    while (reading && pool.filled - committed < pool.window) {
+      job = &pool.jobs[pool.filled % pool.window];
+      job->dict_len = 0;
+      if (prev) {
+        job->dict_len = MZ_MIN(prev->dict_len + prev->len,
+                               (size_t)TDEFL_LZ_DICT_SIZE);
+        memcpy(job->buf,
+               prev->buf + prev->dict_len + prev->len - job->dict_len,
+               job->dict_len);
+      }
+      job->len = fread(job->buf + job->dict_len, sizeof(mz_uint8),
+                       ZIP_BLOCK_SIZE, stream);
+      if (ferror(stream)) {
+        err = ZIP_EFREAD;
+      }
+      if (err || job->len < ZIP_BLOCK_SIZE) {
+        reading = MZ_FALSE;
+      }
+      if (err || !job->len) {
+        break;
+      }
+      job->flush = reading ? TDEFL_SYNC_FLUSH : TDEFL_FINISH;
+      finished = !reading;
+      prev = job;
+
+      zip_mutex_lock(&pool.mutex);
+      pool.filled++;
+      zip_cond_broadcast(&pool.cond);
+      zip_mutex_unlock(&pool.mutex);
+    }
+    if (!reading) {
+      zip_mutex_lock(&pool.mutex);
+      pool.eof = MZ_TRUE;
+      zip_cond_broadcast(&pool.cond);
+      zip_mutex_unlock(&pool.mutex);
+    }
+    if (committed == pool.filled) {
+      break;
+    }
+
+    job = &pool.jobs[committed % pool.window];
+    zip_mutex_lock(&pool.mutex);
+    while (!job->done) {
+      zip_cond_wait(&pool.cond, &pool.mutex);
+    }
+    zip_mutex_unlock(&pool.mutex);
+
+    if (!err && !(err = job->err) && job->size) {
+      err = zip_entry_write_data(zip, job->data, job->size);
+    }
+    if (err) {
+      // Nothing more is read, only the blocks in flight are waited for.
+      reading = MZ_FALSE;
+    }
+    zip->entry.uncomp_size += job->len;
+    zip->entry.uncomp_crc32 =
+        zip_crc32_combine(zip->entry.uncomp_crc32, job->uncomp_crc32, job->len);
+    job->size = 0;
+    job->err = 0;
+    job->done = MZ_FALSE;
+    committed++;
+  }
+
+  if (!err && !finished) {
+    err = zip_entry_write_data(zip, final_block, sizeof(final_block));
+  }
+
+  for (i = 0; i < started; ++i) {
+    zip_thread_join(workers[i]);
+  }
+  zip_cond_destroy(&pool.cond);
+  zip_mutex_destroy(&pool.mutex);
+
+cleanup:
+  if (stream) {
+    fclose(stream);
+  }
+  if (pool.jobs) {
+    for (i = 0; i < pool.window; ++i) {
+      CLEANUP(pool.jobs[i].buf);
+      CLEANUP(pool.jobs[i].data);
+    }
+  }
+  CLEANUP(pool.jobs);
+  CLEANUP(workers);
+  return err;
+}
+
+ssize_t zip_entry_read(struct zip_t *zip, void **buf, size_t *bufsize) {
+  mz_zip_archive *pzip = NULL;
+  mz_uint idx;
+  size_t size = 0;
+
+  if (!zip) {
+    // zip_t handler is not initialized
+    return (ssize_t)ZIP_ENOINIT;
+  }
+
+  pzip = &(zip->archive);
+  if (pzip->m_zip_mode != MZ_ZIP_MODE_READING ||
+      zip->entry.index < (ssize_t)0) {
+    // the entry is not found or we do not have read access
+    return (ssize_t)ZIP_ENOENT;
+  }
+
+  idx = (mz_uint)zip->entry.index;
+  if (mz_zip_reader_is_file_a_directory(pzip, idx)) {
+    // the entry is a directory
+    return (ssize_t)ZIP_EINVENTTYPE;
+  }
+
+  *buf = mz_zip_reader_extract_to_heap(pzip, idx, &size, 0);
+  if (*buf && bufsize) {
+    *bufsize = size;
+  }
+  return (ssize_t)size;
+}
+
+ssize_t zip_entry_read_raw(struct zip_t *zip, void **buf, size_t *bufsize) {
+  mz_zip_archive *pzip = NULL;
+  mz_uint idx;
+  size_t size = 0;
+
+  if (!zip) {
+    // zip_t handler is not initialized
+    return (ssize_t)ZIP_ENOINIT;
+  }
+
+  pzip = &(zip->archive);
+  if (pzip->m_zip_mode != MZ_ZIP_MODE_READING ||
+      zip->entry.index < (ssize_t)0) {
+    // the entry is not found or we do not have read access
+    return (ssize_t)ZIP_ENOENT;
+  }
+
+  idx = (mz_uint)zip->entry.index;
+  if (mz_zip_reader_is_file_a_directory(pzip, idx)) {
+    // the entry is a directory
+    return (ssize_t)ZIP_EINVENTTYPE;
+  }
+
+  *buf = mz_zip_reader_extract_to_heap(pzip, idx, &size,
+                                       MZ_ZIP_FLAG_COMPRESSED_DATA);
+  if (!*buf) {
+    // Cannot read the entry data (e.g. it is encrypted)
+    return (ssize_t)ZIP_EFREAD;
+  }
+  if (bufsize) {
+    *bufsize = size;
+  }
+  return (ssize_t)size;
+}
+
+int zip_entry_gzip_frame(struct zip_t *zip,
+                         unsigned char header[ZIP_GZIP_HEADER_SIZE],
+                         unsigned char trailer[ZIP_GZIP_TRAILER_SIZE]) {
+  mz_uint32 m_time = 0;
+
+  if (!zip) {
+    // zip_t handler is not initialized
+    return ZIP_ENOINIT;
+  }
+
+  if (zip->archive.m_zip_mode != MZ_ZIP_MODE_READING ||
+      zip->entry.index < (ssize_t)0) {
+    // the entry is not found or we do not have read access
+    return ZIP_ENOENT;
+  }
+
+  if (zip->entry.method != MZ_DEFLATED ||
+      mz_zip_reader_is_file_a_directory(&(zip->archive),
+                                        (mz_uint)zip->entry.index)) {
+    // Only deflated file data can be carried by a gzip member
+    return ZIP_EINVENTTYPE;
+  }
+
+  if (zip->entry.m_time > 0 && (mz_uint64)zip->entry.m_time <= MZ_UINT32_MAX) {
+    m_time = (mz_uint32)zip->entry.m_time;
+  }
+
+  // RFC 1952: magic, deflate, no flags, mtime, no extra flags, unknown OS.
+  header[0] = 0x1f;
+  header[1] = 0x8b;
+  header[2] = MZ_DEFLATED;
+  header[3] = 0;
+  MZ_WRITE_LE32(header + 4, m_time);
+  header[8] = 0;
+  header[9] = 0xff;
+
+  // The central directory already holds the CRC-32 and size of the data.
+  MZ_WRITE_LE32(trailer, zip->entry.uncomp_crc32);
+  MZ_WRITE_LE32(trailer + 4, (mz_uint32)zip->entry.uncomp_size);
+  return 0;
+}
+
+ssize_t zip_entry_noallocread(struct zip_t *zip, void *buf, size_t bufsize) {
+  mz_zip_archive *pzip = NULL;
+
+  if (!zip) {
+    // zip_t handler is not initialized
+    return (ssize_t)ZIP_ENOINIT;
+  }
+
+  pzip = &(zip->archive);
+  if (pzip->m_zip_mode != MZ_ZIP_MODE_READING ||
+      zip->entry.index < (ssize_t)0) {
+    // the entry is not found or we do not have read access
+    return (ssize_t)ZIP_ENOENT;
+  }
+
+  if (!mz_zip_reader_extract_to_mem_no_alloc(pzip, (mz_uint)zip->entry.index,
+                                             buf, bufsize, 0, NULL, 0)) {
+    return (ssize_t)ZIP_EMEMNOALLOC;
+  }
+
+  return (ssize_t)zip->entry.uncomp_size;
 }
 
-int zip_entry_close(struct zip_t *zip) {
+int zip_entry_fread(struct zip_t *zip, const char *filename) {
   mz_zip_archive *pzip = NULL;
-  mz_uint level;
-  tdefl_status done;
-  mz_uint16 entrylen;
-  mz_uint16 dos_time = 0, dos_date = 0;
+  mz_uint idx;
+  mz_uint32 xattr = 0;
+  mz_zip_archive_file_stat info;
+  mz_uint8 *buf = NULL;
+  size_t bufsize = 0;
   int err = 0;
-  mz_uint8 *pExtra_data = NULL;
-  mz_uint32 extra_size = 0;
-  mz_uint8 extra_data[MZ_ZIP64_MAX_CENTRAL_EXTRA_FIELD_SIZE];
-  mz_uint8 local_dir_footer[MZ_ZIP_DATA_DESCRIPTER_SIZE64];
-  mz_uint32 local_dir_footer_size = MZ_ZIP_DATA_DESCRIPTER_SIZE64;
 
   if (!zip) {
     // zip_t handler is not initialized
-    err = ZIP_ENOINIT;
-    goto cleanup;
+    return ZIP_ENOINIT;
   }
 
+  memset((void *)&info, 0, sizeof(mz_zip_archive_file_stat));
   pzip = &(zip->archive);
-  if (pzip->m_zip_mode == MZ_ZIP_MODE_READING) {
-    goto cleanup;
+  if (pzip->m_zip_mode != MZ_ZIP_MODE_READING ||
+      zip->entry.index < (ssize_t)0) {
+    // the entry is not found or we do not have read access
+    return ZIP_ENOENT;
   }
 
-  level = zip->level & 0xF;
-  if (level) {
-    done = tdefl_compress_buffer(&(zip->entry.comp), "", 0, TDEFL_FINISH);
-    if (done != TDEFL_STATUS_DONE && done != TDEFL_STATUS_OKAY) {
-      // Cannot flush compressed buffer
-      err = ZIP_ETDEFLBUF;
-      goto cleanup;
-    }
-    zip->entry.comp_size = zip->entry.state.m_comp_size;
-    zip->entry.offset = zip->entry.state.m_cur_archive_file_ofs;
-    zip->entry.method = MZ_DEFLATED;
+  idx = (mz_uint)zip->entry.index;
+  if (mz_zip_reader_is_file_a_directory(pzip, idx)) {
+    // the entry is a directory
+    return ZIP_EINVENTTYPE;
   }
 
-  entrylen = (mz_uint16)strlen(zip->entry.name);
-#ifndef MINIZ_NO_TIME
-  mz_zip_time_t_to_dos_time(zip->entry.m_time, &dos_time, &dos_date);
-#endif
+  buf = zip_io_buffer(zip, &bufsize);
+  if (!buf) {
+    return ZIP_EOOMEM;
+  }
+  if ((err = zip_archive_extract_file(pzip, idx, filename, buf, bufsize)) <
+      0) {
+    return err;
+  }
 
-  MZ_WRITE_LE32(local_dir_footer + 0, MZ_ZIP_DATA_DESCRIPTOR_ID);
-  MZ_WRITE_LE32(local_dir_footer + 4, zip->entry.uncomp_crc32);
-  MZ_WRITE_LE64(local_dir_footer + 8, zip->entry.comp_size);
-  MZ_WRITE_LE64(local_dir_footer + 16, zip->entry.uncomp_size);
+#if defined(_MSC_VER) || defined(PS4)
+  (void)xattr; // unused
+#else
+  if (!mz_zip_reader_file_stat(pzip, idx, &info)) {
+    // Cannot get information about zip archive;
+    return ZIP_ENOFILE;
+  }
 
-  if (pzip->m_pWrite(pzip->m_pIO_opaque, zip->entry.offset, local_dir_footer,
-                     local_dir_footer_size) != local_dir_footer_size) {
-    // Cannot write zip entry header
-    err = ZIP_EWRTHDR;
-    goto cleanup;
+  xattr = (info.m_external_attr >> 16) & 0xFFFF;
+  if (xattr > 0 && xattr <= MZ_UINT16_MAX) {
+    if (CHMOD(filename, (mode_t)xattr) < 0) {
+      return ZIP_ENOPERM;
+    }
   }
-  zip->entry.offset += local_dir_footer_size;
+#endif
 
-  pExtra_data = extra_data;
-  extra_size = mz_zip_writer_create_zip64_extra_data(
-      extra_data,
-      (zip->entry.uncomp_size >= MZ_UINT32_MAX) ? &zip->entry.uncomp_size
-                                                : NULL,
-      (zip->entry.comp_size >= MZ_UINT32_MAX) ? &zip->entry.comp_size : NULL,
-      (zip->entry.header_offset >= MZ_UINT32_MAX) ? &zip->entry.header_offset
-                                                  : NULL);
+  return 0;
+}
 
-  if ((entrylen) && (zip->entry.name[entrylen - 1] == '/') &&
-      !zip->entry.uncomp_size) {
-    /* Set DOS Subdirectory attribute bit. */
-    zip->entry.external_attr |= MZ_ZIP_DOS_DIR_ATTRIBUTE_BITFLAG;
+int zip_entry_extract(struct zip_t *zip,
+                      size_t (*on_extract)(void *arg, uint64_t offset,
+                                           const void *buf, size_t bufsize),
+                      void *arg) {
+  mz_zip_archive *pzip = NULL;
+  mz_uint idx;
+
+  if (!zip) {
+    // zip_t handler is not initialized
+    return ZIP_ENOINIT;
   }
 
-  if (!mz_zip_writer_add_to_central_dir(
-          pzip, zip->entry.name, entrylen, pExtra_data, (mz_uint16)extra_size,
-          "", 0, zip->entry.uncomp_size, zip->entry.comp_size,
-          zip->entry.uncomp_crc32, zip->entry.method,
-          MZ_ZIP_GENERAL_PURPOSE_BIT_FLAG_UTF8 |
-              MZ_ZIP_LDH_BIT_FLAG_HAS_LOCATOR,
-          dos_time, dos_date, zip->entry.header_offset,
-          zip->entry.external_attr, NULL, 0)) {
-    // Cannot write to zip central dir
-    err = ZIP_EWRTDIR;
-    goto cleanup;
+  pzip = &(zip->archive);
+  if (pzip->m_zip_mode != MZ_ZIP_MODE_READING ||
+      zip->entry.index < (ssize_t)0) {
+    // the entry is not found or we do not have read access
+    return ZIP_ENOENT;
   }
 
-  pzip->m_total_files++;
-  pzip->m_archive_size = zip->entry.offset;
+  idx = (mz_uint)zip->entry.index;
+  return (mz_zip_reader_extract_to_callback(pzip, idx, on_extract, arg, 0))
+             ? 0
+             : ZIP_EINVIDX;
+}
 
-cleanup:
-  if (zip) {
-    zip->entry.m_time = 0;
-    CLEANUP(zip->entry.name);
+static struct zip_entry_reader_t *
+zip_entry_reader_new(struct zip_t *zip, mz_uint index, mz_uint flags) {
+  struct zip_entry_reader_t *reader = (struct zip_entry_reader_t *)calloc(
+      (size_t)1, sizeof(struct zip_entry_reader_t));
+  if (!reader) {
+    return NULL;
   }
-  return err;
+
+  reader->iter =
+      mz_zip_reader_extract_iter_new(&(zip->archive), index, flags);
+  if (!reader->iter) {
+    CLEANUP(reader);
+    return NULL;
+  }
+
+  reader->zip = zip;
+  zip_mutex_lock(&zip->lock);
+  reader->next = zip->readers;
+  zip->readers = reader;
+  zip_mutex_unlock(&zip->lock);
+  return reader;
 }
 
-const char *zip_entry_name(struct zip_t *zip) {
+struct zip_entry_reader_t *zip_entry_reader_open(struct zip_t *zip) {
   if (!zip) {
     // zip_t handler is not initialized
     return NULL;
   }
 
-  return zip->entry.name;
+  if (zip->archive.m_zip_mode != MZ_ZIP_MODE_READING ||
+      zip->entry.index < (ssize_t)0) {
+    // the entry is not found or we do not have read access
+    return NULL;
+  }
+
+  return zip_entry_reader_new(zip, (mz_uint)zip->entry.index, 0);
 }
 
-ssize_t zip_entry_index(struct zip_t *zip) {
+struct zip_entry_reader_t *zip_entry_reader_open_raw(struct zip_t *zip) {
   if (!zip) {
     // zip_t handler is not initialized
-    return (ssize_t)ZIP_ENOINIT;
+    return NULL;
   }
 
-  return zip->entry.index;
+  if (zip->archive.m_zip_mode != MZ_ZIP_MODE_READING ||
+      zip->entry.index < (ssize_t)0) {
+    // the entry is not found or we do not have read access
+    return NULL;
+  }
+
+  return zip_entry_reader_new(zip, (mz_uint)zip->entry.index,
+                              MZ_ZIP_FLAG_COMPRESSED_DATA);
 }
 
-int zip_entry_isdir(struct zip_t *zip) {
+struct zip_entry_reader_t *zip_entry_reader_openbyindex(struct zip_t *zip,
+                                                        size_t index) {
   if (!zip) {
     // zip_t handler is not initialized
-    return ZIP_ENOINIT;
+    return NULL;
   }
 
-  if (zip->entry.index < (ssize_t)0) {
-    // zip entry is not opened
-    return ZIP_EINVIDX;
+  if (zip->archive.m_zip_mode != MZ_ZIP_MODE_READING ||
+      index >= (size_t)zip->archive.m_total_files) {
+    // the entry is not found or we do not have read access
+    return NULL;
   }
 
-  return (int)mz_zip_reader_is_file_a_directory(&zip->archive,
-                                                (mz_uint)zip->entry.index);
+  return zip_entry_reader_new(zip, (mz_uint)index, 0);
 }
 
-unsigned long long zip_entry_size(struct zip_t *zip) {
-  return zip_entry_uncomp_size(zip);
-}
+ssize_t zip_entry_reader_read(struct zip_entry_reader_t *reader, void *buf,
+                              size_t bufsize) {
+  size_t n = 0;
 
-unsigned long long zip_entry_uncomp_size(struct zip_t *zip) {
-  return zip ? zip->entry.uncomp_size : 0;
+  if (!reader || !reader->iter) {
+    // reader is not initialized or its archive has been closed
+    return (ssize_t)ZIP_ENOINIT;
+  }
+
+  if (!buf || bufsize == 0) {
+    return 0;
+  }
+
+  n = mz_zip_reader_extract_iter_read(reader->iter, buf, bufsize);
+  if (n == 0) {
+    reader->eof = MZ_TRUE;
+    if (reader->iter->status < 0) {
+      // Cannot read or inflate entry data
+      return (ssize_t)ZIP_EFREAD;
+    }
+  }
+  return (ssize_t)n;
 }
 
-unsigned long long zip_entry_comp_size(struct zip_t *zip) {
-  return zip ? zip->entry.comp_size : 0;
+int zip_entry_reader_close(struct zip_entry_reader_t *reader) {
+  struct zip_entry_reader_t **link = NULL;
+  int err = 0;
+
+  if (!reader) {
+    return ZIP_ENOINIT;
+  }
+
+  if (reader->iter) {
+    // The size and CRC-32 checks only apply once the whole entry was read.
+    if (!mz_zip_reader_extract_iter_free(reader->iter) && reader->eof) {
+      err = ZIP_EFREAD;
+    }
+    reader->iter = NULL;
+  }
+
+  if (reader->zip) {
+    zip_mutex_lock(&reader->zip->lock);
+    for (link = &reader->zip->readers; *link; link = &(*link)->next) {
+      if (*link == reader) {
+        *link = reader->next;
+        break;
+      }
+    }
+    zip_mutex_unlock(&reader->zip->lock);
+  }
+
+  CLEANUP(reader);
+  return err;
 }
 
-unsigned int zip_entry_crc32(struct zip_t *zip) {
-  return zip ? zip->entry.uncomp_crc32 : 0;
+ssize_t zip_entries_total(struct zip_t *zip) {
+  if (!zip) {
+    // zip_t handler is not initialized
+    return ZIP_ENOINIT;
+  }
+
+  return (ssize_t)zip->archive.m_total_files;
 }
 
-int zip_entry_write(struct zip_t *zip, const void *buf, size_t bufsize) {
-  mz_uint level;
+int zip_entry_info(struct zip_t *zip, size_t index,
+                   struct zip_entry_info_t *info) {
   mz_zip_archive *pzip = NULL;
-  tdefl_status status;
+  const mz_uint8 *p = NULL;
 
-  if (!zip) {
+  if (!zip || !info) {
     // zip_t handler is not initialized
     return ZIP_ENOINIT;
   }
 
   pzip = &(zip->archive);
-  if (buf && bufsize > 0) {
-    zip->entry.uncomp_size += bufsize;
-    zip->entry.uncomp_crc32 = (mz_uint32)mz_crc32(
-        zip->entry.uncomp_crc32, (const mz_uint8 *)buf, bufsize);
+  if (index >= (size_t)pzip->m_total_files ||
+      !(p = mz_zip_get_cdh(pzip, (mz_uint)index))) {
+    return ZIP_EINVIDX;
+  }
 
-    level = zip->level & 0xF;
-    if (!level) {
-      if ((pzip->m_pWrite(pzip->m_pIO_opaque, zip->entry.offset, buf,
-                          bufsize) != bufsize)) {
-        // Cannot write buffer
-        return ZIP_EWRTENT;
-      }
-      zip->entry.offset += bufsize;
-      zip->entry.comp_size += bufsize;
-    } else {
-      status = tdefl_compress_buffer(&(zip->entry.comp), buf, bufsize,
-                                     TDEFL_NO_FLUSH);
-      if (status != TDEFL_STATUS_DONE && status != TDEFL_STATUS_OKAY) {
-        // Cannot compress buffer
-        return ZIP_ETDEFLBUF;
-      }
+  info->namelen = MZ_READ_LE16(p + MZ_ZIP_CDH_FILENAME_LEN_OFS);
+  info->name = (const char *)p + MZ_ZIP_CENTRAL_DIR_HEADER_SIZE;
+  info->uncomp_size = MZ_READ_LE32(p + MZ_ZIP_CDH_DECOMPRESSED_SIZE_OFS);
+  info->comp_size = MZ_READ_LE32(p + MZ_ZIP_CDH_COMPRESSED_SIZE_OFS);
+  info->crc32 = MZ_READ_LE32(p + MZ_ZIP_CDH_CRC32_OFS);
+  info->method = MZ_READ_LE16(p + MZ_ZIP_CDH_METHOD_OFS);
+  info->header_offset = MZ_READ_LE32(p + MZ_ZIP_CDH_LOCAL_HEADER_OFS);
+#ifndef MINIZ_NO_TIME
+  info->m_time = (int64_t)mz_zip_dos_to_time_t(
+      MZ_READ_LE16(p + MZ_ZIP_CDH_FILE_TIME_OFS),
+      MZ_READ_LE16(p + MZ_ZIP_CDH_FILE_DATE_OFS));
+#else
+  info->m_time = 0;
+#endif
+  info->isdir = (int)mz_zip_reader_is_file_a_directory(pzip, (mz_uint)index);
+
+  if (info->uncomp_size == MZ_UINT32_MAX || info->comp_size == MZ_UINT32_MAX ||
+      info->header_offset == MZ_UINT32_MAX) {
+    // The real values live in the zip64 extra field.
+    mz_zip_archive_file_stat stats;
+    if (!mz_zip_reader_file_stat(pzip, (mz_uint)index, &stats)) {
+      return ZIP_EINVIDX;
     }
+    info->uncomp_size = stats.m_uncomp_size;
+    info->comp_size = stats.m_comp_size;
+    info->header_offset = stats.m_local_header_ofs;
   }
 
   return 0;
 }
 
-int zip_entry_fwrite(struct zip_t *zip, const char *filename) {
-  int err = 0;
-  size_t n = 0;
-  MZ_FILE *stream = NULL;
-  mz_uint8 buf[MZ_ZIP_MAX_IO_BUF_SIZE];
-  struct MZ_FILE_STAT_STRUCT file_stat;
-  mz_uint16 modes;
+ssize_t zip_entries_delete(struct zip_t *zip, char *const entries[],
+                           size_t len) {
+  ssize_t n = 0;
+  ssize_t err = 0;
+  struct zip_entry_mark_t *entry_mark = NULL;
 
-  if (!zip) {
-    // zip_t handler is not initialized
+  if (zip == NULL || (entries == NULL && len != 0)) {
     return ZIP_ENOINIT;
   }
 
-  memset(buf, 0, MZ_ZIP_MAX_IO_BUF_SIZE);
-  memset((void *)&file_stat, 0, sizeof(struct MZ_FILE_STAT_STRUCT));
-  if (MZ_FILE_STAT(filename, &file_stat) != 0) {
-    // problem getting information - check errno
-    return ZIP_ENOENT;
+  if (entries == NULL && len == 0) {
+    return 0;
+  }
+
+  // File indices shift once entries are removed.
+  zip_index_free(zip);
+  zip_space_free(zip);
+
+  // Entries are moved with reads and writes of the file, which must not be
+  // held back in the append buffer. The buffer stays on for later appends.
+  if ((err = zip_write_buffer_flush(zip)) < 0) {
+    return err;
+  }
+
+  n = zip_entries_total(zip);
+
+  entry_mark = (struct zip_entry_mark_t *)calloc(
+      (size_t)n, sizeof(struct zip_entry_mark_t));
+  if (!entry_mark) {
+    return ZIP_EOOMEM;
+  }
+
+  err = zip_entry_set(zip, entry_mark, n, entries, len);
+  if (err < 0) {
+    CLEANUP(entry_mark);
+    return err;
   }
 
-#if defined(_WIN32) || defined(__WIN32__) || defined(DJGPP)
-  (void)modes; // unused
-#else
-  /* Initialize with permission bits--which are not implementation-optional */
-  modes = file_stat.st_mode &
-          (S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | S_ISGID | S_ISVTX);
-  if (S_ISDIR(file_stat.st_mode))
-    modes |= UNX_IFDIR;
-  if (S_ISREG(file_stat.st_mode))
-    modes |= UNX_IFREG;
-  if (S_ISLNK(file_stat.st_mode))
-    modes |= UNX_IFLNK;
-  if (S_ISBLK(file_stat.st_mode))
-    modes |= UNX_IFBLK;
-  if (S_ISCHR(file_stat.st_mode))
-    modes |= UNX_IFCHR;
-  if (S_ISFIFO(file_stat.st_mode))
-    modes |= UNX_IFIFO;
-  if (S_ISSOCK(file_stat.st_mode))
-    modes |= UNX_IFSOCK;
-  zip->entry.external_attr = (modes << 16) | !(file_stat.st_mode & S_IWUSR);
-  if ((file_stat.st_mode & S_IFMT) == S_IFDIR) {
-    zip->entry.external_attr |= MZ_ZIP_DOS_DIR_ATTRIBUTE_BITFLAG;
-  }
-#endif
+  err = zip_entries_delete_mark(zip, entry_mark, (int)n);
+  CLEANUP(entry_mark);
+  return err;
+}
 
-  zip->entry.m_time = file_stat.st_mtime;
+ssize_t zip_entries_select(struct zip_t *zip, char *const entries[],
+                           size_t len, size_t *indices) {
+  struct zip_name_set_t set;
+  mz_uint i, total = 0;
+  ssize_t n = 0;
+  int err = 0;
 
-  if (!(stream = MZ_FOPEN(filename, "rb"))) {
-    // Cannot open filename
-    return ZIP_EOPNFILE;
+  if (zip == NULL || (entries == NULL && len != 0) || indices == NULL) {
+    return ZIP_ENOINIT;
   }
 
-  while ((n = fread(buf, sizeof(mz_uint8), MZ_ZIP_MAX_IO_BUF_SIZE, stream)) >
-         0) {
-    if (zip_entry_write(zip, buf, n) < 0) {
-      err = ZIP_EWRTENT;
-      break;
+  if ((err = zip_name_set_init(&set, entries, len)) < 0) {
+    return err;
+  }
+
+  total = zip->archive.m_total_files;
+  for (i = 0; i < total; ++i) {
+    size_t namelen = 0;
+    const char *name = zip_index_name(&zip->archive, i, &namelen);
+    if (zip_name_set_contains(&set, name, namelen)) {
+      indices[n++] = i;
     }
   }
-  fclose(stream);
 
-  return err;
+  zip_name_set_free(&set);
+  return n;
 }
 
-ssize_t zip_entry_read(struct zip_t *zip, void **buf, size_t *bufsize) {
+ssize_t zip_entries_unlink(struct zip_t *zip, char *const entries[],
+                           size_t len) {
   mz_zip_archive *pzip = NULL;
-  mz_uint idx;
-  size_t size = 0;
+  struct zip_entry_mark_t *entry_mark = NULL;
+  mz_bool *deleted_entry_flag_array = NULL;
+  size_t i, n = 0, deleted_entry_num = 0;
+  ssize_t err = 0;
 
-  if (!zip) {
-    // zip_t handler is not initialized
-    return (ssize_t)ZIP_ENOINIT;
+  if (zip == NULL || (entries == NULL && len != 0)) {
+    return ZIP_ENOINIT;
   }
 
   pzip = &(zip->archive);
-  if (pzip->m_zip_mode != MZ_ZIP_MODE_READING ||
-      zip->entry.index < (ssize_t)0) {
-    // the entry is not found or we do not have read access
-    return (ssize_t)ZIP_ENOENT;
+  if (pzip->m_zip_mode != MZ_ZIP_MODE_WRITING) {
+    // The central directory is only written back in write modes
+    return ZIP_EINVMODE;
+  }
+  if (len == 0) {
+    return 0;
   }
 
-  idx = (mz_uint)zip->entry.index;
-  if (mz_zip_reader_is_file_a_directory(pzip, idx)) {
-    // the entry is a directory
-    return (ssize_t)ZIP_EINVENTTYPE;
+  n = (size_t)pzip->m_total_files;
+  entry_mark =
+      (struct zip_entry_mark_t *)calloc(n + 1, sizeof(struct zip_entry_mark_t));
+  deleted_entry_flag_array = (mz_bool *)calloc(n + 1, sizeof(mz_bool));
+  if (!entry_mark || !deleted_entry_flag_array) {
+    err = ZIP_EOOMEM;
+    goto cleanup;
   }
 
-  *buf = mz_zip_reader_extract_to_heap(pzip, idx, &size, 0);
-  if (*buf && bufsize) {
-    *bufsize = size;
+  if ((err = zip_entry_mark(zip, entry_mark, (ssize_t)n, entries, len)) < 0) {
+    goto cleanup;
   }
-  return (ssize_t)size;
+  for (i = 0; i < n; ++i) {
+    if (entry_mark[i].type == MZ_DELETE) {
+      deleted_entry_flag_array[i] = MZ_TRUE;
+      deleted_entry_num++;
+    }
+  }
+
+  if (deleted_entry_num > 0) {
+    // File indices shift once entries are removed.
+    zip_index_free(zip);
+    zip_central_dir_delete(pzip->m_pState, deleted_entry_flag_array, (int)n);
+    pzip->m_total_files = (mz_uint32)(n - deleted_entry_num);
+    zip_space_unlink(zip, deleted_entry_flag_array, n);
+  }
+  err = (ssize_t)deleted_entry_num;
+
+cleanup:
+  CLEANUP(entry_mark);
+  CLEANUP(deleted_entry_flag_array);
+  return err;
 }
 
-ssize_t zip_entry_noallocread(struct zip_t *zip, void *buf, size_t bufsize) {
-  mz_zip_archive *pzip = NULL;
+int zip_reclaimable(struct zip_t *zip, unsigned long long *bytes) {
+  mz_uint64 used = 0;
+  size_t i;
+  int err = 0;
 
-  if (!zip) {
+  if (!zip || !bytes) {
     // zip_t handler is not initialized
-    return (ssize_t)ZIP_ENOINIT;
+    return ZIP_ENOINIT;
   }
 
-  pzip = &(zip->archive);
-  if (pzip->m_zip_mode != MZ_ZIP_MODE_READING ||
-      zip->entry.index < (ssize_t)0) {
-    // the entry is not found or we do not have read access
-    return (ssize_t)ZIP_ENOENT;
+  if ((err = zip_write_buffer_flush(zip)) < 0 ||
+      (err = zip_space_update(zip)) < 0) {
+    return err;
   }
-
-  if (!mz_zip_reader_extract_to_mem_no_alloc(pzip, (mz_uint)zip->entry.index,
-                                             buf, bufsize, 0, NULL, 0)) {
-    return (ssize_t)ZIP_EMEMNOALLOC;
+  for (i = 0; i < zip->space->len; ++i) {
+    used += zip->space->extents[i].size;
   }
-
-  return (ssize_t)zip->entry.uncomp_size;
+  *bytes = (unsigned long long)(zip_data_end(&zip->archive) -
+                                zip->space->start - used);
+  return 0;
 }
 
-int zip_entry_fread(struct zip_t *zip, const char *filename) {
+ssize_t zip_compact(struct zip_t *zip, size_t budget) {
   mz_zip_archive *pzip = NULL;
-  mz_uint idx;
-  mz_uint32 xattr = 0;
-  mz_zip_archive_file_stat info;
+  struct zip_space_t *space = NULL;
+  mz_uint64 pos = 0, moved = 0;
+  size_t i;
+  int err = 0;
 
   if (!zip) {
     // zip_t handler is not initialized
     return ZIP_ENOINIT;
   }
 
-  memset((void *)&info, 0, sizeof(mz_zip_archive_file_stat));
   pzip = &(zip->archive);
-  if (pzip->m_zip_mode != MZ_ZIP_MODE_READING ||
-      zip->entry.index < (ssize_t)0) {
-    // the entry is not found or we do not have read access
-    return ZIP_ENOENT;
+  if (pzip->m_zip_mode != MZ_ZIP_MODE_WRITING || !pzip->m_pState->m_pFile ||
+      zip->entry.name) {
+    // Needs an archive file open for writing, between entries
+    return ZIP_EINVMODE;
   }
 
-  idx = (mz_uint)zip->entry.index;
-  if (mz_zip_reader_is_file_a_directory(pzip, idx)) {
-    // the entry is a directory
-    return ZIP_EINVENTTYPE;
+  if ((err = zip_write_buffer_flush(zip)) < 0 ||
+      (err = zip_space_update(zip)) < 0) {
+    return err;
   }
 
-  if (!mz_zip_reader_extract_to_file(pzip, idx, filename, 0)) {
-    return ZIP_ENOFILE;
+  // Slide entries down into the holes in front of them, first to last, so a
+  // call which runs out of budget leaves the holes at the end.
+  space = zip->space;
+  pos = space->start;
+  for (i = 0; i < space->len; ++i) {
+    struct zip_extent_t *extent = &space->extents[i];
+    if (extent->ofs > pos) {
+      if (budget && moved && moved + extent->size > budget) {
+        break;
+      }
+      if ((err = zip_files_move(zip, pos, extent->ofs, extent->size)) < 0 ||
+          (err = zip_central_dir_set_offset(pzip, extent->index, pos)) < 0) {
+        return err;
+      }
+      extent->ofs = pos;
+      moved += extent->size;
+    }
+    pos = MZ_MAX(pos, extent->ofs + extent->size);
   }
 
-#if defined(_MSC_VER) || defined(PS4)
-  (void)xattr; // unused
-#else
-  if (!mz_zip_reader_file_stat(pzip, idx, &info)) {
-    // Cannot get information about zip archive;
-    return ZIP_ENOFILE;
+  if (i == space->len && pos < pzip->m_archive_size) {
+    // The central directory goes right after the last entry, the file is
+    // truncated there on close.
+    pzip->m_archive_size = pos;
   }
+  return (ssize_t)moved;
+}
 
-  xattr = (info.m_external_attr >> 16) & 0xFFFF;
-  if (xattr > 0 && xattr <= MZ_UINT16_MAX) {
-    if (CHMOD(filename, (mode_t)xattr) < 0) {
-      return ZIP_ENOPERM;
+// Picks where a replacement of the entry at extents[k] goes: its own slot
+// with the holes around it if that's enough, else the first hole which is,
+// else the end of the data. need tells the bytes an entry takes at an offset.
+static mz_uint64 zip_space_place(struct zip_t *zip, size_t k,
+                                 mz_uint64 (*need)(mz_uint64, mz_uint64),
+                                 mz_uint64 size) {
+  struct zip_space_t *space = zip->space;
+  mz_uint64 end = zip_data_end(&zip->archive);
+  mz_uint64 prev_end = space->start, slot = 0;
+  size_t j;
+
+  slot = k > 0 ? space->extents[k - 1].ofs + space->extents[k - 1].size
+               : space->start;
+  if ((k + 1 < space->len ? space->extents[k + 1].ofs : end) >=
+      slot + need(slot, size)) {
+    return slot;
+  }
+
+  for (j = 0; j < space->len; ++j) {
+    if (j == k) {
+      continue;
+    }
+    if (space->extents[j].ofs >= prev_end + need(prev_end, size)) {
+      return prev_end;
     }
+    prev_end =
+        MZ_MAX(prev_end, space->extents[j].ofs + space->extents[j].size);
   }
-#endif
+  return prev_end;
+}
 
-  return 0;
+static mz_uint64 zip_entry_need(mz_uint64 ofs, mz_uint64 size) {
+  // Local header with a zip64 offset past 4 GB, data and data descriptor.
+  return MZ_ZIP_LOCAL_DIR_HEADER_SIZE + size +
+         (ofs >= MZ_UINT32_MAX ? 4 + sizeof(mz_uint64) : 0) +
+         MZ_ZIP_DATA_DESCRIPTER_SIZE64;
 }
 
-int zip_entry_extract(struct zip_t *zip,
-                      size_t (*on_extract)(void *arg, uint64_t offset,
-                                           const void *buf, size_t bufsize),
-                      void *arg) {
+int zip_entry_replace(struct zip_t *zip, const char *entryname,
+                      const void *buf, size_t bufsize) {
   mz_zip_archive *pzip = NULL;
-  mz_uint idx;
+  mz_zip_archive_file_stat stats;
+  mz_bool *deleted_entry_flag_array = NULL;
+  void *comp = NULL, *backup = NULL;
+  const void *data = buf;
+  size_t comp_len = bufsize, namelen = 0, i, k = 0, n = 0, backup_len = 0;
+  mz_uint64 end = 0, lo = 0, hi = 0;
+  mz_uint level = 0;
+  mz_uint32 uncomp_crc32 = 0;
+  ssize_t index = -1;
+  char *name = NULL;
+  int err = 0;
 
-  if (!zip) {
+  if (!zip || !entryname || (!buf && bufsize)) {
     // zip_t handler is not initialized
     return ZIP_ENOINIT;
   }
 
   pzip = &(zip->archive);
-  if (pzip->m_zip_mode != MZ_ZIP_MODE_READING ||
-      zip->entry.index < (ssize_t)0) {
-    // the entry is not found or we do not have read access
-    return ZIP_ENOENT;
+  if (pzip->m_zip_mode != MZ_ZIP_MODE_WRITING || !pzip->m_pRead ||
+      zip->entry.name) {
+    // Needs an archive open for writing, between entries
+    return ZIP_EINVMODE;
   }
 
-  idx = (mz_uint)zip->entry.index;
-  return (mz_zip_reader_extract_to_callback(pzip, idx, on_extract, arg, 0))
-             ? 0
-             : ZIP_EINVIDX;
-}
-
-ssize_t zip_entries_total(struct zip_t *zip) {
-  if (!zip) {
-    // zip_t handler is not initialized
-    return ZIP_ENOINIT;
+#ifdef ZIP_RAW_ENTRYNAME
+  name = STRCLONE(entryname);
+#else
+  name = zip_strrpl(entryname, strlen(entryname), '\\', '/');
+#endif
+  if (!name) {
+    return ZIP_EINVENTNAME;
   }
+  namelen = strlen(name);
 
-  return (ssize_t)zip->archive.m_total_files;
-}
-
-ssize_t zip_entries_delete(struct zip_t *zip, char *const entries[],
-                           size_t len) {
-  ssize_t n = 0;
-  ssize_t err = 0;
-  struct zip_entry_mark_t *entry_mark = NULL;
-
-  if (zip == NULL || (entries == NULL && len != 0)) {
-    return ZIP_ENOINIT;
+  n = (size_t)pzip->m_total_files;
+  for (i = 0; i < n && index < 0; ++i) {
+    size_t len = 0;
+    const char *other = zip_index_name(pzip, (mz_uint)i, &len);
+    if (len == namelen && !memcmp(name, other, len)) {
+      index = (ssize_t)i;
+    }
   }
-
-  if (entries == NULL && len == 0) {
-    return 0;
+  if (index < 0 || !mz_zip_reader_file_stat(pzip, (mz_uint)index, &stats)) {
+    err = ZIP_ENOENT;
+    goto cleanup;
   }
 
-  n = zip_entries_total(zip);
+  // Compressed up front, where it goes depends on the compressed size. Data
+  // not worth deflating is stored, as zip_entry_write would.
+  uncomp_crc32 =
+      (mz_uint32)mz_crc32(MZ_CRC32_INIT, (const mz_uint8 *)buf, bufsize);
+  level = zip->level & 0xF;
+  if (level && bufsize >= ZIP_PROBE_MIN && zip_store_threshold(zip) >= 0) {
+    if (!zip->entry.comp &&
+        !(zip->entry.comp =
+              (tdefl_compressor *)malloc(sizeof(tdefl_compressor)))) {
+      err = ZIP_EOOMEM;
+      goto cleanup;
+    }
+    if (zip_probe_incompressible(zip->entry.comp, (const mz_uint8 *)buf,
+                                 bufsize, zip_store_threshold(zip))) {
+      level = 0;
+    }
+  }
+  if (level) {
+    comp = tdefl_compress_mem_to_heap(
+        buf, bufsize, &comp_len,
+        (int)tdefl_create_comp_flags_from_zip_params((int)level, -15,
+                                                     MZ_DEFAULT_STRATEGY));
+    if (!comp) {
+      err = ZIP_ETDEFLBUF;
+      goto cleanup;
+    }
+    data = comp;
+  }
 
-  entry_mark = (struct zip_entry_mark_t *)calloc(
-      (size_t)n, sizeof(struct zip_entry_mark_t));
-  if (!entry_mark) {
-    return ZIP_EOOMEM;
+  if ((err = zip_write_buffer_flush(zip)) < 0 ||
+      (err = zip_space_update(zip)) < 0) {
+    goto cleanup;
+  }
+  for (k = 0; k < zip->space->len; ++k) {
+    if (zip->space->extents[k].index == (mz_uint32)index) {
+      break;
+    }
   }
 
-  zip->archive.m_zip_mode = MZ_ZIP_MODE_READING;
+  // The entry is written where the archive would append it, so point the
+  // end there for the time being.
+  end = pzip->m_archive_size;
+  if (!pzip->m_file_offset_alignment && k < zip->space->len) {
+    pzip->m_archive_size =
+        zip_space_place(zip, k, zip_entry_need, namelen + comp_len);
+
+    // Keep the old bytes the new entry covers, to put them back if writing
+    // fails part way.
+    lo = MZ_MAX(pzip->m_archive_size, zip->space->extents[k].ofs);
+    hi = MZ_MIN(pzip->m_archive_size +
+                    zip_entry_need(pzip->m_archive_size, namelen + comp_len),
+                zip->space->extents[k].ofs + zip->space->extents[k].size);
+    if (hi > lo) {
+      backup_len = (size_t)(hi - lo);
+      if (!(backup = malloc(backup_len))) {
+        pzip->m_archive_size = end;
+        err = ZIP_EOOMEM;
+        goto cleanup;
+      }
+      if (pzip->m_pRead(pzip->m_pIO_opaque, lo, backup, backup_len) !=
+          backup_len) {
+        pzip->m_archive_size = end;
+        err = ZIP_EFREAD;
+        goto cleanup;
+      }
+    }
+  }
 
-  err = zip_entry_set(zip, entry_mark, n, entries, len);
+  if ((err = _zip_entry_open(zip, name, 1, level ? MZ_DEFLATED : 0, -1,
+                             MZ_DEFAULT_STRATEGY)) < 0) {
+    pzip->m_archive_size = end;
+    goto cleanup;
+  }
+  zip->entry.external_attr = stats.m_external_attr;
+  if (comp_len > 0) {
+    err = zip_entry_write_data(zip, data, comp_len);
+  }
+  zip->entry.uncomp_crc32 = uncomp_crc32;
+  zip->entry.uncomp_size = bufsize;
+  if (err == 0) {
+    // Not committed yet, the archive ends elsewhere for the time being.
+    err = zip_entry_finish(zip);
+  }
   if (err < 0) {
-    CLEANUP(entry_mark);
-    return err;
+    // Leave the old entry as it was, without a record for the new one.
+    zip_entry_abort(zip);
+    pzip->m_archive_size = end;
+    if (!backup ||
+        (pzip->m_pWrite(pzip->m_pIO_opaque, lo, backup, backup_len) ==
+             backup_len &&
+         zip_write_buffer_flush(zip) == 0)) {
+      goto cleanup;
+    }
+    // The old data could not be put back, so its record goes too.
+  } else {
+    pzip->m_archive_size = MZ_MAX(end, pzip->m_archive_size);
   }
 
-  err = zip_entries_delete_mark(zip, entry_mark, (int)n);
-  CLEANUP(entry_mark);
+  // Drop the old record, the new one (if any) was appended to the central
+  // directory.
+  n = (size_t)pzip->m_total_files;
+  deleted_entry_flag_array = (mz_bool *)calloc(n + 1, sizeof(mz_bool));
+  if (!deleted_entry_flag_array) {
+    err = err < 0 ? err : ZIP_EOOMEM;
+    goto cleanup;
+  }
+  deleted_entry_flag_array[index] = MZ_TRUE;
+  zip_index_free(zip);
+  zip_central_dir_delete(pzip->m_pState, deleted_entry_flag_array, (int)n);
+  pzip->m_total_files = (mz_uint32)(n - 1);
+  zip_space_unlink(zip, deleted_entry_flag_array, n);
+
+cleanup:
+  CLEANUP(deleted_entry_flag_array);
+  CLEANUP(backup);
+  CLEANUP(comp);
+  CLEANUP(name);
   return err;
 }
 
@@ -1653,6 +5045,7 @@ struct zip_t *zip_stream_open(const char *stream, size_t size, int level,
   } else {
     goto cleanup;
   }
+  zip_mutex_init(&zip->lock);
   return zip;
 
 cleanup:
@@ -1679,10 +5072,38 @@ ssize_t zip_stream_copy(struct zip_t *zip, void **buf, size_t *bufsize) {
   return (ssize_t)n;
 }
 
+ssize_t zip_stream_finalize(struct zip_t *zip, void **buf, size_t *bufsize) {
+  size_t n = 0;
+
+  if (!zip || !buf) {
+    return (ssize_t)ZIP_ENOINIT;
+  }
+
+  *buf = NULL;
+  if (!mz_zip_writer_finalize_heap_archive(&(zip->archive), buf, &n)) {
+    // Not a heap archive opened for writing, or it cannot be finalized
+    return (ssize_t)ZIP_EINVMODE;
+  }
+
+  if (bufsize != NULL) {
+    *bufsize = n;
+  }
+  return (ssize_t)n;
+}
+
 void zip_stream_close(struct zip_t *zip) {
   if (zip) {
+    zip_readers_detach(zip);
+    zip_index_free(zip);
+    zip_space_free(zip);
+    CLEANUP(zip->entry.comp);
+    CLEANUP(zip->entry.sample);
+    CLEANUP(zip->io_buf);
+    CLEANUP(zip->rules);
     mz_zip_writer_end(&(zip->archive));
     mz_zip_reader_end(&(zip->archive));
+    zip_unmap_file(zip);
+    zip_mutex_destroy(&zip->lock);
     CLEANUP(zip);
   }
 }
@@ -1769,6 +5190,39 @@ int zip_create(const char *zipname, const char *filenames[], size_t len) {
   return err;
 }
 
+int zip_merge(const char *zipname, const char *const inputs[], size_t len) {
+  int err = 0;
+  size_t i, j, n;
+  struct zip_t *zip = NULL, *src = NULL;
+
+  if (!zipname || strlen(zipname) < 1) {
+    // zip_t archive name is empty or NULL
+    return ZIP_EINVZIPNAME;
+  }
+
+  if (!(zip = zip_open(zipname, 0, 'w'))) {
+    // Cannot initialize zip_archive writer
+    return ZIP_ENOINIT;
+  }
+
+  for (i = 0; i < len && !err; ++i) {
+    if (!inputs[i] || !(src = zip_open(inputs[i], 0, 'r'))) {
+      // Cannot open an input archive
+      err = ZIP_EOPNFILE;
+      break;
+    }
+
+    n = (size_t)src->archive.m_total_files;
+    for (j = 0; j < n && !err; ++j) {
+      err = zip_entry_copy(zip, src, j, NULL);
+    }
+    zip_close(src);
+  }
+
+  zip_close(zip);
+  return err;
+}
+
 int zip_extract(const char *zipname, const char *dir,
                 int (*on_extract)(const char *filename, void *arg), void *arg) {
   mz_zip_archive zip_archive;
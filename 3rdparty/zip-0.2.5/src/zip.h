@@ -64,6 +64,15 @@ typedef long ssize_t; /* byte count or error */
  */
 #define ZIP_DEFAULT_COMPRESSION_LEVEL 6
 
+/**
+ * Deflate strategies, see zip_entry_open_level.
+ */
+#define ZIP_STRATEGY_DEFAULT 0  // lazy matching
+#define ZIP_STRATEGY_FILTERED 1 // prefers literals over short matches
+#define ZIP_STRATEGY_HUFFMAN 2  // literals only, no matches
+#define ZIP_STRATEGY_RLE 3      // matches at distance 1 only
+#define ZIP_STRATEGY_FIXED 4    // static Huffman codes only
+
 /**
  * Error codes
  */
@@ -96,6 +105,8 @@ typedef long ssize_t; /* byte count or error */
 #define ZIP_EFSEEK -27      // fseek error
 #define ZIP_EFREAD -28      // fread error
 #define ZIP_EFWRITE -29     // fwrite error
+#define ZIP_ECRC32 -30      // crc32 mismatch
+#define ZIP_ECORRUPT -31    // corrupt entry data
 
 /**
  * Looks up the error message string coresponding to an error number.
@@ -105,6 +116,33 @@ typedef long ssize_t; /* byte count or error */
  */
 extern ZIP_EXPORT const char *zip_strerror(int errnum);
 
+/**
+ * Updates a running CRC-32 checksum (the one stored in zip entries).
+ *
+ * Start with crc = 0. Uses carry-less multiplication or the CRC-32
+ * instructions when the CPU has them, table slicing otherwise.
+ *
+ * @param crc checksum of the preceding data.
+ * @param buf input buffer.
+ * @param len input buffer size (in bytes).
+ *
+ * @return the updated checksum.
+ */
+extern ZIP_EXPORT uint32_t zip_crc32(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * Combines the checksums of two adjacent blocks into the checksum of their
+ * concatenation, without touching the data.
+ *
+ * @param crc1 checksum of the first block.
+ * @param crc2 checksum of the second block.
+ * @param len2 length of the second block (in bytes).
+ *
+ * @return the checksum of both blocks.
+ */
+extern ZIP_EXPORT uint32_t zip_crc32_combine(uint32_t crc1, uint32_t crc2,
+                                             uint64_t len2);
+
 /**
  * @struct zip_t
  *
@@ -128,6 +166,147 @@ struct zip_t;
 extern ZIP_EXPORT struct zip_t *zip_open(const char *zipname, int level,
                                          char mode);
 
+/**
+ * Opens zip archive for reading through a read-only memory mapping of the
+ * file instead of buffered stdio.
+ *
+ * @note the file must not be truncated while the archive is open, touching a
+ *       mapped page past the new end of file faults the process.
+ *
+ * @param zipname zip archive file name.
+ * @param level compression level (0-9 are the standard zlib-style levels).
+ *
+ * @return the zip archive handler or NULL on error
+ */
+extern ZIP_EXPORT struct zip_t *zip_open_mmap(const char *zipname, int level);
+
+/**
+ * Opens an archive for appending that may have been cut short while it was
+ * written, e.g. because the writing process died.
+ *
+ * An archive with a valid central directory is opened as with mode 'a'.
+ * Otherwise the local headers are walked from the start of the file, each
+ * entry ending at its data descriptor, and the central directory is rebuilt
+ * from every complete entry. The incomplete rest of the file is cut off and
+ * the archive committed (see zip_commit), so writing can continue after the
+ * last complete entry.
+ *
+ * @note entries found that way get the attributes of new entries, local
+ *       headers do not keep them. Data is not checked against its CRC-32.
+ *
+ * @param zipname zip archive file name.
+ * @param level compression level (0-9 are the standard zlib-style levels).
+ *
+ * @return the zip archive handler or NULL on error
+ */
+extern ZIP_EXPORT struct zip_t *zip_open_resume(const char *zipname,
+                                                int level);
+
+/**
+ * Default size of the buffer coalescing writes to an archive file.
+ */
+#define ZIP_WRITE_BUFFER_SIZE (4 * 1024 * 1024)
+
+/**
+ * Sets the size of the buffer in front of an archive file opened in 'w' or
+ * 'a' mode.
+ *
+ * Sequential writes at the end of the archive are collected in the buffer
+ * and handed to the file in large chunks, so adding many small entries does
+ * not cost a seek and a write for every header and compressed chunk. The
+ * buffer is ZIP_WRITE_BUFFER_SIZE bytes by default and is allocated by the
+ * first write.
+ *
+ * @param zip zip archive handler.
+ * @param size buffer size (in bytes), 0 writes straight through.
+ *
+ * @return the return code - 0 on success, negative number (< 0) on error.
+ */
+extern ZIP_EXPORT int zip_set_write_buffer(struct zip_t *zip, size_t size);
+
+/**
+ * Default size of the chunks files are read and extracted in.
+ */
+#define ZIP_IO_BUFFER_SIZE (1024 * 1024)
+
+/**
+ * Sets the size of the chunks zip_entry_fwrite and zip_entries_fwrite read
+ * their input files in, and zip_entry_fread reads compressed data and writes
+ * the output file in.
+ *
+ * The buffer is ZIP_IO_BUFFER_SIZE bytes by default, is allocated by the
+ * first use and is kept until the archive is closed. Sizes are rounded up to
+ * a power of two of at least 32 KB. Each thread of zip_entries_fwrite reads
+ * into a buffer of its own, of the same size.
+ *
+ * @param zip zip archive handler.
+ * @param size chunk size (in bytes), 0 restores the default.
+ *
+ * @return the return code - 0 on success, negative number (< 0) on error.
+ */
+extern ZIP_EXPORT int zip_set_io_buffer(struct zip_t *zip, size_t size);
+
+/**
+ * Default gain, in percent, below which entries are stored, see
+ * zip_set_store_threshold.
+ */
+#define ZIP_STORE_THRESHOLD 3
+
+/**
+ * Sets when entries of an archive being written are stored rather than
+ * deflated.
+ *
+ * The first 64 KB written to a deflated entry are sampled before anything is
+ * compressed. Smaller writes are held back until there are 64 KB, or the
+ * entry is closed, so the sample doesn't depend on how the data is split.
+ * Entries under 4 KB are not sampled. When the sampled bytes are spread
+ * evenly over all values, as in images, video or archives, they are deflated
+ * at the fastest level, and if that saves less than percent of them the
+ * entry is stored instead. The threshold is ZIP_STORE_THRESHOLD by default.
+ *
+ * @param zip zip archive handler.
+ * @param percent the least gain worth deflating for (0-100), 0 turns
+ *                sampling off.
+ *
+ * @return the return code - 0 on success, negative number (< 0) on error.
+ */
+extern ZIP_EXPORT int zip_set_store_threshold(struct zip_t *zip, int percent);
+
+/**
+ * Commits an archive file opened in 'w', 'a' or 'd' mode, so that the file
+ * on disk is a complete archive holding every entry closed so far.
+ *
+ * The central directory is written after the last entry and the handler
+ * stays open, the next entry overwrites the directory and the next commit
+ * (or zip_close) writes it out again. A long running writer that appends
+ * now and then can thus keep one handler open, instead of reading and
+ * rewriting the whole central directory for every zip_open and zip_close.
+ *
+ * @param zip zip archive handler.
+ *
+ * @return the return code - 0 on success, negative number (< 0) on error.
+ */
+extern ZIP_EXPORT int zip_commit(struct zip_t *zip);
+
+/**
+ * Makes zip_entry_close commit the archive (see zip_commit) once any of the
+ * limits is reached since the last commit. A limit of 0 is ignored, all of
+ * them 0 turns committing off.
+ *
+ * Time is only looked at when an entry is closed, call zip_commit to flush
+ * entries added before a quiet spell.
+ *
+ * @param zip zip archive handler.
+ * @param entries number of entries added.
+ * @param bytes number of bytes the archive grew by.
+ * @param seconds number of seconds passed.
+ *
+ * @return the return code - 0 on success, negative number (< 0) on error.
+ */
+extern ZIP_EXPORT int zip_set_autocommit(struct zip_t *zip, size_t entries,
+                                         unsigned long long bytes,
+                                         unsigned int seconds);
+
 /**
  * Closes the zip archive, releases resources - always finalize.
  *
@@ -174,6 +353,25 @@ extern ZIP_EXPORT int zip_entry_open(struct zip_t *zip, const char *entryname);
 extern ZIP_EXPORT int zip_entry_opencasesensitive(struct zip_t *zip,
                                                   const char *entryname);
 
+/**
+ * Opens a new entry by name in a zip archive opened in 'w' or 'a' mode,
+ * compressed with its own level and strategy instead of the archive's.
+ *
+ * Level 0 stores the entry. Level 1 with ZIP_STRATEGY_RLE or
+ * ZIP_STRATEGY_HUFFMAN is much faster than the default on large logs or
+ * sparse data, at some cost in size.
+ *
+ * @param zip zip archive handler.
+ * @param entryname an entry name in local dictionary.
+ * @param level compression level (0-10), negative for the archive's level.
+ * @param strategy one of the ZIP_STRATEGY_* values.
+ *
+ * @return the return code - 0 on success, negative number (< 0) on error.
+ */
+extern ZIP_EXPORT int zip_entry_open_level(struct zip_t *zip,
+                                           const char *entryname, int level,
+                                           int strategy);
+
 /**
  * Opens a new entry by index in the zip archive.
  *
@@ -279,6 +477,47 @@ extern ZIP_EXPORT unsigned int zip_entry_crc32(struct zip_t *zip);
 extern ZIP_EXPORT int zip_entry_write(struct zip_t *zip, const void *buf,
                                       size_t bufsize);
 
+/**
+ * Adds a new entry holding data which has already been deflated.
+ *
+ * The data is written as given, without going through the compressor, e.g.
+ * to assemble archives from blobs deflated once and cached, or to copy the
+ * output of zip_entry_read_raw. The entry is opened and closed by the call,
+ * and left out of the archive if writing its data fails.
+ *
+ * @param zip zip archive handler.
+ * @param entryname the entry name.
+ * @param buf raw deflate stream.
+ * @param bufsize raw deflate stream size (in bytes).
+ * @param crc32 CRC-32 checksum of the uncompressed data.
+ * @param uncomp_size size of the uncompressed data (in bytes).
+ *
+ * @return the return code - 0 on success, negative number (< 0) on error.
+ */
+extern ZIP_EXPORT int zip_entry_write_raw(struct zip_t *zip,
+                                          const char *entryname,
+                                          const void *buf, size_t bufsize,
+                                          uint32_t crc32,
+                                          unsigned long long uncomp_size);
+
+/**
+ * Adds a new entry holding a copy of an entry of another archive.
+ *
+ * The compressed data is copied verbatim, with copy_file_range on Linux when
+ * both archives are files, and only the headers are written anew. Stored and
+ * deflated entries can be copied, encrypted ones cannot. If the copy fails
+ * part way, no entry is added.
+ *
+ * @param zip zip archive handler, opened for writing.
+ * @param src zip archive handler, opened for reading.
+ * @param index index of the entry in src.
+ * @param entryname name of the new entry, or NULL to keep the source name.
+ *
+ * @return the return code - 0 on success, negative number (< 0) on error.
+ */
+extern ZIP_EXPORT int zip_entry_copy(struct zip_t *zip, struct zip_t *src,
+                                     size_t index, const char *entryname);
+
 /**
  * Compresses a file for the current zip entry.
  *
@@ -289,6 +528,90 @@ extern ZIP_EXPORT int zip_entry_write(struct zip_t *zip, const void *buf,
  */
 extern ZIP_EXPORT int zip_entry_fwrite(struct zip_t *zip, const char *filename);
 
+/**
+ * Compresses files into new entries of the zip archive, named after the
+ * files.
+ *
+ * With more than one thread the files are compressed concurrently and the
+ * entries are written in input order as they complete, giving the same
+ * output as calling zip_entry_open, zip_entry_fwrite and zip_entry_close for
+ * every file. An entry is written for every file, even if it fails.
+ *
+ * @param zip zip archive handler.
+ * @param filenames input files.
+ * @param len number of input files.
+ * @param threads maximum number of files compressed at the same time, no
+ *                more than ZIP_MAX_THREADS are used.
+ *
+ * @return the return code - 0 on success, otherwise the first error met
+ *         (< 0).
+ */
+extern ZIP_EXPORT int zip_entries_fwrite(struct zip_t *zip,
+                                         const char *const filenames[],
+                                         size_t len, int threads);
+
+/**
+ * A rule of a compression policy, see zip_set_policy.
+ */
+struct zip_rule_t {
+  const char *pattern;         // glob the file name matches, NULL any name
+  unsigned long long min_size; // smallest file size matched, in bytes
+  unsigned long long max_size; // largest file size matched, 0 no limit
+  int level;    // compression level (0-10), 0 stores, -1 the archive's
+  int strategy; // one of the ZIP_STRATEGY_* values
+  int threads;  // more than 1 deflates each file in blocks on that many
+};
+
+/**
+ * Sets how zip_entries_fwrite compresses each file, so that logs, images
+ * and huge files can each be handled their own way in one pass.
+ *
+ * Every file is compressed as the first rule it matches says, or at the
+ * archive's level when none does. A pattern without a slash is matched
+ * against the file's base name, otherwise against the whole name; '*'
+ * stands for any run of characters and '?' for one, ignoring case. The
+ * file is only looked at on disk for rules with a size range. The rules
+ * are copied, len 0 removes them.
+ *
+ * @param zip zip archive handler.
+ * @param rules the rules, in the order they are tried.
+ * @param len number of rules.
+ *
+ * @return the return code - 0 on success, negative number (< 0) on error.
+ */
+extern ZIP_EXPORT int zip_set_policy(struct zip_t *zip,
+                                     const struct zip_rule_t *rules,
+                                     size_t len);
+
+/**
+ * Most threads a call compresses on, larger requests are clamped to it.
+ */
+#define ZIP_MAX_THREADS 64
+
+/**
+ * Compresses a single file into the current zip entry using several
+ * threads.
+ *
+ * The file is cut into 1 MB blocks which are deflated concurrently, each
+ * one primed with the 32 KB that precede it, and stitched back together in
+ * order. Meant for very large files; the result is a regular deflate stream
+ * whose compressed size is within a fraction of a percent of the serial one.
+ *
+ * The entry must have been opened with zip_entry_open and nothing written
+ * to it yet, and nothing else may be written to it afterwards. Falls back to
+ * zip_entry_fwrite for a single thread or a stored entry.
+ *
+ * @param zip zip archive handler.
+ * @param filename input file.
+ * @param threads maximum number of blocks compressed at the same time, at
+ *                most ZIP_MAX_THREADS.
+ *
+ * @return the return code - 0 on success, negative number (< 0) on error.
+ */
+extern ZIP_EXPORT int zip_entry_fwrite_parallel(struct zip_t *zip,
+                                                const char *filename,
+                                                int threads);
+
 /**
  * Extracts the current zip entry into output buffer.
  *
@@ -307,6 +630,47 @@ extern ZIP_EXPORT int zip_entry_fwrite(struct zip_t *zip, const char *filename);
 extern ZIP_EXPORT ssize_t zip_entry_read(struct zip_t *zip, void **buf,
                                          size_t *bufsize);
 
+/**
+ * Reads the data of the current zip entry exactly as it is stored in the
+ * archive, without inflating it.
+ *
+ * For a deflated entry this is a raw deflate stream, which can be handed to
+ * clients accepting deflate, or wrapped into gzip with zip_entry_gzip_frame.
+ *
+ * @param zip zip archive handler.
+ * @param buf output buffer.
+ * @param bufsize output buffer size (in bytes).
+ *
+ * @note remember to release memory allocated for a output buffer.
+ *
+ * @return the return code - the number of bytes actually read on success.
+ *         Otherwise a negative number (< 0) on error.
+ */
+extern ZIP_EXPORT ssize_t zip_entry_read_raw(struct zip_t *zip, void **buf,
+                                             size_t *bufsize);
+
+#define ZIP_GZIP_HEADER_SIZE 10
+#define ZIP_GZIP_TRAILER_SIZE 8
+
+/**
+ * Builds the gzip header and trailer which turn the raw data of the current
+ * deflated zip entry into a gzip member, using the CRC-32 and size recorded
+ * in the central directory.
+ *
+ * @param zip zip archive handler.
+ * @param header output for the ZIP_GZIP_HEADER_SIZE bytes written before the
+ *        raw data.
+ * @param trailer output for the ZIP_GZIP_TRAILER_SIZE bytes written after
+ *        the raw data.
+ *
+ * @return the return code - 0 on success, negative number (< 0) on error
+ *         (ZIP_EINVENTTYPE if the entry is not deflated).
+ */
+extern ZIP_EXPORT int
+zip_entry_gzip_frame(struct zip_t *zip,
+                     unsigned char header[ZIP_GZIP_HEADER_SIZE],
+                     unsigned char trailer[ZIP_GZIP_TRAILER_SIZE]);
+
 /**
  * Extracts the current zip entry into a memory buffer using no memory
  * allocation.
@@ -330,6 +694,9 @@ extern ZIP_EXPORT ssize_t zip_entry_noallocread(struct zip_t *zip, void *buf,
 /**
  * Extracts the current zip entry into output file.
  *
+ * The output file is removed again if the entry turns out to be corrupt
+ * (ZIP_ECORRUPT), fails its CRC-32 check (ZIP_ECRC32) or cannot be written.
+ *
  * @param zip zip archive handler.
  * @param filename output file.
  *
@@ -353,6 +720,80 @@ zip_entry_extract(struct zip_t *zip,
                                        const void *data, size_t size),
                   void *arg);
 
+/**
+ * @struct zip_entry_reader_t
+ *
+ * Incremental reader for a single zip entry - forward declaration.
+ */
+struct zip_entry_reader_t;
+
+/**
+ * Opens an incremental reader for the current zip entry.
+ *
+ * The reader inflates the entry chunk by chunk into caller supplied buffers,
+ * so entries of any size can be processed with a fixed amount of memory.
+ * Readers which are still open when the archive is closed are detached and
+ * will fail on subsequent reads - they still have to be closed.
+ *
+ * @param zip zip archive handler.
+ *
+ * @return the reader handler or NULL on error.
+ */
+extern ZIP_EXPORT struct zip_entry_reader_t *
+zip_entry_reader_open(struct zip_t *zip);
+
+/**
+ * Opens an incremental reader returning the data of the current zip entry
+ * as stored in the archive, without inflating it.
+ *
+ * @param zip zip archive handler.
+ *
+ * @return the reader handler or NULL on error.
+ */
+extern ZIP_EXPORT struct zip_entry_reader_t *
+zip_entry_reader_open_raw(struct zip_t *zip);
+
+/**
+ * Opens an incremental reader for the zip entry at the given index, without
+ * changing the current entry.
+ *
+ * Archives opened for reading with zip_open or zip_open_mmap use positional
+ * reads, so several threads may open, read and close their own readers on one
+ * shared handle at the same time. The zip_entry_* functions which work on the
+ * current entry still need a handle per thread.
+ *
+ * @param zip zip archive handler.
+ * @param index index in local dictionary.
+ *
+ * @return the reader handler or NULL on error.
+ */
+extern ZIP_EXPORT struct zip_entry_reader_t *
+zip_entry_reader_openbyindex(struct zip_t *zip, size_t index);
+
+/**
+ * Reads the next chunk of uncompressed data from the zip entry reader.
+ *
+ * @param reader zip entry reader handler.
+ * @param buf output buffer.
+ * @param bufsize output buffer size (in bytes).
+ *
+ * @return the return code - the number of bytes actually read on success,
+ *         0 at the end of the entry. Otherwise a negative number (< 0) on
+ *         error.
+ */
+extern ZIP_EXPORT ssize_t zip_entry_reader_read(struct zip_entry_reader_t *reader,
+                                                void *buf, size_t bufsize);
+
+/**
+ * Closes the zip entry reader and releases resources.
+ *
+ * @param reader zip entry reader handler.
+ *
+ * @return the return code - 0 on success, negative number (< 0) on error
+ *         (e.g. the CRC-32 checksum of a fully read entry does not match).
+ */
+extern ZIP_EXPORT int zip_entry_reader_close(struct zip_entry_reader_t *reader);
+
 /**
  * Returns the number of all entries (files and directories) in the zip archive.
  *
@@ -363,6 +804,56 @@ zip_entry_extract(struct zip_t *zip,
  */
 extern ZIP_EXPORT ssize_t zip_entries_total(struct zip_t *zip);
 
+/**
+ * @struct zip_entry_info_t
+ *
+ * Central directory record of a single zip entry.
+ */
+struct zip_entry_info_t {
+  const char *name; /* stored name, not NUL terminated */
+  size_t namelen;
+  unsigned long long uncomp_size;
+  unsigned long long comp_size;
+  uint32_t crc32;
+  uint16_t method;
+  unsigned long long header_offset;
+  int64_t m_time;
+  int isdir;
+};
+
+/**
+ * Reads the central directory record of the entry at the given index, without
+ * opening the entry or allocating any memory.
+ *
+ * @note info->name points into the archive's central directory and stays valid
+ *       until the archive is modified or closed.
+ *
+ * @param zip zip archive handler.
+ * @param index index in local dictionary.
+ * @param info output record.
+ *
+ * @return the return code - 0 on success, negative number (< 0) on error.
+ */
+extern ZIP_EXPORT int zip_entry_info(struct zip_t *zip, size_t index,
+                                     struct zip_entry_info_t *info);
+
+/**
+ * Finds the entries with any of the given names, in one pass over the
+ * central directory. Names are case sensitive, backslashes in them match
+ * slashes.
+ *
+ * @param zip zip archive handler.
+ * @param entries array of entry names to look for.
+ * @param len the number of names.
+ * @param indices receives the index of every matching entry, in ascending
+ *                order. It must have room for zip_entries_total() indices.
+ *
+ * @return the number of indices written, or negative number (< 0) on error.
+ */
+extern ZIP_EXPORT ssize_t zip_entries_select(struct zip_t *zip,
+                                             char *const entries[], size_t len,
+                                             size_t *indices);
+
 /**
  * Deletes zip archive entries.
  *
@@ -374,6 +865,69 @@ extern ZIP_EXPORT ssize_t zip_entries_total(struct zip_t *zip);
 extern ZIP_EXPORT ssize_t zip_entries_delete(struct zip_t *zip,
                                              char *const entries[], size_t len);
 
+/**
+ * Deletes zip archive entries from the central directory only. Their data
+ * stays in the file as holes until zip_compact moves the entries after
+ * them down.
+ *
+ * @param zip zip archive handler.
+ * @param entries array of zip archive entries to be deleted.
+ * @param len the number of entries to be deleted.
+ * @return the number of deleted entries, or negative number (< 0) on error.
+ */
+extern ZIP_EXPORT ssize_t zip_entries_unlink(struct zip_t *zip,
+                                             char *const entries[], size_t len);
+
+/**
+ * Counts the bytes in front of the central directory which no entry
+ * covers, such as the ones zip_entries_unlink and zip_entry_replace leave.
+ *
+ * @param zip zip archive handler.
+ * @param bytes receives the count.
+ *
+ * @return the return code - 0 on success, negative number (< 0) on error.
+ */
+extern ZIP_EXPORT int zip_reclaimable(struct zip_t *zip,
+                                      unsigned long long *bytes);
+
+/**
+ * Moves entries down into the holes in front of them, first to last. Once
+ * no holes are left the file is truncated after the last entry on close.
+ *
+ * @param zip zip archive handler, opened for writing.
+ * @param budget stop before moving more than this many bytes, 0 for no
+ *               limit. Entries are moved whole, so the first one is moved
+ *               even if it is larger.
+ *
+ * @return the number of bytes moved, or negative number (< 0) on error.
+ */
+extern ZIP_EXPORT ssize_t zip_compact(struct zip_t *zip, size_t budget);
+
+/**
+ * Replaces the data of an entry. The new data is compressed up front, at
+ * the archive's level, or stored if deflating would not pay (see
+ * zip_set_store_threshold). It is written over the old entry if it fits
+ * there, into the first hole which is large enough otherwise, or after the
+ * last entry. Holes left behind are reused by later replacements and
+ * reclaimed by zip_compact.
+ *
+ * The entry keeps its name and attributes and moves to the end of the
+ * central directory, so its index changes.
+ *
+ * If writing fails, the old data is put back where it was overwritten and
+ * the entry is left unchanged. Only if that fails too is the entry removed.
+ *
+ * @param zip zip archive handler, opened for writing.
+ * @param entryname the name of the entry, matched case sensitively.
+ * @param buf the new data.
+ * @param bufsize the size of buf in bytes.
+ *
+ * @return the return code - 0 on success, negative number (< 0) on error.
+ */
+extern ZIP_EXPORT int zip_entry_replace(struct zip_t *zip,
+                                        const char *entryname,
+                                        const void *buf, size_t bufsize);
+
 /**
  * Extracts a zip archive stream into directory.
  *
@@ -419,6 +973,22 @@ extern ZIP_EXPORT struct zip_t *zip_stream_open(const char *stream, size_t size,
 extern ZIP_EXPORT ssize_t zip_stream_copy(struct zip_t *zip, void **buf,
                                           size_t *bufsize);
 
+/**
+ * Finalizes a zip archive stream opened for writing and hands its output
+ * buffer over to the caller without copying it.
+ *
+ * No more entries can be added afterwards, but the archive still has to be
+ * released with zip_stream_close.
+ *
+ * @param zip zip archive handler.
+ * @param buf output buffer. User should free buf.
+ * @param bufsize output buffer size (in bytes).
+ *
+ * @return the output buffer size on success, negative number (< 0) on error.
+ */
+extern ZIP_EXPORT ssize_t zip_stream_finalize(struct zip_t *zip, void **buf,
+                                              size_t *bufsize);
+
 /**
  * Close zip archive releases resources.
  *
@@ -440,6 +1010,21 @@ extern ZIP_EXPORT void zip_stream_close(struct zip_t *zip);
 extern ZIP_EXPORT int zip_create(const char *zipname, const char *filenames[],
                                  size_t len);
 
+/**
+ * Creates a new archive holding the entries of several archives, in order.
+ *
+ * Entries are copied as they are stored, see zip_entry_copy, so nothing is
+ * inflated or deflated again. Names repeated across inputs are kept.
+ *
+ * @param zipname zip archive file.
+ * @param inputs input zip archive files.
+ * @param len number of input archives.
+ *
+ * @return the return code - 0 on success, negative number (< 0) on error.
+ */
+extern ZIP_EXPORT int zip_merge(const char *zipname, const char *const inputs[],
+                                size_t len);
+
 /**
  * Extracts a zip archive file into directory.
  *
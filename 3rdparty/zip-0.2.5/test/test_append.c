@@ -78,10 +78,179 @@ MU_TEST(test_append) {
   zip_close(zip);
 }
 
+static ssize_t entries_on_disk(void) {
+  struct zip_t *zip = zip_open(ZIPNAME, 0, 'r');
+  ssize_t n = zip ? zip_entries_total(zip) : -1;
+  zip_close(zip);
+  return n;
+}
+
+MU_TEST(test_append_commit) {
+  struct zip_t *zip = zip_open(ZIPNAME, ZIP_DEFAULT_COMPRESSION_LEVEL, 'a');
+  ssize_t n = entries_on_disk();
+  char name[32];
+  int i;
+  mu_check(zip != NULL);
+
+  mu_assert_int_eq(0, zip_set_autocommit(zip, 2, 0, 0));
+  for (i = 0; i < 5; ++i) {
+    sprintf(name, "log/%d.txt", i);
+    mu_assert_int_eq(0, zip_entry_open(zip, name));
+    mu_assert_int_eq(0, zip_entry_write(zip, TESTDATA2, strlen(TESTDATA2)));
+    mu_assert_int_eq(0, zip_entry_close(zip));
+    // Every other entry reaches the file, the archive stays open.
+    mu_assert_int_eq(n + (i + 1) / 2 * 2, entries_on_disk());
+  }
+
+  mu_assert_int_eq(0, zip_entry_open(zip, "log/5.txt"));
+  mu_assert_int_eq(ZIP_EINVMODE, zip_commit(zip));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  mu_assert_int_eq(0, zip_commit(zip));
+  mu_assert_int_eq(n + 6, entries_on_disk());
+  mu_assert_int_eq(0, zip_commit(zip));
+
+  mu_assert_int_eq(0, zip_entry_open(zip, "log/6.txt"));
+  mu_assert_int_eq(0, zip_entry_write(zip, TESTDATA1, strlen(TESTDATA1)));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  zip_close(zip);
+
+  zip = zip_open(ZIPNAME, 0, 'r');
+  mu_assert_int_eq(n + 7, zip_entries_total(zip));
+  mu_assert_int_eq(0, zip_entry_open(zip, "log/4.txt"));
+  mu_check(CRC32DATA2 == zip_entry_crc32(zip));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  mu_assert_int_eq(0, zip_entry_open(zip, "test/test-1.txt"));
+  mu_assert_int_eq(strlen(TESTDATA1), zip_entry_size(zip));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  mu_assert_int_eq(ZIP_EINVMODE, zip_commit(zip));
+  zip_close(zip);
+}
+
+// Copies the first len bytes of a file, what a crash could have left.
+static long copy_prefix(const char *from, const char *to, long len) {
+  FILE *in = fopen(from, "rb"), *out = fopen(to, "wb");
+  char buf[4096];
+  size_t n = 0;
+  long done = 0;
+
+  if (len < 0 && in) {
+    fseek(in, 0, SEEK_END);
+    len = ftell(in);
+    fseek(in, 0, SEEK_SET);
+  }
+  while (in && out && done < len &&
+         (n = fread(buf, 1, (size_t)(len - done) < sizeof(buf)
+                                ? (size_t)(len - done)
+                                : sizeof(buf),
+                    in)) > 0) {
+    fwrite(buf, 1, n, out);
+    done += (long)n;
+  }
+  if (in)
+    fclose(in);
+  if (out)
+    fclose(out);
+  return done;
+}
+
+MU_TEST(test_append_resume) {
+  char copy[L_tmpnam + 16];
+  char name[32], data[64], *buf = NULL;
+  size_t bufsize = 0;
+  long len = 0;
+  FILE *file = NULL;
+  struct zip_entry_info_t info;
+  struct zip_t *zip = zip_open(ZIPNAME, ZIP_DEFAULT_COMPRESSION_LEVEL, 'w');
+  int i;
+  mu_check(zip != NULL);
+
+  sprintf(copy, "%s.copy", ZIPNAME);
+  mu_assert_int_eq(0, zip_set_autocommit(zip, 2, 0, 0));
+  for (i = 0; i < 3; ++i) {
+    sprintf(name, "part-%d.txt", i);
+    sprintf(data, "%s %d %s", TESTDATA1, i, TESTDATA2);
+    mu_assert_int_eq(0, zip_entry_open(zip, name));
+    mu_assert_int_eq(0, zip_entry_write(zip, data, strlen(data)));
+    mu_assert_int_eq(0, zip_entry_close(zip));
+    if (i == 1) {
+      // Just committed, the copy is a complete archive.
+      copy_prefix(ZIPNAME, copy, -1);
+    }
+  }
+  zip_close(zip);
+
+  zip = zip_open_resume(copy, 0);
+  mu_check(zip != NULL);
+  mu_assert_int_eq(2, zip_entries_total(zip));
+  zip_close(zip);
+
+  zip = zip_open(ZIPNAME, 0, 'r');
+  mu_assert_int_eq(0, zip_entry_info(zip, 2, &info));
+  zip_close(zip);
+
+  // Cut in the middle of the third entry, only the first two are complete.
+  copy_prefix(ZIPNAME, copy, (long)info.header_offset + 40);
+  zip = zip_open(copy, 0, 'r');
+  mu_check(zip == NULL);
+  zip = zip_open_resume(copy, 0);
+  mu_check(zip != NULL);
+  mu_assert_int_eq(2, zip_entries_total(zip));
+  zip_close(zip);
+  zip = zip_open(copy, 0, 'r');
+  mu_check(zip != NULL);
+  mu_assert_int_eq(2, zip_entries_total(zip));
+  zip_close(zip);
+
+  // Cut in the central directory, all three are.
+  len = copy_prefix(ZIPNAME, copy, -1);
+  copy_prefix(ZIPNAME, copy, len - 22);
+  zip = zip_open_resume(copy, ZIP_DEFAULT_COMPRESSION_LEVEL);
+  mu_check(zip != NULL);
+  mu_assert_int_eq(3, zip_entries_total(zip));
+  mu_assert_int_eq(0, zip_entry_open(zip, "part-3.txt"));
+  mu_assert_int_eq(0, zip_entry_write(zip, TESTDATA2, strlen(TESTDATA2)));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  zip_close(zip);
+
+  zip = zip_open(copy, 0, 'r');
+  mu_check(zip != NULL);
+  mu_assert_int_eq(4, zip_entries_total(zip));
+  mu_assert_int_eq(0, zip_entry_open(zip, "part-2.txt"));
+  mu_check(zip_entry_read(zip, (void **)&buf, &bufsize) > 0);
+  sprintf(data, "%s %d %s", TESTDATA1, 2, TESTDATA2);
+  mu_assert_int_eq(strlen(data), bufsize);
+  mu_assert_int_eq(0, strncmp(buf, data, bufsize));
+  free(buf);
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  mu_assert_int_eq(0, zip_entry_open(zip, "part-3.txt"));
+  mu_check(CRC32DATA2 == zip_entry_crc32(zip));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  zip_close(zip);
+
+  // An empty file starts an empty archive, anything else is left alone.
+  fclose(fopen(copy, "wb"));
+  zip = zip_open_resume(copy, 0);
+  mu_check(zip != NULL);
+  mu_assert_int_eq(0, zip_entries_total(zip));
+  zip_close(zip);
+  file = fopen(copy, "wb");
+  fputs(TESTDATA1, file);
+  fclose(file);
+  mu_check(zip_open_resume(copy, 0) == NULL);
+  file = fopen(copy, "rb");
+  fseek(file, 0, SEEK_END);
+  mu_assert_int_eq(strlen(TESTDATA1), ftell(file));
+  fclose(file);
+
+  remove(copy);
+}
+
 MU_TEST_SUITE(test_append_suite) {
   MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
 
   MU_RUN_TEST(test_append);
+  MU_RUN_TEST(test_append_commit);
+  MU_RUN_TEST(test_append_resume);
 }
 
 #define UNUSED(x) (void)x
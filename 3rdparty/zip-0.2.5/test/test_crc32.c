@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <zip.h>
+
+#include "minunit.h"
+
+#define BUFSIZE 4096
+
+static unsigned char *buffer = NULL;
+
+static uint32_t crc32_bitwise(uint32_t crc, const unsigned char *buf,
+                              size_t len) {
+  int k;
+  crc = ~crc;
+  while (len--) {
+    crc ^= *buf++;
+    for (k = 0; k < 8; k++) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0xedb88320u : crc >> 1;
+    }
+  }
+  return ~crc;
+}
+
+void test_setup(void) {
+  size_t i;
+  uint32_t x = 2463534242u;
+
+  buffer = (unsigned char *)malloc(BUFSIZE);
+  for (i = 0; i < BUFSIZE; i++) {
+    // xorshift32
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    buffer[i] = (unsigned char)x;
+  }
+}
+
+void test_teardown(void) {
+  free(buffer);
+  buffer = NULL;
+}
+
+MU_TEST(test_crc32_vectors) {
+  mu_check(0 == zip_crc32(0, NULL, 0));
+  mu_check(0 == zip_crc32(0, "", 0));
+  mu_check(0xcbf43926u == zip_crc32(0, "123456789", 9));
+  mu_check(0x414fa339u ==
+           zip_crc32(0, "The quick brown fox jumps over the lazy dog", 43));
+}
+
+MU_TEST(test_crc32_lengths) {
+  size_t offset, len;
+
+  // Every alignment and every length around the folding block sizes.
+  for (offset = 0; offset < 16; offset++) {
+    for (len = 0; len + offset <= 300; len++) {
+      mu_check(crc32_bitwise(0, buffer + offset, len) ==
+               zip_crc32(0, buffer + offset, len));
+    }
+  }
+  mu_check(crc32_bitwise(0, buffer, BUFSIZE) == zip_crc32(0, buffer, BUFSIZE));
+  mu_check(crc32_bitwise(0, buffer + 3, BUFSIZE - 3) ==
+           zip_crc32(0, buffer + 3, BUFSIZE - 3));
+}
+
+MU_TEST(test_crc32_incremental) {
+  uint32_t crc = 0;
+  size_t i, step = 1;
+
+  for (i = 0; i < BUFSIZE; i += step, step = step * 3 % 199 + 1) {
+    size_t n = i + step > BUFSIZE ? BUFSIZE - i : step;
+    crc = zip_crc32(crc, buffer + i, n);
+  }
+  mu_check(crc32_bitwise(0, buffer, BUFSIZE) == crc);
+}
+
+MU_TEST(test_crc32_combine) {
+  size_t split;
+  uint32_t whole = zip_crc32(0, buffer, BUFSIZE);
+
+  for (split = 0; split <= BUFSIZE; split += 97) {
+    uint32_t crc1 = zip_crc32(0, buffer, split);
+    uint32_t crc2 = zip_crc32(0, buffer + split, BUFSIZE - split);
+    mu_check(whole == zip_crc32_combine(crc1, crc2, BUFSIZE - split));
+  }
+  mu_check(whole == zip_crc32_combine(whole, 0, 0));
+}
+
+MU_TEST_SUITE(test_crc32_suite) {
+  MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+
+  MU_RUN_TEST(test_crc32_vectors);
+  MU_RUN_TEST(test_crc32_lengths);
+  MU_RUN_TEST(test_crc32_incremental);
+  MU_RUN_TEST(test_crc32_combine);
+}
+
+#define UNUSED(x) (void)x
+
+int main(int argc, char *argv[]) {
+  UNUSED(argc);
+  UNUSED(argv);
+
+  MU_RUN_SUITE(test_crc32_suite);
+  MU_REPORT();
+  return MU_EXIT_CODE;
+}
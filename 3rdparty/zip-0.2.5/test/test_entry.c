@@ -1,6 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#if !defined(_WIN32)
+#include <signal.h>
+#include <sys/resource.h>
+#endif
+
 #include <zip.h>
 
 #include "minunit.h"
@@ -125,6 +130,50 @@ MU_TEST(test_entry_opencasesensitive) {
   zip_close(zip);
 }
 
+MU_TEST(test_entry_lookup) {
+  char name[64];
+  int i;
+
+  struct zip_t *zip = zip_open(ZIPNAME, ZIP_DEFAULT_COMPRESSION_LEVEL, 'w');
+  mu_check(zip != NULL);
+  for (i = 0; i < 1000; ++i) {
+    sprintf(name, "Dir-%d/File-%d.TXT", i % 7, i);
+    mu_assert_int_eq(0, zip_entry_open(zip, name));
+    mu_assert_int_eq(0, zip_entry_close(zip));
+  }
+  // Duplicates, the first one in the central directory wins.
+  mu_assert_int_eq(0, zip_entry_open(zip, "Dir-0/File-0.TXT"));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  mu_assert_int_eq(0, zip_entry_open(zip, "dir-1/file-1.txt"));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  zip_close(zip);
+
+  zip = zip_open(ZIPNAME, 0, 'r');
+  mu_check(zip != NULL);
+  for (i = 999; i >= 0; --i) {
+    sprintf(name, "Dir-%d/File-%d.TXT", i % 7, i);
+    mu_assert_int_eq(0, zip_entry_opencasesensitive(zip, name));
+    mu_assert_int_eq(i, zip_entry_index(zip));
+    mu_assert_int_eq(0, zip_entry_close(zip));
+
+    sprintf(name, "dir-%d\\FILE-%d.txt", i % 7, i);
+    mu_assert_int_eq(0, zip_entry_open(zip, name));
+    mu_assert_int_eq(i, zip_entry_index(zip));
+    mu_assert_int_eq(0, zip_entry_close(zip));
+  }
+
+  mu_assert_int_eq(0, zip_entry_opencasesensitive(zip, "dir-1/file-1.txt"));
+  mu_assert_int_eq(1001, zip_entry_index(zip));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+
+  mu_assert_int_eq(ZIP_ENOENT, zip_entry_open(zip, "Dir-0/File-1000.TXT"));
+  mu_assert_int_eq(ZIP_ENOENT, zip_entry_open(zip, "Dir-0/File-0.TX"));
+  mu_assert_int_eq(ZIP_ENOENT,
+                   zip_entry_opencasesensitive(zip, "dir-0/file-0.txt"));
+
+  zip_close(zip);
+}
+
 MU_TEST(test_entry_index) {
   struct zip_t *zip = zip_open(ZIPNAME, 0, 'r');
   mu_check(zip != NULL);
@@ -167,6 +216,40 @@ MU_TEST(test_entry_openbyindex) {
   zip_close(zip);
 }
 
+MU_TEST(test_entry_info) {
+  struct zip_entry_info_t info;
+  ssize_t i, n;
+
+  struct zip_t *zip = zip_open(ZIPNAME, 0, 'r');
+  mu_check(zip != NULL);
+
+  n = zip_entries_total(zip);
+  mu_assert_int_eq(total_entries, n);
+  for (i = 0; i < n; ++i) {
+    mu_assert_int_eq(0, zip_entry_info(zip, (size_t)i, &info));
+    mu_assert_int_eq(0, zip_entry_openbyindex(zip, (size_t)i));
+    mu_assert_int_eq(strlen(zip_entry_name(zip)), info.namelen);
+    mu_assert_int_eq(0, strncmp(zip_entry_name(zip), info.name, info.namelen));
+    mu_assert_int_eq(zip_entry_uncomp_size(zip), info.uncomp_size);
+    mu_assert_int_eq(zip_entry_comp_size(zip), info.comp_size);
+    mu_check(zip_entry_crc32(zip) == info.crc32);
+    mu_assert_int_eq(zip_entry_isdir(zip), info.isdir);
+    mu_assert_int_eq(0, zip_entry_close(zip));
+  }
+
+  mu_assert_int_eq(0, zip_entry_info(zip, 0, &info));
+  mu_assert_int_eq(0, strncmp("test/test-1.txt", info.name, info.namelen));
+  mu_check(CRC32DATA1 == info.crc32);
+  mu_assert_int_eq(0, info.isdir);
+
+  mu_assert_int_eq(0, zip_entry_info(zip, 2, &info));
+  mu_assert_int_eq(1, info.isdir);
+
+  mu_assert_int_eq(ZIP_EINVIDX, zip_entry_info(zip, (size_t)n, &info));
+
+  zip_close(zip);
+}
+
 MU_TEST(test_entry_read) {
   char *bufencode1 = NULL;
   char *bufencode2 = NULL;
@@ -220,6 +303,24 @@ MU_TEST(test_list_entries) {
   zip_close(zip);
 }
 
+MU_TEST(test_entries_select) {
+  char *entries[] = {"delete/file.4", "test\\test-2.txt", "missing",
+                     "delete.me", "delete.me", "TEST/TEST-1.TXT"};
+  size_t indices[32];
+
+  struct zip_t *zip = zip_open(ZIPNAME, 0, 'r');
+  mu_check(zip != NULL);
+
+  mu_assert_int_eq(3, zip_entries_select(zip, entries, 6, indices));
+  mu_assert_int_eq(1, indices[0]);
+  mu_assert_int_eq(5, indices[1]);
+  mu_assert_int_eq(10, indices[2]);
+
+  mu_assert_int_eq(0, zip_entries_select(zip, NULL, 0, indices));
+
+  zip_close(zip);
+}
+
 MU_TEST(test_entries_delete) {
   char *entries[] = {"delete.me", "_", "delete/file.1", "deleteme/file.3",
                      "delete/file.2"};
@@ -273,16 +374,375 @@ MU_TEST(test_entries_delete) {
   zip_close(zip);
 }
 
+MU_TEST(test_entries_delete_large) {
+  // Stored entries, so the gaps left by deleted ones are as large as
+  // their data.
+  const char *names[] = {"a.bin", "b.bin", "c.bin", "d.bin", "e.bin"};
+  const size_t sizes[] = {3 << 20, 100, 5 << 20, 3 << 20, 1024};
+  char *entries[] = {"a.bin", "b.bin", "d.bin"};
+  char *data = NULL, *buf = NULL;
+  size_t i, j, bufsize = 0;
+
+  data = (char *)malloc((5 << 20) + 4);
+  mu_check(data != NULL);
+  for (j = 0; j < (5 << 20) + 4; ++j) {
+    data[j] = (char)(j * 2654435761u >> 13);
+  }
+
+  struct zip_t *zip = zip_open(ZIPNAME, 0, 'w');
+  mu_check(zip != NULL);
+  for (i = 0; i < 5; ++i) {
+    mu_assert_int_eq(0, zip_entry_open(zip, names[i]));
+    mu_assert_int_eq(0, zip_entry_write(zip, data + i, sizes[i]));
+    mu_assert_int_eq(0, zip_entry_close(zip));
+  }
+  zip_close(zip);
+
+  zip = zip_open(ZIPNAME, 0, 'd');
+  mu_check(zip != NULL);
+  mu_assert_int_eq(3, zip_entries_delete(zip, entries, 3));
+  zip_close(zip);
+
+  zip = zip_open(ZIPNAME, 0, 'r');
+  mu_check(zip != NULL);
+  mu_assert_int_eq(2, zip_entries_total(zip));
+  for (i = 2; i < 5; i += 2) {
+    mu_assert_int_eq(0, zip_entry_open(zip, names[i]));
+    mu_assert_int_eq(sizes[i], zip_entry_read(zip, (void **)&buf, &bufsize));
+    mu_assert_int_eq(0, memcmp(buf, data + i, sizes[i]));
+    mu_assert_int_eq(0, zip_entry_close(zip));
+    free(buf);
+    buf = NULL;
+  }
+  mu_assert_int_eq(ZIP_ENOENT, zip_entry_open(zip, "d.bin"));
+  zip_close(zip);
+
+  free(data);
+}
+
+static void write_stored(const char *zipname, const char *const names[],
+                         const size_t sizes[], size_t n, const char *data) {
+  size_t i;
+  struct zip_t *zip = zip_open(zipname, 0, 'w');
+  for (i = 0; i < n; ++i) {
+    zip_entry_open(zip, names[i]);
+    zip_entry_write(zip, data + i, sizes[i]);
+    zip_entry_close(zip);
+  }
+  zip_close(zip);
+}
+
+static long file_size(const char *filename) {
+  long size = -1;
+  FILE *fp = fopen(filename, "rb");
+  if (fp) {
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fclose(fp);
+  }
+  return size;
+}
+
+MU_TEST(test_entries_unlink_compact) {
+  const char *names[] = {"a.bin", "b.bin", "c.bin", "d.bin", "e.bin"};
+  const char *kept[] = {"b.bin", "c.bin", "e.bin"};
+  const size_t sizes[] = {64 << 10, 100, 200 << 10, 3000, 1024};
+  const size_t kept_sizes[] = {100, 200 << 10, 1024};
+  char *entries[] = {"a.bin", "d.bin"};
+  char reference[] = "z-reference.zip";
+  unsigned long long reclaimable = 0, holes = 0;
+  char *data = NULL, *buf = NULL;
+  size_t i, bufsize = 0;
+
+  data = (char *)malloc((200 << 10) + 8);
+  mu_check(data != NULL);
+  for (i = 0; i < (200 << 10) + 8; ++i) {
+    data[i] = (char)(i * 2654435761u >> 13);
+  }
+  write_stored(ZIPNAME, names, sizes, 5, data);
+
+  struct zip_t *zip = zip_open(ZIPNAME, 0, 'd');
+  mu_check(zip != NULL);
+  mu_assert_int_eq(0, zip_reclaimable(zip, &reclaimable));
+  mu_assert_int_eq(0, reclaimable);
+  mu_assert_int_eq(2, zip_entries_unlink(zip, entries, 2));
+  mu_assert_int_eq(3, zip_entries_total(zip));
+  mu_assert_int_eq(0, zip_reclaimable(zip, &holes));
+  mu_check(holes > sizes[0] + sizes[3]);
+  zip_close(zip);
+
+  // The holes are found again from the local headers.
+  zip = zip_open(ZIPNAME, 0, 'd');
+  mu_check(zip != NULL);
+  mu_assert_int_eq(0, zip_reclaimable(zip, &reclaimable));
+  mu_assert_int_eq(holes, reclaimable);
+
+  // b.bin is moved whole although it's over budget, c.bin then doesn't fit.
+  mu_check(zip_compact(zip, 1) > 100);
+  mu_assert_int_eq(0, zip_reclaimable(zip, &reclaimable));
+  mu_assert_int_eq(holes, reclaimable);
+
+  mu_check(zip_compact(zip, 0) > (200 << 10));
+  mu_assert_int_eq(0, zip_reclaimable(zip, &reclaimable));
+  mu_assert_int_eq(0, reclaimable);
+  mu_assert_int_eq(0, zip_compact(zip, 0));
+  zip_close(zip);
+
+  write_stored(reference, kept, kept_sizes, 3, data);
+  mu_assert_int_eq(file_size(reference), file_size(ZIPNAME));
+  remove(reference);
+
+  zip = zip_open(ZIPNAME, 0, 'r');
+  mu_check(zip != NULL);
+  mu_assert_int_eq(3, zip_entries_total(zip));
+  for (i = 0; i < 3; ++i) {
+    mu_assert_int_eq(0, zip_entry_open(zip, kept[i]));
+    mu_assert_int_eq(kept_sizes[i],
+                     zip_entry_read(zip, (void **)&buf, &bufsize));
+    mu_assert_int_eq(0, memcmp(buf, data + (i == 2 ? 4 : i + 1), bufsize));
+    mu_assert_int_eq(0, zip_entry_close(zip));
+    free(buf);
+    buf = NULL;
+  }
+  zip_close(zip);
+
+  free(data);
+}
+
+static void put_le(unsigned char **p, unsigned long v, int n) {
+  for (; n > 0; --n, v >>= 8) {
+    *(*p)++ = (unsigned char)v;
+  }
+}
+
+MU_TEST(test_entries_unlink_short_descriptors) {
+  // Three stored entries of 5 bytes, each followed by a 16 byte descriptor
+  // with a signature and 32-bit sizes, as streaming writers leave them.
+  unsigned char archive[512], *p = archive;
+  unsigned long ofs[3], cd = 0, crc = 0x3610a686UL;
+  char *entries[] = {"b"};
+  unsigned long long reclaimable = 0;
+  char *buf = NULL;
+  size_t bufsize = 0;
+  FILE *stream = NULL;
+  int i;
+
+  for (i = 0; i < 3; ++i) {
+    ofs[i] = (unsigned long)(p - archive);
+    put_le(&p, 0x04034b50UL, 4);
+    put_le(&p, 20, 2);
+    put_le(&p, 0x08, 2); // sizes in the descriptor
+    put_le(&p, 0, 2);
+    put_le(&p, 0, 2);
+    put_le(&p, 0x21, 2);
+    put_le(&p, 0, 12);
+    put_le(&p, 1, 2);
+    put_le(&p, 0, 2);
+    *p++ = (unsigned char)('a' + i);
+    memcpy(p, "hello", 5);
+    p += 5;
+    put_le(&p, 0x08074b50UL, 4);
+    put_le(&p, crc, 4);
+    put_le(&p, 5, 4);
+    put_le(&p, 5, 4);
+  }
+  cd = (unsigned long)(p - archive);
+  for (i = 0; i < 3; ++i) {
+    put_le(&p, 0x02014b50UL, 4);
+    put_le(&p, 20, 2);
+    put_le(&p, 20, 2);
+    put_le(&p, 0x08, 2);
+    put_le(&p, 0, 2);
+    put_le(&p, 0, 2);
+    put_le(&p, 0x21, 2);
+    put_le(&p, crc, 4);
+    put_le(&p, 5, 4);
+    put_le(&p, 5, 4);
+    put_le(&p, 1, 2);
+    put_le(&p, 0, 12);
+    put_le(&p, ofs[i], 4);
+    *p++ = (unsigned char)('a' + i);
+  }
+  put_le(&p, 0x06054b50UL, 4);
+  put_le(&p, 0, 4);
+  put_le(&p, 3, 2);
+  put_le(&p, 3, 2);
+  put_le(&p, (unsigned long)(p - archive) - 12 - cd, 4);
+  put_le(&p, cd, 4);
+  put_le(&p, 0, 2);
+
+  stream = fopen(ZIPNAME, "wb");
+  mu_check(stream != NULL);
+  mu_assert_int_eq(p - archive, fwrite(archive, 1, p - archive, stream));
+  fclose(stream);
+
+  // All of b is a hole, none of it is taken for a's descriptor.
+  struct zip_t *zip = zip_open(ZIPNAME, 0, 'd');
+  mu_check(zip != NULL);
+  mu_assert_int_eq(1, zip_entries_unlink(zip, entries, 1));
+  mu_assert_int_eq(0, zip_reclaimable(zip, &reclaimable));
+  mu_assert_int_eq(ofs[2] - ofs[1], reclaimable);
+  mu_check(zip_compact(zip, 0) >= 0);
+  zip_close(zip);
+
+  zip = zip_open(ZIPNAME, 0, 'r');
+  mu_check(zip != NULL);
+  mu_assert_int_eq(2, zip_entries_total(zip));
+  mu_assert_int_eq(0, zip_entry_open(zip, "c"));
+  mu_assert_int_eq(5, zip_entry_read(zip, (void **)&buf, &bufsize));
+  mu_assert_int_eq(0, memcmp(buf, "hello", 5));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  free(buf);
+  zip_close(zip);
+}
+
+MU_TEST(test_entry_replace) {
+  char config[] = "{\"interval\": 60, \"verbose\": false}";
+  char *noise = NULL, *buf = NULL;
+  char *entries[] = {"big.bin"};
+  unsigned long long reclaimable = 0;
+  unsigned int seed = 2463534242u;
+  size_t i, bufsize = 0;
+  long size = 0;
+
+  // Doesn't compress.
+  noise = (char *)malloc(64 << 10);
+  mu_check(noise != NULL);
+  for (i = 0; i < (64 << 10); ++i) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    noise[i] = (char)seed;
+  }
+
+  struct zip_t *zip = zip_open(ZIPNAME, ZIP_DEFAULT_COMPRESSION_LEVEL, 'w');
+  mu_check(zip != NULL);
+  mu_assert_int_eq(0, zip_entry_open(zip, "config.json"));
+  mu_assert_int_eq(0, zip_entry_write(zip, noise, 2000));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  mu_assert_int_eq(0, zip_entry_open(zip, "big.bin"));
+  mu_assert_int_eq(0, zip_entry_write(zip, noise, 64 << 10));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  mu_assert_int_eq(0, zip_entry_open(zip, "tail.txt"));
+  mu_assert_int_eq(0, zip_entry_write(zip, TESTDATA1, strlen(TESTDATA1)));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  zip_close(zip);
+  size = file_size(ZIPNAME);
+
+  // Smaller, written over the old data.
+  zip = zip_open(ZIPNAME, ZIP_DEFAULT_COMPRESSION_LEVEL, 'd');
+  mu_check(zip != NULL);
+  mu_assert_int_eq(0, zip_entry_replace(zip, "config.json", config,
+                                        strlen(config)));
+  mu_assert_int_eq(0, zip_reclaimable(zip, &reclaimable));
+  mu_check(reclaimable > 1000);
+  mu_assert_int_eq(ZIP_ENOENT, zip_entry_replace(zip, "missing", config, 1));
+  mu_assert_int_eq(3, zip_entries_total(zip));
+  zip_close(zip);
+  mu_check(file_size(ZIPNAME) <= size);
+
+  // Larger, goes into the hole big.bin leaves.
+  zip = zip_open(ZIPNAME, ZIP_DEFAULT_COMPRESSION_LEVEL, 'd');
+  mu_check(zip != NULL);
+  mu_assert_int_eq(1, zip_entries_unlink(zip, entries, 1));
+  mu_assert_int_eq(0, zip_entry_replace(zip, "config.json", noise, 8000));
+  zip_close(zip);
+  mu_check(file_size(ZIPNAME) < size);
+
+  // Larger than any hole, appended.
+  zip = zip_open(ZIPNAME, ZIP_DEFAULT_COMPRESSION_LEVEL, 'd');
+  mu_check(zip != NULL);
+  mu_assert_int_eq(0, zip_entry_replace(zip, "tail.txt", noise, 64 << 10));
+  zip_close(zip);
+  mu_check(file_size(ZIPNAME) > size);
+
+  zip = zip_open(ZIPNAME, 0, 'r');
+  mu_check(zip != NULL);
+  mu_assert_int_eq(2, zip_entries_total(zip));
+  // Noise is stored, as when it is written.
+  mu_assert_int_eq(0, zip_entry_open(zip, "config.json"));
+  mu_assert_int_eq(8000, zip_entry_comp_size(zip));
+  mu_assert_int_eq(8000, zip_entry_read(zip, (void **)&buf, &bufsize));
+  mu_assert_int_eq(0, memcmp(buf, noise, bufsize));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  free(buf);
+  buf = NULL;
+  mu_assert_int_eq(0, zip_entry_open(zip, "tail.txt"));
+  mu_assert_int_eq(64 << 10, zip_entry_comp_size(zip));
+  mu_assert_int_eq(64 << 10, zip_entry_read(zip, (void **)&buf, &bufsize));
+  mu_assert_int_eq(0, memcmp(buf, noise, bufsize));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  free(buf);
+  zip_close(zip);
+
+  free(noise);
+}
+
+#if !defined(_WIN32)
+MU_TEST(test_entry_replace_failed_write) {
+  char *noise = NULL, *buf = NULL;
+  unsigned int seed = 2463534242u;
+  struct rlimit limit, saved;
+  size_t i, bufsize = 0;
+
+  noise = (char *)malloc(64 << 10);
+  mu_check(noise != NULL);
+  for (i = 0; i < (64 << 10); ++i) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    noise[i] = (char)seed;
+  }
+
+  // Larger than the file may grow, the write fails part way.
+  struct zip_t *zip = zip_open(ZIPNAME, ZIP_DEFAULT_COMPRESSION_LEVEL, 'd');
+  mu_check(zip != NULL);
+  mu_assert_int_eq(0, zip_set_write_buffer(zip, 0));
+  mu_assert_int_eq(0, getrlimit(RLIMIT_FSIZE, &saved));
+  limit = saved;
+  limit.rlim_cur = (rlim_t)file_size(ZIPNAME) + 1024;
+  signal(SIGXFSZ, SIG_IGN);
+  mu_assert_int_eq(0, setrlimit(RLIMIT_FSIZE, &limit));
+  mu_check(zip_entry_replace(zip, "test/test-1.txt", noise, 64 << 10) < 0);
+  mu_assert_int_eq(0, setrlimit(RLIMIT_FSIZE, &saved));
+  mu_assert_int_eq(total_entries, zip_entries_total(zip));
+  zip_close(zip);
+
+  zip = zip_open(ZIPNAME, 0, 'r');
+  mu_check(zip != NULL);
+  mu_assert_int_eq(total_entries, zip_entries_total(zip));
+  mu_assert_int_eq(0, zip_entry_open(zip, "test/test-1.txt"));
+  mu_assert_int_eq(strlen(TESTDATA1),
+                   zip_entry_read(zip, (void **)&buf, &bufsize));
+  mu_assert_int_eq(0, strncmp(buf, TESTDATA1, bufsize));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  free(buf);
+  zip_close(zip);
+
+  free(noise);
+}
+#endif
+
 MU_TEST_SUITE(test_entry_suite) {
   MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
 
   MU_RUN_TEST(test_entry_name);
   MU_RUN_TEST(test_entry_opencasesensitive);
+  MU_RUN_TEST(test_entry_lookup);
   MU_RUN_TEST(test_entry_index);
   MU_RUN_TEST(test_entry_openbyindex);
+  MU_RUN_TEST(test_entry_info);
   MU_RUN_TEST(test_entry_read);
   MU_RUN_TEST(test_list_entries);
+  MU_RUN_TEST(test_entries_select);
   MU_RUN_TEST(test_entries_delete);
+  MU_RUN_TEST(test_entries_delete_large);
+  MU_RUN_TEST(test_entries_unlink_compact);
+  MU_RUN_TEST(test_entries_unlink_short_descriptors);
+  MU_RUN_TEST(test_entry_replace);
+#if !defined(_WIN32)
+  MU_RUN_TEST(test_entry_replace_failed_write);
+#endif
 }
 
 #define UNUSED(x) (void)x
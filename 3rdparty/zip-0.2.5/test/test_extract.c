@@ -136,11 +136,119 @@ MU_TEST(test_extract_stream) {
   fclose(fp);
 }
 
+MU_TEST(test_entry_fread) {
+  char zipname[L_tmpnam + 1];
+  char outname[L_tmpnam + 1];
+  char *data = NULL, *buf = NULL;
+  const size_t size = 300 * 1000;
+  size_t i;
+  FILE *stream = NULL;
+  struct zip_t *zip = NULL;
+  int k;
+
+  data = (char *)malloc(size);
+  buf = (char *)malloc(size + 1);
+  mu_check(data != NULL && buf != NULL);
+  for (i = 0; i < size; ++i) {
+    data[i] = "abcdefgh \n"[(i * 7919 + i / 13) % 10];
+  }
+  strncpy(zipname, "z-XXXXXX\0", L_tmpnam);
+  mktemp(zipname);
+  strncpy(outname, "o-XXXXXX\0", L_tmpnam);
+  mktemp(outname);
+
+  // Deflated and stored, through the smallest buffer so that the entry spans
+  // many reads and many wraps of the inflate ring.
+  for (k = 0; k < 2; ++k) {
+    zip = zip_open(zipname, k ? 0 : ZIP_DEFAULT_COMPRESSION_LEVEL, 'w');
+    mu_check(zip != NULL);
+    mu_assert_int_eq(0, zip_entry_open(zip, "data.bin"));
+    mu_assert_int_eq(0, zip_entry_write(zip, data, size));
+    mu_assert_int_eq(0, zip_entry_close(zip));
+    zip_close(zip);
+
+    zip = zip_open(zipname, 0, 'r');
+    mu_check(zip != NULL);
+    mu_assert_int_eq(0, zip_set_io_buffer(zip, 1));
+    mu_assert_int_eq(0, zip_entry_open(zip, "data.bin"));
+    mu_assert_int_eq(0, zip_entry_fread(zip, outname));
+    mu_assert_int_eq(0, zip_entry_close(zip));
+    zip_close(zip);
+
+    stream = fopen(outname, "rb");
+    mu_check(stream != NULL);
+    mu_assert_int_eq(size, fread(buf, 1, size + 1, stream));
+    fclose(stream);
+    mu_assert_int_eq(0, memcmp(data, buf, size));
+    remove(outname);
+  }
+
+  free(data);
+  free(buf);
+  remove(zipname);
+}
+
+MU_TEST(test_entry_fread_corrupt) {
+  char zipname[L_tmpnam + 1];
+  char outname[L_tmpnam + 1];
+  char data[4096];
+  size_t i;
+  FILE *stream = NULL;
+  struct zip_t *zip = NULL;
+  int c, k;
+
+  for (i = 0; i < sizeof(data); ++i) {
+    data[i] = "abcdefgh \n"[(i * 7919 + i / 13) % 10];
+  }
+  strncpy(zipname, "z-XXXXXX\0", L_tmpnam);
+  mktemp(zipname);
+  strncpy(outname, "o-XXXXXX\0", L_tmpnam);
+  mktemp(outname);
+
+  // A flipped byte in stored data fails the checksum, in deflated data it
+  // breaks the stream or the checksum.
+  for (k = 0; k < 2; ++k) {
+    zip = zip_open(zipname, k ? ZIP_DEFAULT_COMPRESSION_LEVEL : 0, 'w');
+    mu_check(zip != NULL);
+    mu_assert_int_eq(0, zip_entry_open(zip, "data.bin"));
+    mu_assert_int_eq(0, zip_entry_write(zip, data, sizeof(data)));
+    mu_assert_int_eq(0, zip_entry_close(zip));
+    zip_close(zip);
+
+    // The data starts after the local header and the name.
+    stream = fopen(zipname, "r+b");
+    mu_check(stream != NULL);
+    fseek(stream, 30 + 8 + 20, SEEK_SET);
+    c = fgetc(stream);
+    fseek(stream, 30 + 8 + 20, SEEK_SET);
+    fputc(~c & 0xFF, stream);
+    fclose(stream);
+
+    zip = zip_open(zipname, 0, 'r');
+    mu_check(zip != NULL);
+    mu_assert_int_eq(0, zip_entry_open(zip, "data.bin"));
+    if (k) {
+      mu_check(zip_entry_fread(zip, outname) < 0);
+    } else {
+      mu_assert_int_eq(ZIP_ECRC32, zip_entry_fread(zip, outname));
+    }
+    mu_assert_int_eq(0, zip_entry_close(zip));
+    zip_close(zip);
+
+    // Nothing unverified is left behind.
+    mu_check(fopen(outname, "rb") == NULL);
+  }
+
+  remove(zipname);
+}
+
 MU_TEST_SUITE(test_extract_suite) {
   MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
 
   MU_RUN_TEST(test_extract);
   MU_RUN_TEST(test_extract_stream);
+  MU_RUN_TEST(test_entry_fread);
+  MU_RUN_TEST(test_entry_fread_corrupt);
 }
 
 int main(int argc, char *argv[]) {
@@ -121,11 +121,174 @@ MU_TEST(test_noallocread) {
   zip_close(zip);
 }
 
+MU_TEST(test_read_mmap) {
+  char *buf = NULL;
+  ssize_t bufsize;
+  size_t buftmp;
+
+  mu_check(zip_open_mmap("nonexistent.zip", 0) == NULL);
+
+  struct zip_t *zip = zip_open_mmap(ZIPNAME, 0);
+  mu_check(zip != NULL);
+  mu_assert_int_eq(5, zip_entries_total(zip));
+
+  mu_assert_int_eq(0, zip_entry_open(zip, "test/test-1.txt"));
+  mu_check(CRC32DATA1 == zip_entry_crc32(zip));
+  bufsize = zip_entry_read(zip, (void **)&buf, &buftmp);
+  mu_assert_int_eq(strlen(TESTDATA1), bufsize);
+  mu_assert_int_eq(0, strncmp(buf, TESTDATA1, buftmp));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  free(buf);
+  buf = NULL;
+
+  mu_assert_int_eq(0, zip_entry_open(zip, "dotfiles/.test"));
+  bufsize = zip_entry_read(zip, (void **)&buf, &buftmp);
+  mu_assert_int_eq(strlen(TESTDATA2), bufsize);
+  mu_assert_int_eq(0, strncmp(buf, TESTDATA2, buftmp));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  free(buf);
+  buf = NULL;
+
+  zip_close(zip);
+}
+
+MU_TEST(test_entry_reader) {
+  char buf[8];
+  char data[64];
+  size_t total = 0;
+  ssize_t n;
+  struct zip_entry_reader_t *reader = NULL;
+
+  struct zip_t *zip = zip_open(ZIPNAME, 0, 'r');
+  mu_check(zip != NULL);
+
+  mu_assert_int_eq(0, zip_entry_open(zip, "test/test-1.txt"));
+  reader = zip_entry_reader_open(zip);
+  mu_check(reader != NULL);
+  while ((n = zip_entry_reader_read(reader, buf, sizeof(buf))) > 0) {
+    mu_check(total + (size_t)n <= sizeof(data));
+    memcpy(data + total, buf, (size_t)n);
+    total += (size_t)n;
+  }
+  mu_assert_int_eq(0, n);
+  mu_assert_int_eq(strlen(TESTDATA1), total);
+  mu_assert_int_eq(0, strncmp(data, TESTDATA1, total));
+  mu_assert_int_eq(0, zip_entry_reader_close(reader));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+
+  // A partially read entry can be closed early.
+  mu_assert_int_eq(0, zip_entry_open(zip, "test/test-2.txt"));
+  reader = zip_entry_reader_open(zip);
+  mu_check(reader != NULL);
+  mu_assert_int_eq(sizeof(buf), zip_entry_reader_read(reader, buf, sizeof(buf)));
+  mu_assert_int_eq(0, strncmp(buf, TESTDATA2, sizeof(buf)));
+  mu_assert_int_eq(0, zip_entry_reader_close(reader));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+
+  // Readers left open are detached when the archive is closed.
+  mu_assert_int_eq(0, zip_entry_open(zip, "dotfiles/.test"));
+  reader = zip_entry_reader_open(zip);
+  mu_check(reader != NULL);
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  zip_close(zip);
+  mu_assert_int_eq(ZIP_ENOINIT, zip_entry_reader_read(reader, buf, sizeof(buf)));
+  mu_assert_int_eq(0, zip_entry_reader_close(reader));
+}
+
+MU_TEST(test_entry_reader_openbyindex) {
+  char buf1[64], buf2[64];
+  ssize_t n1, n2;
+  struct zip_entry_reader_t *reader1 = NULL, *reader2 = NULL;
+
+  struct zip_t *zip = zip_open(ZIPNAME, 0, 'r');
+  mu_check(zip != NULL);
+
+  mu_check(zip_entry_reader_openbyindex(zip, 5) == NULL);
+
+  // Interleaved readers on one handle, the current entry is left alone.
+  reader1 = zip_entry_reader_openbyindex(zip, 0);
+  reader2 = zip_entry_reader_openbyindex(zip, 1);
+  mu_check(reader1 != NULL && reader2 != NULL);
+  mu_check(zip_entry_name(zip) == NULL);
+
+  mu_assert_int_eq(4, zip_entry_reader_read(reader2, buf2, 4));
+  mu_assert_int_eq(4, zip_entry_reader_read(reader1, buf1, 4));
+  n2 = zip_entry_reader_read(reader2, buf2 + 4, sizeof(buf2) - 4);
+  n1 = zip_entry_reader_read(reader1, buf1 + 4, sizeof(buf1) - 4);
+  mu_assert_int_eq(strlen(TESTDATA1), (size_t)n1 + 4);
+  mu_assert_int_eq(strlen(TESTDATA2), (size_t)n2 + 4);
+  mu_assert_int_eq(0, strncmp(buf1, TESTDATA1, strlen(TESTDATA1)));
+  mu_assert_int_eq(0, strncmp(buf2, TESTDATA2, strlen(TESTDATA2)));
+  mu_assert_int_eq(0, zip_entry_reader_read(reader1, buf1, sizeof(buf1)));
+  mu_assert_int_eq(0, zip_entry_reader_read(reader2, buf2, sizeof(buf2)));
+
+  mu_assert_int_eq(0, zip_entry_reader_close(reader1));
+  mu_assert_int_eq(0, zip_entry_reader_close(reader2));
+
+  zip_close(zip);
+}
+
+MU_TEST(test_read_raw) {
+  unsigned char header[ZIP_GZIP_HEADER_SIZE];
+  unsigned char trailer[ZIP_GZIP_TRAILER_SIZE];
+  unsigned char chunk[7];
+  char *buf = NULL;
+  size_t buftmp = 0, total = 0;
+  ssize_t bufsize, n;
+  struct zip_entry_reader_t *reader = NULL;
+
+  struct zip_t *zip = zip_open(ZIPNAME, 0, 'r');
+  mu_check(zip != NULL);
+
+  mu_assert_int_eq(0, zip_entry_open(zip, "test/test-1.txt"));
+  bufsize = zip_entry_read_raw(zip, (void **)&buf, &buftmp);
+  mu_check(bufsize > 0);
+  mu_assert_int_eq((size_t)bufsize, buftmp);
+  mu_check((unsigned long long)bufsize == zip_entry_comp_size(zip));
+
+  // The chunked reader returns the same bytes.
+  reader = zip_entry_reader_open_raw(zip);
+  mu_check(reader != NULL);
+  while ((n = zip_entry_reader_read(reader, chunk, sizeof(chunk))) > 0) {
+    mu_check(total + (size_t)n <= buftmp);
+    mu_assert_int_eq(0, memcmp(buf + total, chunk, (size_t)n));
+    total += (size_t)n;
+  }
+  mu_assert_int_eq(0, n);
+  mu_assert_int_eq(buftmp, total);
+  mu_assert_int_eq(0, zip_entry_reader_close(reader));
+  free(buf);
+  buf = NULL;
+
+  mu_assert_int_eq(0, zip_entry_gzip_frame(zip, header, trailer));
+  mu_assert_int_eq(0x1f, header[0]);
+  mu_assert_int_eq(0x8b, header[1]);
+  mu_assert_int_eq(8, header[2]);
+  mu_check(((unsigned long)trailer[0] | (unsigned long)trailer[1] << 8 |
+            (unsigned long)trailer[2] << 16 |
+            (unsigned long)trailer[3] << 24) == CRC32DATA1);
+  mu_assert_int_eq(strlen(TESTDATA1), trailer[4]);
+  mu_assert_int_eq(0, trailer[5] | trailer[6] | trailer[7]);
+  mu_assert_int_eq(0, zip_entry_close(zip));
+
+  mu_assert_int_eq(0, zip_entry_open(zip, "empty/"));
+  mu_assert_int_eq(ZIP_EINVENTTYPE,
+                   zip_entry_read_raw(zip, (void **)&buf, &buftmp));
+  mu_assert_int_eq(ZIP_EINVENTTYPE, zip_entry_gzip_frame(zip, header, trailer));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+
+  zip_close(zip);
+}
+
 MU_TEST_SUITE(test_read_suite) {
   MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
 
   MU_RUN_TEST(test_read);
   MU_RUN_TEST(test_noallocread);
+  MU_RUN_TEST(test_read_mmap);
+  MU_RUN_TEST(test_entry_reader);
+  MU_RUN_TEST(test_entry_reader_openbyindex);
+  MU_RUN_TEST(test_read_raw);
 }
 
 #define UNUSED(x) (void)x
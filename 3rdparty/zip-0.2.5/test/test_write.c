@@ -67,11 +67,551 @@ MU_TEST(test_fwrite) {
   zip_close(zip);
 }
 
+MU_TEST(test_write_stream) {
+  void *buf = NULL;
+  void *again = NULL;
+  size_t bufsize = 0;
+  char *data = NULL;
+  size_t datasize = 0;
+
+  struct zip_t *zip = zip_stream_open(NULL, 0, ZIP_DEFAULT_COMPRESSION_LEVEL, 'w');
+  mu_check(zip != NULL);
+  mu_assert_int_eq(0, zip_entry_open(zip, "test/test-1.txt"));
+  mu_assert_int_eq(0, zip_entry_write(zip, TESTDATA1, strlen(TESTDATA1)));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+
+  mu_check(zip_stream_finalize(zip, &buf, &bufsize) > 0);
+  mu_check(buf != NULL);
+  mu_check(zip_stream_finalize(zip, &again, NULL) < 0);
+  mu_check(again == NULL);
+  zip_stream_close(zip);
+
+  zip = zip_stream_open((const char *)buf, bufsize, 0, 'r');
+  mu_check(zip != NULL);
+  mu_assert_int_eq(0, zip_entry_open(zip, "test/test-1.txt"));
+  mu_assert_int_eq(strlen(TESTDATA1),
+                   zip_entry_read(zip, (void **)&data, &datasize));
+  mu_assert_int_eq(0, strncmp(data, TESTDATA1, datasize));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  zip_stream_close(zip);
+
+  free(data);
+  free(buf);
+}
+
+MU_TEST(test_entries_fwrite) {
+  char files[4][L_tmpnam + 1];
+  const char *filenames[5];
+  char zipnames[2][L_tmpnam + 1];
+  long sizes[2];
+  unsigned long long comp_sizes[2][4];
+  unsigned int crcs[2][4];
+  unsigned int seed = 2463534242u;
+  FILE *stream = NULL;
+  struct zip_t *zip = NULL;
+  int i, j, k;
+
+  for (i = 0; i < 4; ++i) {
+    strncpy(files[i], "f-XXXXXX\0", L_tmpnam);
+    mktemp(files[i]);
+    filenames[i] = files[i];
+    stream = fopen(files[i], "wb");
+    mu_check(stream != NULL);
+    // The last one starts with 8 KB of noise, a short read of it alone
+    // would look incompressible.
+    for (j = 0; i == 3 && j < 8192; ++j) {
+      seed ^= seed << 13;
+      seed ^= seed >> 17;
+      seed ^= seed << 5;
+      fputc((int)(seed & 0xFF), stream);
+    }
+    for (j = 0; j < 20000 * (i == 3 ? 1 : i); ++j) {
+      fprintf(stream, "%d %s\n", (j * 7919) % (1000 + i), TESTDATA1);
+    }
+    fclose(stream);
+  }
+  // Missing files still get an entry.
+  filenames[4] = "missing-file.txt";
+
+  for (k = 0; k < 2; ++k) {
+    strncpy(zipnames[k], "z-XXXXXX\0", L_tmpnam);
+    mktemp(zipnames[k]);
+    zip = zip_open(zipnames[k], ZIP_DEFAULT_COMPRESSION_LEVEL, 'w');
+    mu_check(zip != NULL);
+    mu_assert_int_eq(ZIP_ENOENT,
+                     zip_entries_fwrite(zip, filenames, 5, k ? 4 : 1));
+    zip_close(zip);
+
+    stream = fopen(zipnames[k], "rb");
+    mu_check(stream != NULL);
+    fseek(stream, 0, SEEK_END);
+    sizes[k] = ftell(stream);
+    fclose(stream);
+
+    zip = zip_open(zipnames[k], 0, 'r');
+    mu_check(zip != NULL);
+    mu_assert_int_eq(5, zip_entries_total(zip));
+    for (i = 0; i < 4; ++i) {
+      mu_assert_int_eq(0, zip_entry_openbyindex(zip, (size_t)i));
+      mu_assert_int_eq(0, strcmp(zip_entry_name(zip), files[i]));
+      comp_sizes[k][i] = zip_entry_comp_size(zip);
+      crcs[k][i] = zip_entry_crc32(zip);
+      mu_assert_int_eq(0, zip_entry_close(zip));
+    }
+    zip_close(zip);
+  }
+
+  // The parallel archive is laid out exactly like the serial one.
+  mu_check(sizes[0] == sizes[1]);
+  for (i = 0; i < 4; ++i) {
+    mu_check(comp_sizes[0][i] == comp_sizes[1][i]);
+    mu_check(crcs[0][i] == crcs[1][i]);
+  }
+  mu_check(comp_sizes[0][3] < 100000);
+
+  for (i = 0; i < 4; ++i) {
+    remove(files[i]);
+  }
+  remove(zipnames[0]);
+  remove(zipnames[1]);
+}
+
+MU_TEST(test_entry_fwrite_parallel) {
+  // Empty, exactly two 1 MB blocks, and a short last block.
+  static const long lengths[3] = {0, 2 * 1024 * 1024, 3 * 1024 * 1024 + 4321};
+  char file[L_tmpnam + 1];
+  char zipname[L_tmpnam + 1];
+  unsigned long long comp_sizes[2];
+  unsigned int crcs[2];
+  unsigned int seed = 1;
+  void *bufs[2];
+  size_t bufsizes[2];
+  FILE *stream = NULL;
+  struct zip_t *zip = NULL;
+  long i;
+  int j, k;
+
+  strncpy(file, "p-XXXXXX\0", L_tmpnam);
+  mktemp(file);
+  strncpy(zipname, "z-XXXXXX\0", L_tmpnam);
+  mktemp(zipname);
+
+  for (j = 0; j < 3; ++j) {
+    stream = fopen(file, "wb");
+    mu_check(stream != NULL);
+    for (i = 0; i < lengths[j]; ++i) {
+      seed = seed * 1103515245 + 12345;
+      fputc("abcdefgh \n"[(seed >> 16) % 10], stream);
+    }
+    fclose(stream);
+
+    zip = zip_open(zipname, ZIP_DEFAULT_COMPRESSION_LEVEL, 'w');
+    mu_check(zip != NULL);
+    for (k = 0; k < 2; ++k) {
+      mu_assert_int_eq(0, zip_entry_open(zip, k ? "parallel" : "serial"));
+      mu_assert_int_eq(0, zip_entry_fwrite_parallel(zip, file, k ? 4 : 1));
+      mu_assert_int_eq(0, zip_entry_close(zip));
+    }
+    zip_close(zip);
+
+    zip = zip_open(zipname, 0, 'r');
+    mu_check(zip != NULL);
+    for (k = 0; k < 2; ++k) {
+      mu_assert_int_eq(0, zip_entry_openbyindex(zip, (size_t)k));
+      comp_sizes[k] = zip_entry_comp_size(zip);
+      crcs[k] = zip_entry_crc32(zip);
+      bufs[k] = NULL;
+      mu_check(zip_entry_read(zip, &bufs[k], &bufsizes[k]) == lengths[j]);
+      mu_assert_int_eq(0, zip_entry_close(zip));
+    }
+    zip_close(zip);
+
+    mu_check(crcs[0] == crcs[1]);
+    mu_check(bufsizes[0] == bufsizes[1]);
+    mu_assert_int_eq(0, memcmp(bufs[0], bufs[1], bufsizes[0]));
+    // Priming every block with its predecessor keeps the cost of splitting
+    // the stream small.
+    mu_check(comp_sizes[1] <= comp_sizes[0] + comp_sizes[0] / 100 + 16);
+    free(bufs[0]);
+    free(bufs[1]);
+  }
+
+  remove(file);
+  remove(zipname);
+}
+
+MU_TEST(test_entry_write_raw) {
+  char zipname[L_tmpnam + 1];
+  void *raw = NULL;
+  char *buf = NULL;
+  size_t rawsize = 0, bufsize = 0;
+  unsigned int crc = 0;
+  unsigned long long size = 0;
+  struct zip_t *zip = NULL;
+
+  // Deflate the data once...
+  zip = zip_open(ZIPNAME, ZIP_DEFAULT_COMPRESSION_LEVEL, 'w');
+  mu_check(zip != NULL);
+  mu_assert_int_eq(0, zip_entry_open(zip, "test/test-1.txt"));
+  mu_assert_int_eq(0, zip_entry_write(zip, TESTDATA1, strlen(TESTDATA1)));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  zip_close(zip);
+
+  zip = zip_open(ZIPNAME, 0, 'r');
+  mu_check(zip != NULL);
+  mu_assert_int_eq(0, zip_entry_open(zip, "test/test-1.txt"));
+  mu_check(zip_entry_read_raw(zip, &raw, &rawsize) > 0);
+  crc = zip_entry_crc32(zip);
+  size = zip_entry_size(zip);
+  mu_assert_int_eq(ZIP_EINVMODE,
+                   zip_entry_write_raw(zip, "copy.txt", raw, rawsize, crc, size));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  zip_close(zip);
+
+  // ...and reuse it in a stored archive without recompressing.
+  strncpy(zipname, "z-XXXXXX\0", L_tmpnam);
+  mktemp(zipname);
+  zip = zip_open(zipname, 0, 'w');
+  mu_check(zip != NULL);
+  mu_assert_int_eq(0,
+                   zip_entry_write_raw(zip, "copy.txt", raw, rawsize, crc, size));
+  zip_close(zip);
+  free(raw);
+
+  zip = zip_open(zipname, 0, 'r');
+  mu_check(zip != NULL);
+  mu_assert_int_eq(0, zip_entry_open(zip, "copy.txt"));
+  mu_check(CRC32DATA1 == zip_entry_crc32(zip));
+  mu_check(rawsize == zip_entry_comp_size(zip));
+  mu_assert_int_eq(strlen(TESTDATA1),
+                   zip_entry_read(zip, (void **)&buf, &bufsize));
+  mu_assert_int_eq(0, strncmp(buf, TESTDATA1, bufsize));
+  free(buf);
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  zip_close(zip);
+
+  remove(zipname);
+}
+
+MU_TEST(test_entry_copy) {
+  char inputs[2][L_tmpnam + 1];
+  const char *names[2];
+  char *buf = NULL;
+  size_t bufsize = 0;
+  struct zip_entry_info_t info;
+  struct zip_t *zip = NULL, *src = NULL;
+  int i;
+
+  // A deflated and a stored archive.
+  for (i = 0; i < 2; ++i) {
+    strncpy(inputs[i], "z-XXXXXX\0", L_tmpnam);
+    mktemp(inputs[i]);
+    names[i] = inputs[i];
+    zip = zip_open(inputs[i], i ? 0 : ZIP_DEFAULT_COMPRESSION_LEVEL, 'w');
+    mu_check(zip != NULL);
+    mu_assert_int_eq(0, zip_entry_open(zip, i ? "stored.txt" : "deflated.txt"));
+    mu_assert_int_eq(0, zip_entry_write(zip, TESTDATA1, strlen(TESTDATA1)));
+    mu_assert_int_eq(0, zip_entry_close(zip));
+    if (!i) {
+      mu_assert_int_eq(0, zip_entry_open(zip, "dir/"));
+      mu_assert_int_eq(0, zip_entry_close(zip));
+    }
+    zip_close(zip);
+  }
+
+  mu_assert_int_eq(0, zip_merge(ZIPNAME, names, 2));
+
+  zip = zip_open(ZIPNAME, 0, 'r');
+  mu_check(zip != NULL);
+  mu_assert_int_eq(3, zip_entries_total(zip));
+  mu_assert_int_eq(0, zip_entry_info(zip, 0, &info));
+  mu_assert_int_eq(8, info.method);
+  mu_assert_int_eq(0, zip_entry_info(zip, 1, &info));
+  mu_check(info.isdir);
+  mu_assert_int_eq(0, zip_entry_info(zip, 2, &info));
+  mu_assert_int_eq(0, info.method);
+  mu_assert_int_eq(0, strncmp(info.name, "stored.txt", info.namelen));
+  for (i = 0; i < 3; i += 2) {
+    mu_assert_int_eq(0, zip_entry_openbyindex(zip, (size_t)i));
+    mu_check(CRC32DATA1 == zip_entry_crc32(zip));
+    mu_assert_int_eq(strlen(TESTDATA1),
+                     zip_entry_read(zip, (void **)&buf, &bufsize));
+    mu_assert_int_eq(0, strncmp(buf, TESTDATA1, bufsize));
+    free(buf);
+    buf = NULL;
+    mu_assert_int_eq(0, zip_entry_close(zip));
+  }
+  zip_close(zip);
+
+  // Copy out of a memory mapped archive, under a new name.
+  src = zip_open_mmap(inputs[0], 0);
+  mu_check(src != NULL);
+  zip = zip_open(ZIPNAME, 0, 'w');
+  mu_check(zip != NULL);
+  mu_assert_int_eq(ZIP_EINVIDX, zip_entry_copy(zip, src, 2, NULL));
+  mu_assert_int_eq(ZIP_EINVMODE, zip_entry_copy(src, zip, 0, NULL));
+  mu_assert_int_eq(0, zip_entry_copy(zip, src, 0, "renamed.txt"));
+  zip_close(zip);
+  zip_close(src);
+
+  zip = zip_open(ZIPNAME, 0, 'r');
+  mu_check(zip != NULL);
+  mu_assert_int_eq(0, zip_entry_open(zip, "renamed.txt"));
+  mu_assert_int_eq(strlen(TESTDATA1),
+                   zip_entry_read(zip, (void **)&buf, &bufsize));
+  mu_assert_int_eq(0, strncmp(buf, TESTDATA1, bufsize));
+  free(buf);
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  zip_close(zip);
+
+  remove(inputs[0]);
+  remove(inputs[1]);
+}
+
+MU_TEST(test_write_buffer) {
+  // Straight through, smaller than most writes, and the default.
+  static const size_t sizes[3] = {0, 24, ZIP_WRITE_BUFFER_SIZE};
+  char name[32];
+  char *buf = NULL;
+  size_t bufsize = 0;
+  struct zip_t *zip = NULL;
+  int i, k;
+
+  for (k = 0; k < 3; ++k) {
+    zip = zip_open(ZIPNAME, ZIP_DEFAULT_COMPRESSION_LEVEL, 'w');
+    mu_check(zip != NULL);
+    mu_assert_int_eq(0, zip_set_write_buffer(zip, sizes[k]));
+    for (i = 0; i < 100; ++i) {
+      sprintf(name, "file-%d.txt", i);
+      mu_assert_int_eq(0, zip_entry_open(zip, name));
+      mu_assert_int_eq(0, zip_entry_write(zip, TESTDATA1, strlen(TESTDATA1)));
+      mu_assert_int_eq(0, zip_entry_close(zip));
+    }
+    zip_close(zip);
+
+    // Appending is buffered as well.
+    zip = zip_open(ZIPNAME, ZIP_DEFAULT_COMPRESSION_LEVEL, 'a');
+    mu_check(zip != NULL);
+    mu_assert_int_eq(0, zip_set_write_buffer(zip, sizes[k]));
+    mu_assert_int_eq(0, zip_entry_open(zip, "appended.txt"));
+    mu_assert_int_eq(0, zip_entry_write(zip, TESTDATA1, strlen(TESTDATA1)));
+    mu_assert_int_eq(0, zip_entry_close(zip));
+    zip_close(zip);
+
+    zip = zip_open(ZIPNAME, 0, 'r');
+    mu_check(zip != NULL);
+    mu_assert_int_eq(ZIP_EINVMODE, zip_set_write_buffer(zip, sizes[k]));
+    mu_assert_int_eq(101, zip_entries_total(zip));
+    for (i = 0; i < 101; ++i) {
+      mu_assert_int_eq(0, zip_entry_openbyindex(zip, (size_t)i));
+      mu_check(CRC32DATA1 == zip_entry_crc32(zip));
+      mu_assert_int_eq(strlen(TESTDATA1),
+                       zip_entry_read(zip, (void **)&buf, &bufsize));
+      mu_assert_int_eq(0, strncmp(buf, TESTDATA1, bufsize));
+      free(buf);
+      buf = NULL;
+      mu_assert_int_eq(0, zip_entry_close(zip));
+    }
+    zip_close(zip);
+  }
+}
+
+MU_TEST(test_store_threshold) {
+  const size_t size = 256 * 1024;
+  char *noise = (char *)malloc(size), *text = (char *)malloc(size);
+  char *buf = NULL;
+  size_t bufsize = 0, i;
+  unsigned int x = 2463534242u;
+  struct zip_entry_info_t info;
+  struct zip_t *zip = NULL;
+  mu_check(noise != NULL && text != NULL);
+
+  for (i = 0; i < size; ++i) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    noise[i] = (char)(x >> 24);
+    text[i] = TESTDATA1[i % strlen(TESTDATA1)];
+  }
+
+  zip = zip_open(ZIPNAME, ZIP_DEFAULT_COMPRESSION_LEVEL, 'w');
+  mu_check(zip != NULL);
+  mu_assert_int_eq(ZIP_EINVLVL, zip_set_store_threshold(zip, 101));
+  mu_assert_int_eq(0, zip_entry_open(zip, "noise.bin"));
+  mu_assert_int_eq(0, zip_entry_write(zip, noise, size / 2));
+  mu_assert_int_eq(0, zip_entry_write(zip, noise + size / 2, size / 2));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  mu_assert_int_eq(0, zip_entry_open(zip, "text.txt"));
+  mu_assert_int_eq(0, zip_entry_write(zip, text, size));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  // Pieces too small to be probed alone, sampled as if written at once.
+  mu_assert_int_eq(0, zip_entry_open(zip, "pieces.bin"));
+  for (i = 0; i < size; i += 1000) {
+    mu_assert_int_eq(
+        0, zip_entry_write(zip, noise + i, size - i < 1000 ? size - i : 1000));
+  }
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  mu_assert_int_eq(0, zip_entry_open(zip, "short.bin"));
+  for (i = 0; i < 10000; i += 1000) {
+    mu_assert_int_eq(0, zip_entry_write(zip, noise + i, 1000));
+  }
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  mu_assert_int_eq(0, zip_set_store_threshold(zip, 0));
+  mu_assert_int_eq(0, zip_entry_open(zip, "deflated.bin"));
+  mu_assert_int_eq(0, zip_entry_write(zip, noise, size));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  zip_close(zip);
+
+  zip = zip_open(ZIPNAME, 0, 'r');
+  mu_check(zip != NULL);
+  mu_assert_int_eq(0, zip_entry_info(zip, 0, &info));
+  mu_assert_int_eq(0, info.method);
+  mu_assert_int_eq(size, info.comp_size);
+  mu_assert_int_eq(0, zip_entry_info(zip, 1, &info));
+  mu_assert_int_eq(8, info.method);
+  mu_assert_int_eq(0, zip_entry_info(zip, 2, &info));
+  mu_assert_int_eq(0, info.method);
+  mu_assert_int_eq(size, info.comp_size);
+  mu_assert_int_eq(0, zip_entry_info(zip, 3, &info));
+  mu_assert_int_eq(0, info.method);
+  mu_assert_int_eq(10000, info.comp_size);
+  mu_assert_int_eq(0, zip_entry_info(zip, 4, &info));
+  mu_assert_int_eq(8, info.method);
+
+  mu_assert_int_eq(0, zip_entry_open(zip, "noise.bin"));
+  mu_assert_int_eq(size, zip_entry_read(zip, (void **)&buf, &bufsize));
+  mu_assert_int_eq(0, memcmp(buf, noise, size));
+  free(buf);
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  mu_assert_int_eq(0, zip_entry_open(zip, "pieces.bin"));
+  mu_assert_int_eq(size, zip_entry_read(zip, (void **)&buf, &bufsize));
+  mu_assert_int_eq(0, memcmp(buf, noise, size));
+  free(buf);
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  zip_close(zip);
+
+  free(noise);
+  free(text);
+}
+
+MU_TEST(test_entry_open_level) {
+  const char *names[] = {"stored.txt", "rle.txt", "huffman.txt",
+                         "default.txt"};
+  char *buf = NULL;
+  size_t bufsize = 0, i;
+  struct zip_entry_info_t info;
+  struct zip_t *zip = zip_open(ZIPNAME, 0, 'w');
+  mu_check(zip != NULL);
+
+  mu_assert_int_eq(ZIP_EINVLVL, zip_entry_open_level(zip, names[0], 11,
+                                                     ZIP_STRATEGY_DEFAULT));
+  mu_assert_int_eq(ZIP_EINVLVL, zip_entry_open_level(zip, names[0], 1, 5));
+  mu_assert_int_eq(
+      0, zip_entry_open_level(zip, names[0], 0, ZIP_STRATEGY_DEFAULT));
+  mu_assert_int_eq(0, zip_entry_write(zip, TESTDATA1, strlen(TESTDATA1)));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  mu_assert_int_eq(0, zip_entry_open_level(zip, names[1], 1, ZIP_STRATEGY_RLE));
+  mu_assert_int_eq(0, zip_entry_write(zip, TESTDATA1, strlen(TESTDATA1)));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  mu_assert_int_eq(
+      0, zip_entry_open_level(zip, names[2], 1, ZIP_STRATEGY_HUFFMAN));
+  mu_assert_int_eq(0, zip_entry_write(zip, TESTDATA1, strlen(TESTDATA1)));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  mu_assert_int_eq(0, zip_entry_open(zip, names[3]));
+  mu_assert_int_eq(0, zip_entry_write(zip, TESTDATA1, strlen(TESTDATA1)));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  zip_close(zip);
+
+  zip = zip_open(ZIPNAME, 0, 'r');
+  mu_check(zip != NULL);
+  for (i = 0; i < 4; ++i) {
+    mu_assert_int_eq(0, zip_entry_info(zip, i, &info));
+    mu_assert_int_eq(i == 1 || i == 2 ? 8 : 0, info.method);
+    mu_assert_int_eq(0, zip_entry_open(zip, names[i]));
+    mu_assert_int_eq(strlen(TESTDATA1),
+                     zip_entry_read(zip, (void **)&buf, &bufsize));
+    mu_assert_int_eq(0, strncmp(buf, TESTDATA1, bufsize));
+    free(buf);
+    buf = NULL;
+    mu_assert_int_eq(0, zip_entry_close(zip));
+  }
+  zip_close(zip);
+}
+
+MU_TEST(test_entries_policy) {
+  const char *filenames[4] = {"policy.log", "policy.png", "policy.bin",
+                              "policy.txt"};
+  const int methods[4] = {8, 0, 8, 8};
+  struct zip_rule_t rules[3];
+  unsigned long long comp_sizes[2][4];
+  struct zip_entry_info_t info;
+  FILE *stream = NULL;
+  struct zip_t *zip = NULL;
+  int i, j, k;
+
+  for (i = 0; i < 4; ++i) {
+    stream = fopen(filenames[i], "wb");
+    mu_check(stream != NULL);
+    for (j = 0; j < (i == 2 ? 150000 : 2000); ++j) {
+      fprintf(stream, "%d %s\n", (j * 7919) % 1000, TESTDATA1);
+    }
+    fclose(stream);
+  }
+
+  memset(rules, 0, sizeof(rules));
+  rules[0].pattern = "*.PNG";
+  rules[0].level = 0;
+  rules[1].min_size = 1024 * 1024;
+  rules[1].level = 1;
+  rules[1].threads = 2;
+  rules[2].pattern = "*.log";
+  rules[2].level = 1;
+  rules[2].strategy = ZIP_STRATEGY_RLE;
+
+  for (k = 0; k < 2; ++k) {
+    zip = zip_open(ZIPNAME, ZIP_DEFAULT_COMPRESSION_LEVEL, 'w');
+    mu_check(zip != NULL);
+    rules[0].level = 11;
+    mu_assert_int_eq(ZIP_EINVLVL, zip_set_policy(zip, rules, 3));
+    rules[0].level = 0;
+    mu_assert_int_eq(0, zip_set_policy(zip, rules, 3));
+    mu_assert_int_eq(0, zip_entries_fwrite(zip, filenames, 4, k ? 4 : 1));
+    zip_close(zip);
+
+    zip = zip_open(ZIPNAME, 0, 'r');
+    mu_check(zip != NULL);
+    mu_assert_int_eq(4, zip_entries_total(zip));
+    for (i = 0; i < 4; ++i) {
+      mu_assert_int_eq(0, zip_entry_info(zip, (size_t)i, &info));
+      mu_assert_int_eq(methods[i], info.method);
+      comp_sizes[k][i] = info.comp_size;
+      mu_check(methods[i] || info.comp_size == info.uncomp_size);
+    }
+    zip_close(zip);
+    mu_assert_int_eq(0, zip_extract(ZIPNAME, ".", NULL, NULL));
+  }
+
+  // Serial and parallel runs compress every file the same way.
+  for (i = 0; i < 4; ++i) {
+    mu_check(comp_sizes[0][i] == comp_sizes[1][i]);
+    remove(filenames[i]);
+  }
+}
+
 MU_TEST_SUITE(test_write_suite) {
   MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
 
   MU_RUN_TEST(test_write);
   MU_RUN_TEST(test_fwrite);
+  MU_RUN_TEST(test_write_stream);
+  MU_RUN_TEST(test_entries_fwrite);
+  MU_RUN_TEST(test_entry_fwrite_parallel);
+  MU_RUN_TEST(test_entry_write_raw);
+  MU_RUN_TEST(test_entry_copy);
+  MU_RUN_TEST(test_write_buffer);
+  MU_RUN_TEST(test_store_threshold);
+  MU_RUN_TEST(test_entry_open_level);
+  MU_RUN_TEST(test_entries_policy);
 }
 
 #define UNUSED(x) (void)x
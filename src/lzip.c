@@ -24,6 +24,11 @@ SOFTWARE.
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <zip.h>
 
 
@@ -31,6 +36,16 @@ SOFTWARE.
 #define ZIP_MINIMUM_COMPRESSION_LEVEL 0
 #define ZIP_MAXIMUM_COMPRESSION_LEVEL 9
 
+// Default number of bytes returned by each read of an entry reader.
+#define LZIP_READER_CHUNK_SIZE 65536
+
+// Length of a table without metamethods, renamed after Lua 5.1.
+#if LUA_VERSION_NUM == 501
+#define lzip_rawlen(L, idx) lua_objlen(L, idx)
+#else
+#define lzip_rawlen(L, idx) lua_rawlen(L, idx)
+#endif
+
 
 // Macro to allow us to export C Constants back to Lua
 #define lua_setConst(L, name) \
@@ -45,13 +60,31 @@ SOFTWARE.
 /*
  * This is the data structure every instance will hold.
  * It contains a pointer to the zip_t data structure.
+ * In-memory archives also record that they are streams, and archives read
+ * from a Lua string keep a reference to it for as long as they are open.
  */
 struct lzip_data
 {
   struct zip_t *zip_t;
+  int stream;
+  int data_ref;
 };
 typedef struct lzip_data lzip_data;
 
+/*
+ * The data structure held by every entry reader.
+ * It owns the chunk buffer which is reused by every read and keeps a
+ * reference to the archive so it isn't collected while the reader is alive.
+ */
+struct lzip_reader
+{
+  struct zip_entry_reader_t *reader;
+  char *buffer;
+  size_t size;
+  int zip_ref;
+};
+typedef struct lzip_reader lzip_reader;
+
 
 //------------------------------------------------------------------------------
 
@@ -73,6 +106,16 @@ lzip_data *check_lzip(lua_State *L, int index)
 
 //------------------------------------------------------------------------------
 
+/*
+ * Checks whether the function argument (index) is an entry reader.
+ */
+lzip_reader *check_lzip_reader(lua_State *L, int index)
+{
+	return (lzip_reader *)luaL_checkudata(L, index, "lzip.reader");
+}
+
+//------------------------------------------------------------------------------
+
 /*
 * Decode a zip error number and push the resulting error string onto the stack.
 */
@@ -94,6 +137,20 @@ int lzip_geterror(lua_State *L, int err)
  *        - 'r': opens a file for reading/extracting (the file must exists).
  *        - 'w': creates an empty file for writing.
  *        - 'a': appends to an existing archive.
+ * options optional table.
+ *        - mmap: read the archive through a memory mapping ('r' only).
+ *        - write_buffer: bytes of writes collected before they reach the
+ *          file ('w' and 'a' only), 0 writes straight through.
+ *        - io_buffer: size of the chunks entry_fwrite reads files in and
+ *          entry_fread extracts them in.
+ *        - autocommit: table with any of entries, bytes and seconds, the
+ *          archive is committed (see commit) when an entry is closed once
+ *          that many entries were added, the file grew by that many bytes
+ *          or that many seconds passed ('w' and 'a' only).
+ *        - resume: rebuild the central directory of an archive that was
+ *          cut short while it was written ('a' only).
+ *        - store_threshold: entries whose start deflates by less than this
+ *          many percent are stored instead, 0 deflates everything.
  *
  * Returns:
  * The zip archive handler or NULL on error
@@ -103,12 +160,19 @@ static int lzip_open(lua_State *L)
 	const char *zipname;
 	int compressionlevel = ZIP_DEFAULT_COMPRESSION_LEVEL;
 	const char *mode = {'\0'};
-
-
-	if (lua_gettop(L) != 3)
+	int use_mmap = 0;
+	int resume = 0;
+	lua_Integer write_buffer = -1;
+	lua_Integer io_buffer = -1;
+	lua_Integer store_threshold = -1;
+	lua_Integer autocommit[3] = {0, 0, 0};
+	static const char *const autocommit_fields[3] = {"entries", "bytes", "seconds"};
+	int i;
+
+	if (lua_gettop(L) != 3 && lua_gettop(L) != 4)
 	{
 		// Display the usage message.
-		luaL_error(L, "usage: open( zipname, compressionlevel, mode)");
+		luaL_error(L, "usage: open( zipname, compressionlevel, mode [, options])");
 	}
 
 	zipname = luaL_checkstring(L, 1);
@@ -133,17 +197,105 @@ static int lzip_open(lua_State *L)
 		luaL_error(L, "Unrecognised archive access mode");
 	}
 
+	// Check the options.
+	if (lua_istable(L, 4))
+	{
+		lua_getfield(L, 4, "mmap");
+		use_mmap = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 4, "resume");
+		resume = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 4, "write_buffer");
+		if (lua_isnumber(L, -1))
+		{
+			write_buffer = lua_tointeger(L, -1);
+			luaL_argcheck(L, write_buffer >= 0, 4, "write_buffer must not be negative");
+		}
+		lua_pop(L, 1);
+
+		lua_getfield(L, 4, "io_buffer");
+		if (lua_isnumber(L, -1))
+		{
+			io_buffer = lua_tointeger(L, -1);
+			luaL_argcheck(L, io_buffer >= 0, 4, "io_buffer must not be negative");
+		}
+		lua_pop(L, 1);
+
+		lua_getfield(L, 4, "store_threshold");
+		if (lua_isnumber(L, -1))
+		{
+			store_threshold = lua_tointeger(L, -1);
+			luaL_argcheck(L, store_threshold >= 0 && store_threshold <= 100, 4, "store_threshold must be a percentage");
+		}
+		lua_pop(L, 1);
+
+		lua_getfield(L, 4, "autocommit");
+		if (lua_istable(L, -1))
+		{
+			for (i = 0; i < 3; i++)
+			{
+				lua_getfield(L, -1, autocommit_fields[i]);
+				autocommit[i] = lua_isnumber(L, -1) ? lua_tointeger(L, -1) : 0;
+				luaL_argcheck(L, autocommit[i] >= 0, 4, "autocommit limits must not be negative");
+				lua_pop(L, 1);
+			}
+		}
+		lua_pop(L, 1);
+	}
+	if (use_mmap && mode[0] != 'r')
+	{
+		luaL_error(L, "Memory mapping is only supported for reading");
+	}
+	if (resume && mode[0] != 'a')
+	{
+		luaL_error(L, "Resuming is only supported for appending");
+	}
+
 	// Create the user data
 	lzip_data *self = (lzip_data *)lua_newuserdata(L, sizeof(lzip_data));
+	self->stream = 0;
+	self->data_ref = LUA_NOREF;
 
 	// Call zip_open function.
-	self->zip_t = zip_open(zipname, compressionlevel, mode[0]);
+	if (use_mmap)
+	{
+		self->zip_t = zip_open_mmap(zipname, compressionlevel);
+	}
+	else if (resume)
+	{
+		self->zip_t = zip_open_resume(zipname, compressionlevel);
+	}
+	else
+	{
+		self->zip_t = zip_open(zipname, compressionlevel, mode[0]);
+	}
 	if (self->zip_t == NULL)
 	{
 		// Display a error.
 		luaL_error(L, "Unable to open archive.");
 	}
 
+	// Resize the write buffer, reading archives have none.
+	if (write_buffer >= 0 && (mode[0] == 'w' || mode[0] == 'a'))
+	{
+		zip_set_write_buffer(self->zip_t, (size_t)write_buffer);
+	}
+	if (io_buffer >= 0)
+	{
+		zip_set_io_buffer(self->zip_t, (size_t)io_buffer);
+	}
+	if (store_threshold >= 0)
+	{
+		zip_set_store_threshold(self->zip_t, (int)store_threshold);
+	}
+	if ((autocommit[0] || autocommit[1] || autocommit[2]) && (mode[0] == 'w' || mode[0] == 'a'))
+	{
+		zip_set_autocommit(self->zip_t, (size_t)autocommit[0], (unsigned long long)autocommit[1], (unsigned int)autocommit[2]);
+	}
+
 	// Create the userdata.
 	luaL_getmetatable(L, "lzip.db");
 	lua_setmetatable(L, -2);
@@ -164,14 +316,181 @@ static int lzip_close(lua_State *L)
 	// Close the archive.
 	if (self->zip_t != NULL)
 	{
-		zip_close(self->zip_t);
+		if (self->stream)
+		{
+			zip_stream_close(self->zip_t);
+		}
+		else
+		{
+			zip_close(self->zip_t);
+		}
+		self->zip_t = NULL;
+	}
+
+	// Release the Lua string an in-memory archive was read from.
+	luaL_unref(L, LUA_REGISTRYINDEX, self->data_ref);
+	self->data_ref = LUA_NOREF;
+
+	return 0;
+}
+
+//------------------------------------------------------------------------------
+
+/*
+ * Opens a zip archive held in a Lua string for reading.
+ *
+ * Passed:
+ * data            The archive's contents.
+ *
+ * Returns:
+ * The zip archive handler. The string is read in place, no copy is made.
+ */
+static int lzip_open_memory(lua_State *L)
+{
+	const char *data = NULL;
+	size_t size = 0;
+
+	data = luaL_checklstring(L, 1, &size);
+
+	// Create the user data
+	lzip_data *self = (lzip_data *)lua_newuserdata(L, sizeof(lzip_data));
+	self->stream = 1;
+	self->data_ref = LUA_NOREF;
+
+	// Open the archive straight from the string's memory.
+	self->zip_t = zip_stream_open(data, size, 0, 'r');
+	if (self->zip_t == NULL)
+	{
+		// Display a error.
+		luaL_error(L, "Unable to open archive.");
+	}
+
+	// Create the userdata.
+	luaL_getmetatable(L, "lzip.db");
+	lua_setmetatable(L, -2);
+
+	// Keep the string alive while the archive reads from it.
+	lua_pushvalue(L, 1);
+	self->data_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	return 1;
+}
+
+//------------------------------------------------------------------------------
+
+/*
+ * Creates a new zip archive in memory.
+ *
+ * Passed:
+ * level           Optional compression level.
+ *
+ * Returns:
+ * The zip archive handler. Use finalize() to get the archive's contents.
+ */
+static int lzip_new_memory(lua_State *L)
+{
+	int compressionlevel = ZIP_DEFAULT_COMPRESSION_LEVEL;
+
+	compressionlevel = (int)luaL_optinteger(L, 1, ZIP_DEFAULT_COMPRESSION_LEVEL);
+
+	// Check the compression level.
+	if ((compressionlevel & 0xF) > 9)
+	{
+		compressionlevel = ZIP_DEFAULT_COMPRESSION_LEVEL;
+	}
+
+	// Create the user data
+	lzip_data *self = (lzip_data *)lua_newuserdata(L, sizeof(lzip_data));
+	self->stream = 1;
+	self->data_ref = LUA_NOREF;
+
+	// Create the archive on the heap.
+	self->zip_t = zip_stream_open(NULL, 0, compressionlevel, 'w');
+	if (self->zip_t == NULL)
+	{
+		// Display a error.
+		luaL_error(L, "Unable to create archive.");
 	}
 
+	// Create the userdata.
+	luaL_getmetatable(L, "lzip.db");
+	lua_setmetatable(L, -2);
+
+	return 1;
+}
+
+//------------------------------------------------------------------------------
+
+/*
+ * Frees the buffer a finalized archive handed over, should pushing it as a
+ * string raise an error.
+ */
+static int lzip_buffer__gc(lua_State *L)
+{
+	void **box = (void **)lua_touserdata(L, 1);
+
+	if (box != NULL && *box != NULL)
+	{
+		free(*box);
+		*box = NULL;
+	}
 	return 0;
 }
 
 //------------------------------------------------------------------------------
 
+/*
+ * Finish an in-memory archive and return its contents as a string.
+ * The archive's buffer is taken over rather than copied and the archive is
+ * closed afterwards.
+ *
+ * Returns the archive's contents, or nil and an error message.
+ */
+static int lzip_finalize(lua_State *L)
+{
+	void **box = NULL;
+	size_t size = 0;
+	ssize_t result = 0;
+
+	// Grab the userdata from Lua's stack
+	lzip_data *self = check_lzip(L, 1);
+
+	if (!self->stream)
+	{
+		lua_pushnil(L);
+		lzip_geterror(L, ZIP_EINVMODE);
+		return 2;
+	}
+
+	// Holds the buffer until it is pushed, so a memory error can't leak it.
+	box = (void **)lua_newuserdata(L, sizeof(void *));
+	*box = NULL;
+	luaL_getmetatable(L, "lzip.buffer");
+	lua_setmetatable(L, -2);
+
+	// Take ownership of the archive's buffer.
+	result = zip_stream_finalize(self->zip_t, box, &size);
+	if (result < 0)
+	{
+		lua_pushnil(L);
+		lzip_geterror(L, (int)result);
+		return 2;
+	}
+
+	// The archive is done with, close it before anything can raise an error.
+	zip_stream_close(self->zip_t);
+	self->zip_t = NULL;
+
+	// Push the archive and release the buffer.
+	lua_pushlstring(L, (const char *)*box, size);
+	free(*box);
+	*box = NULL;
+
+	return 1;
+}
+
+//------------------------------------------------------------------------------
+
 /*
  * Is this a 64bit zip archive?
  */
@@ -190,29 +509,73 @@ int lzip_is64(lua_State *L)
 
 /*
  *	Open a zip entry by name
+ *
+ *	Passed:
+ *	entryname name of the entry.
+ *	options optional table, for entries added to an archive opened in 'w' or
+ *	'a' mode.
+ *	       - level: compression level (0-10) of this entry instead of the
+ *	         archive's, 0 stores it.
+ *	       - strategy: "default", "filtered", "huffman" (literals only), "rle"
+ *	         (matches at distance 1 only) or "fixed" (static Huffman codes).
+ *
+ *	Returns nil, or an error message if the entry could not be opened.
  */
 int lzip_entry_open(lua_State *L)
 {
+	static const char *const strategies[] = {"default", "filtered", "huffman", "rle", "fixed", NULL};
 	const char *entryname;
+	lua_Integer level = -1;
+	int strategy = ZIP_STRATEGY_DEFAULT;
+	int result = 0;
 	
 	// Grab the userdata from Lua's stack
 	lzip_data *self = check_lzip(L, 1);
 	
 	// Check for the name on the stack
 	entryname = luaL_checkstring(L, 2);	
-	
-	// Open the entry.
-	return zip_entry_open(self->zip_t, entryname);
+
+	// Read the per entry compression settings.
+	if (lua_istable(L, 3))
+	{
+		lua_getfield(L, 3, "level");
+		if (!lua_isnil(L, -1))
+		{
+			level = luaL_checkinteger(L, -1);
+			luaL_argcheck(L, level >= 0 && level <= 10, 3, "level must be between 0 and 10");
+		}
+		lua_pop(L, 1);
+
+		lua_getfield(L, 3, "strategy");
+		if (!lua_isnil(L, -1))
+		{
+			strategy = luaL_checkoption(L, -1, NULL, strategies);
+		}
+		lua_pop(L, 1);
+
+		result = zip_entry_open_level(self->zip_t, entryname, (int)level, strategy);
+	}
+	else
+	{
+		// Open the entry.
+		result = zip_entry_open(self->zip_t, entryname);
+	}
+
+	lzip_geterror(L, result);
+	return 1;
 }
 
 //------------------------------------------------------------------------------
 
 /*
  * Open a case sensitive archive entry.
+ *
+ * Returns nil, or an error message if the entry could not be opened.
  */
 int lzip_entry_opencasesensitive(lua_State *L)
 {
 	const char *entryname;
+	int result = 0;
 	
 	// Grab the userdata from Lua's stack.
 	lzip_data *self = check_lzip(L, 1);
@@ -221,17 +584,22 @@ int lzip_entry_opencasesensitive(lua_State *L)
 	entryname = luaL_checkstring(L, 2);	
 	
 	// Try to open the entry.
-	return zip_entry_opencasesensitive(self->zip_t, entryname);
+	result = zip_entry_opencasesensitive(self->zip_t, entryname);
+	lzip_geterror(L, result);
+	return 1;
 }
 
 //------------------------------------------------------------------------------
 
 /*
  *	Open an archive entry by index. Indexes start at 0. 
+ *
+ *	Returns nil, or an error message if the entry could not be opened.
  */
 int lzip_entry_openbyindex(lua_State *L)
 {
 	long Index = 0;
+	int result = 0;
 	
 	// Grab the userdata from Lua's stack
 	lzip_data *self = check_lzip(L, 1);
@@ -240,7 +608,9 @@ int lzip_entry_openbyindex(lua_State *L)
 	Index = (long)luaL_checknumber(L, 2);
 
 	// Try to open the entry.
-	return zip_entry_openbyindex(self->zip_t, Index);
+	result = zip_entry_openbyindex(self->zip_t, Index);
+	lzip_geterror(L, result);
+	return 1;
 }
 
 //------------------------------------------------------------------------------
@@ -371,18 +741,65 @@ int lzip_entry_write(lua_State *L)
 
 //------------------------------------------------------------------------------
 
+/*
+ *	Add a new entry from data which has already been deflated.
+ *
+ *	Passed:
+ *	name            The entry name.
+ *	data            Raw deflate stream, e.g. from entry_read_raw.
+ *	crc32           CRC-32 of the uncompressed data.
+ *	size            Size of the uncompressed data.
+ */
+int lzip_entry_write_raw(lua_State *L)
+{
+	int result = 0;
+	size_t length = 0;
+	const char *name = NULL;
+	const char *data = NULL;
+	uint32_t crc32 = 0;
+	unsigned long long size = 0;
+
+	// Grab the userdata from Lua's stack
+	lzip_data *self = check_lzip(L, 1);
+
+	// Get the entry and its description from the stack.
+	name = luaL_checkstring(L, 2);
+	data = luaL_checklstring(L, 3, &length);
+	crc32 = (uint32_t)luaL_checknumber(L, 4);
+	size = (unsigned long long)luaL_checknumber(L, 5);
+
+	// Store the data as is, the entry is opened and closed by the call.
+	result = zip_entry_write_raw(self->zip_t, name, data, length, crc32, size);
+	lzip_geterror(L, result);
+	return 1;
+}
+
+//------------------------------------------------------------------------------
+
 /*
  *	Write the contents of a file into the currently selected entry.
+ *	An optional thread count deflates a large file in parallel blocks,
+ *	the entry must not have been written to yet in that case.
  */
 int lzip_entry_fwrite(lua_State *L)
 {
 	int result = 0;
+	lua_Integer threads = 0;
 	
 	// Grab the userdata from Lua's stack
 	lzip_data *self = check_lzip(L, 1);
 	
+	// How many threads compress the file.
+	threads = luaL_optinteger(L, 3, 1);
+	luaL_argcheck(L, threads >= 1, 3, "threads must be at least 1");
+	if (threads > ZIP_MAX_THREADS)
+		threads = ZIP_MAX_THREADS;
+	
 	// Read the file and write it's data into the current entry.
-	result = zip_entry_fwrite(self->zip_t, luaL_checkstring(L, 2));
+	if (threads > 1)
+		result = zip_entry_fwrite_parallel(self->zip_t, luaL_checkstring(L, 2), (int)threads);
+	else
+		result = zip_entry_fwrite(self->zip_t, luaL_checkstring(L, 2));
 	lzip_geterror(L, result);
 	return 1;
 }
@@ -407,70 +824,1125 @@ int lzip_entry_fread(lua_State *L)
 
 //------------------------------------------------------------------------------
 
+#if LUA_VERSION_NUM == 501
 /*
- *	Close the current entry in the archive.
+ * Extraction callback which appends each inflated chunk to a luaL_Buffer.
  */
-int lzip_entry_close(lua_State *L)
+static size_t lzip_buffer_write(void *arg, uint64_t offset, const void *data, size_t size)
 {
-	int result = 0;
-	
-	// Grab the userdata from Lua's stack
-	lzip_data *self = check_lzip(L, 1);
-	
-	// Close the current archive entry.
-	result = zip_entry_close(self->zip_t);
-	lzip_geterror(L, result);
-	return 1;
+	(void)offset;
+	luaL_addlstring((luaL_Buffer *)arg, (const char *)data, size);
+	return size;
 }
+#endif
 
 //------------------------------------------------------------------------------
 
 /*
- *	Places the index of the current entry in the archive on the Lua stack.
+ *	Read the currently selected entry and place its contents on the Lua stack.
+ *
+ *	The Lua buffer is sized from the entry's uncompressed size and the entry is
+ *	inflated straight into it, so no intermediate heap copy is made.
+ *
+ *	Returns the data, or nil and an error message.
  */
-int lzip_entry_index(lua_State *L)
+int lzip_entry_read(lua_State *L)
 {
-	int result = 0;
-	
+	unsigned long long size = 0;
+	ssize_t result = 0, index = 0;
+	luaL_Buffer buffer;
+#if LUA_VERSION_NUM != 501
+	char *data = NULL;
+#endif
+
 	// Grab the userdata from Lua's stack
 	lzip_data *self = check_lzip(L, 1);
-	
-	// Find the index of the current entry
-	result = zip_entry_index(self->zip_t);
-	
-	// Place the result on the stack.
-	lua_pushnumber(L, result);	
-	// lzip_geterror(L,result);
-	return 1;
+
+	// Only an open entry of the archive can be read, not one being written.
+	index = zip_entry_index(self->zip_t);
+	if (!zip_entry_name(self->zip_t) || index < 0 || index >= zip_entries_total(self->zip_t))
+	{
+		lua_pushnil(L);
+		lzip_geterror(L, ZIP_ENOENT);
+		return 2;
+	}
+
+	// Directories have no data to read.
+	if (zip_entry_isdir(self->zip_t) > 0)
+	{
+		lua_pushnil(L);
+		lzip_geterror(L, ZIP_EINVENTTYPE);
+		return 2;
+	}
+
+	// Make sure the entry will fit in memory.
+	size = zip_entry_uncomp_size(self->zip_t);
+	if (size > (unsigned long long)(size_t)-1)
+	{
+		lua_pushnil(L);
+		lzip_geterror(L, ZIP_EOOMEM);
+		return 2;
+	}
+
+#if LUA_VERSION_NUM == 501
+	// Lua 5.1 can't presize a buffer, so append the entry a chunk at a time.
+	luaL_buffinit(L, &buffer);
+	result = zip_entry_extract(self->zip_t, lzip_buffer_write, &buffer);
+	if (result >= 0)
+	{
+		luaL_pushresult(&buffer);
+		return 1;
+	}
+#else
+	// Decompress the entry directly into the Lua buffer.
+	data = luaL_buffinitsize(L, &buffer, (size_t)size);
+	result = size ? zip_entry_noallocread(self->zip_t, data, (size_t)size) : 0;
+	if (result >= 0)
+	{
+		luaL_pushresultsize(&buffer, (size_t)result);
+		return 1;
+	}
+#endif
+
+	lua_pushnil(L);
+	lzip_geterror(L, (int)result);
+	return 2;
 }
 
 //------------------------------------------------------------------------------
 
 /*
- *	Places the total number of entries in the archive on the Lua stack
+ *	Read the currently selected entry as it is stored in the archive, without
+ *	inflating it.
+ *
+ *	Passed:
+ *	gzip            Optional, wrap the deflated data into a gzip member using
+ *	                the CRC and size from the central directory.
+ *
+ *	Returns the data, or nil and an error message.
  */
-static int lzip_entries_total(lua_State *L)
+int lzip_entry_read_raw(lua_State *L)
 {
+	unsigned char header[ZIP_GZIP_HEADER_SIZE];
+	unsigned char trailer[ZIP_GZIP_TRAILER_SIZE];
+	void *data = NULL;
+	size_t size = 0;
+	ssize_t result = 0;
+	int gzip = 0;
+	luaL_Buffer buffer;
+
 	// Grab the userdata from Lua's stack
 	lzip_data *self = check_lzip(L, 1);
-	
-	// Push the total number of entries into the stack.
-	lua_pushnumber(L, zip_entries_total(self->zip_t));
+
+	// Is a gzip member wanted.
+	gzip = lua_toboolean(L, 2);
+	if (gzip)
+	{
+		result = zip_entry_gzip_frame(self->zip_t, header, trailer);
+		if (result < 0)
+		{
+			lua_pushnil(L);
+			lzip_geterror(L, (int)result);
+			return 2;
+		}
+	}
+
+	// Read the stored bytes.
+	result = zip_entry_read_raw(self->zip_t, &data, &size);
+	if (result < 0)
+	{
+		lua_pushnil(L);
+		lzip_geterror(L, (int)result);
+		return 2;
+	}
+
+	luaL_buffinit(L, &buffer);
+	if (gzip)
+		luaL_addlstring(&buffer, (const char *)header, sizeof(header));
+	luaL_addlstring(&buffer, (const char *)data, size);
+	if (gzip)
+		luaL_addlstring(&buffer, (const char *)trailer, sizeof(trailer));
+	free(data);
+	luaL_pushresult(&buffer);
 	return 1;
 }
 
 //------------------------------------------------------------------------------
 
 /*
- *	Simple wrapper function which takes a list of files in a lua table and compresses 
- *  them into a zip archive.
+ *	Build the gzip header and trailer for the currently selected entry, to send
+ *	around the chunks of a raw reader.
+ *
+ *	Returns the header and trailer, or nil and an error message.
  */
-int lzipFiles(lua_State *L)
+int lzip_entry_gzip_frame(lua_State *L)
 {
-  // Initialize the zip state.
-  struct zip_t *Zip;
-  
-  int CompressionLevel = ZIP_DEFAULT_COMPRESSION_LEVEL;
+	unsigned char header[ZIP_GZIP_HEADER_SIZE];
+	unsigned char trailer[ZIP_GZIP_TRAILER_SIZE];
+	int result = 0;
+
+	// Grab the userdata from Lua's stack
+	lzip_data *self = check_lzip(L, 1);
+
+	result = zip_entry_gzip_frame(self->zip_t, header, trailer);
+	if (result < 0)
+	{
+		lua_pushnil(L);
+		lzip_geterror(L, result);
+		return 2;
+	}
+
+	lua_pushlstring(L, (const char *)header, sizeof(header));
+	lua_pushlstring(L, (const char *)trailer, sizeof(trailer));
+	return 2;
+}
+
+//------------------------------------------------------------------------------
+
+/*
+ *	Create a reader userdata for the currently selected entry, inflated or as
+ *	stored in the archive.
+ */
+static int lzip_push_reader(lua_State *L, int raw)
+{
+	lzip_reader *reader = NULL;
+	lua_Integer chunksize = 0;
+
+	// Grab the userdata from Lua's stack
+	lzip_data *self = check_lzip(L, 1);
+
+	// Get the chunk size from the stack.
+	chunksize = luaL_optinteger(L, 2, LZIP_READER_CHUNK_SIZE);
+	luaL_argcheck(L, chunksize > 0, 2, "chunk size must be positive");
+
+	// Create the reader userdata.
+	reader = (lzip_reader *)lua_newuserdata(L, sizeof(lzip_reader));
+	reader->reader = NULL;
+	reader->buffer = NULL;
+	reader->size = 0;
+	reader->zip_ref = LUA_NOREF;
+	luaL_getmetatable(L, "lzip.reader");
+	lua_setmetatable(L, -2);
+
+	// Allocate the buffer every read will reuse.
+	reader->buffer = (char *)malloc((size_t)chunksize);
+	if (reader->buffer == NULL)
+	{
+		lua_pushnil(L);
+		lzip_geterror(L, ZIP_EOOMEM);
+		return 2;
+	}
+	reader->size = (size_t)chunksize;
+
+	// Start reading the current entry.
+	if (raw)
+		reader->reader = zip_entry_reader_open_raw(self->zip_t);
+	else
+		reader->reader = zip_entry_reader_open(self->zip_t);
+	if (reader->reader == NULL)
+	{
+		lua_pushnil(L);
+		lzip_geterror(L, ZIP_ENOENT);
+		return 2;
+	}
+
+	// Keep the archive alive for as long as the reader is.
+	lua_pushvalue(L, 1);
+	reader->zip_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	return 1;
+}
+
+//------------------------------------------------------------------------------
+
+/*
+ *	Open a reader which returns the currently selected entry a chunk at a time.
+ *
+ *	Passed:
+ *	chunksize       Optional size of the reusable read buffer.
+ *
+ *	Returns the reader, or nil and an error message.
+ */
+int lzip_entry_reader(lua_State *L)
+{
+	return lzip_push_reader(L, 0);
+}
+
+//------------------------------------------------------------------------------
+
+/*
+ *	Open a reader which returns the stored, still compressed, bytes of the
+ *	currently selected entry a chunk at a time.
+ *
+ *	Passed:
+ *	chunksize       Optional size of the reusable read buffer.
+ *
+ *	Returns the reader, or nil and an error message.
+ */
+int lzip_entry_reader_raw(lua_State *L)
+{
+	return lzip_push_reader(L, 1);
+}
+
+//------------------------------------------------------------------------------
+
+/*
+ *	Read the next chunk from an entry reader.
+ *
+ *	Passed:
+ *	size            Optional maximum number of bytes to read, defaults to the
+ *	                reader's chunk size.
+ *
+ *	Returns the data, nil at the end of the entry, or nil and an error message.
+ */
+static int lzip_reader_read(lua_State *L)
+{
+	ssize_t result = 0;
+	lua_Integer size = 0;
+	char *buffer = NULL;
+
+	// Grab the reader from Lua's stack
+	lzip_reader *self = check_lzip_reader(L, 1);
+
+	// Get the number of bytes wanted from the stack.
+	size = luaL_optinteger(L, 2, (lua_Integer)self->size);
+	luaL_argcheck(L, size > 0, 2, "size must be positive");
+
+	if (self->reader == NULL)
+	{
+		lua_pushnil(L);
+		lzip_geterror(L, ZIP_ENOINIT);
+		return 2;
+	}
+
+	// Grow the shared buffer if a bigger read is asked for.
+	if ((size_t)size > self->size)
+	{
+		buffer = (char *)realloc(self->buffer, (size_t)size);
+		if (buffer == NULL)
+		{
+			lua_pushnil(L);
+			lzip_geterror(L, ZIP_EOOMEM);
+			return 2;
+		}
+		self->buffer = buffer;
+		self->size = (size_t)size;
+	}
+
+	// Inflate the next chunk.
+	result = zip_entry_reader_read(self->reader, self->buffer, (size_t)size);
+	if (result > 0)
+	{
+		lua_pushlstring(L, self->buffer, (size_t)result);
+		return 1;
+	}
+
+	lua_pushnil(L);
+	if (result < 0)
+	{
+		lzip_geterror(L, (int)result);
+		return 2;
+	}
+	return 1;
+}
+
+//------------------------------------------------------------------------------
+
+/*
+ *	Close an entry reader and release its buffer.
+ *
+ *	Returns nil, or an error message if a fully read entry failed its CRC check.
+ */
+static int lzip_reader_close(lua_State *L)
+{
+	int result = 0;
+
+	// Grab the reader from Lua's stack
+	lzip_reader *self = check_lzip_reader(L, 1);
+
+	if (self->reader != NULL)
+	{
+		result = zip_entry_reader_close(self->reader);
+		self->reader = NULL;
+	}
+
+	if (self->buffer != NULL)
+	{
+		free(self->buffer);
+		self->buffer = NULL;
+		self->size = 0;
+	}
+
+	// Let the archive be collected again.
+	luaL_unref(L, LUA_REGISTRYINDEX, self->zip_ref);
+	self->zip_ref = LUA_NOREF;
+
+	lzip_geterror(L, result);
+	return 1;
+}
+
+//------------------------------------------------------------------------------
+
+/*
+ *	Close the current entry in the archive.
+ */
+int lzip_entry_close(lua_State *L)
+{
+	int result = 0;
+	
+	// Grab the userdata from Lua's stack
+	lzip_data *self = check_lzip(L, 1);
+	
+	// Close the current archive entry.
+	result = zip_entry_close(self->zip_t);
+	lzip_geterror(L, result);
+	return 1;
+}
+
+//------------------------------------------------------------------------------
+
+/*
+ *	Places the index of the current entry in the archive on the Lua stack.
+ */
+int lzip_entry_index(lua_State *L)
+{
+	int result = 0;
+	
+	// Grab the userdata from Lua's stack
+	lzip_data *self = check_lzip(L, 1);
+	
+	// Find the index of the current entry
+	result = zip_entry_index(self->zip_t);
+	
+	// Place the result on the stack.
+	lua_pushnumber(L, result);	
+	// lzip_geterror(L,result);
+	return 1;
+}
+
+//------------------------------------------------------------------------------
+
+/*
+ *	Places the total number of entries in the archive on the Lua stack
+ */
+static int lzip_entries_total(lua_State *L)
+{
+	// Grab the userdata from Lua's stack
+	lzip_data *self = check_lzip(L, 1);
+	
+	// Push the total number of entries into the stack.
+	lua_pushnumber(L, zip_entries_total(self->zip_t));
+	return 1;
+}
+
+//------------------------------------------------------------------------------
+
+/*
+ * Names of the fields a listing can return, in bit order.
+ */
+static const char *const lzip_info_fields[] = {
+	"name", "index", "size", "comp_size", "crc32",
+	"method", "offset", "mtime", "isdir", NULL};
+
+#define LZIP_INFO_ALL ((1 << 9) - 1)
+
+/*
+ * Turn an optional table of field names into a bit mask, defaults to all.
+ */
+static int lzip_info_mask(lua_State *L, int index)
+{
+	int mask = 0;
+	size_t i, n;
+
+	if (lua_isnoneornil(L, index))
+	{
+		return LZIP_INFO_ALL;
+	}
+	luaL_checktype(L, index, LUA_TTABLE);
+
+	n = lzip_rawlen(L, index);
+	for (i = 1; i <= n; i++)
+	{
+		lua_rawgeti(L, index, (int)i);
+		mask |= 1 << luaL_checkoption(L, -1, NULL, lzip_info_fields);
+		lua_pop(L, 1);
+	}
+	return mask;
+}
+
+/*
+ * Collect a table of entry names into a malloc'd array for the bulk name
+ * functions of the zip library. The strings stay anchored in the table.
+ */
+static char **lzip_check_names(lua_State *L, int index, size_t *count)
+{
+	char **names = NULL;
+	size_t i = 0;
+
+	luaL_checktype(L, index, LUA_TTABLE);
+
+	*count = lzip_rawlen(L, index);
+	names = malloc((*count + 1) * sizeof(*names));
+	if (names == NULL)
+	{
+		luaL_error(L, "out of memory");
+		return NULL;
+	}
+	for (i = 0; i < *count; i++)
+	{
+		lua_rawgeti(L, index, (int)i + 1);
+		if (lua_type(L, -1) != LUA_TSTRING)
+		{
+			free(names);
+			luaL_argerror(L, index, "entry names must be strings");
+			return NULL;
+		}
+		names[i] = (char *)lua_tostring(L, -1);
+		lua_pop(L, 1);
+	}
+	return names;
+}
+
+/*
+ * Fill the table on top of the stack with the requested fields of an entry.
+ */
+static void lzip_push_info(lua_State *L, const struct zip_entry_info_t *info,
+	size_t index, int mask)
+{
+	if (mask & (1 << 0))
+	{
+		lua_pushlstring(L, info->name, info->namelen);
+		lua_setfield(L, -2, "name");
+	}
+	if (mask & (1 << 1))
+	{
+		lua_pushinteger(L, (lua_Integer)index);
+		lua_setfield(L, -2, "index");
+	}
+	if (mask & (1 << 2))
+	{
+		lua_pushnumber(L, (lua_Number)info->uncomp_size);
+		lua_setfield(L, -2, "size");
+	}
+	if (mask & (1 << 3))
+	{
+		lua_pushnumber(L, (lua_Number)info->comp_size);
+		lua_setfield(L, -2, "comp_size");
+	}
+	if (mask & (1 << 4))
+	{
+		lua_pushnumber(L, (lua_Number)info->crc32);
+		lua_setfield(L, -2, "crc32");
+	}
+	if (mask & (1 << 5))
+	{
+		lua_pushinteger(L, info->method);
+		lua_setfield(L, -2, "method");
+	}
+	if (mask & (1 << 6))
+	{
+		lua_pushnumber(L, (lua_Number)info->header_offset);
+		lua_setfield(L, -2, "offset");
+	}
+	if (mask & (1 << 7))
+	{
+		lua_pushnumber(L, (lua_Number)info->m_time);
+		lua_setfield(L, -2, "mtime");
+	}
+	if (mask & (1 << 8))
+	{
+		lua_pushboolean(L, info->isdir);
+		lua_setfield(L, -2, "isdir");
+	}
+}
+
+//------------------------------------------------------------------------------
+
+/*
+ * Lists every entry in the archive in one call, straight from the central
+ * directory, without opening the entries.
+ *
+ * Passed:
+ * fields          Optional table of field names to return, defaults to all.
+ * names           Optional table of entry names, only those entries are
+ *                 listed. The index field tells where they are.
+ *
+ * Returns:
+ * An array of records, or nil and an error message.
+ */
+static int lzip_list(lua_State *L)
+{
+	struct zip_entry_info_t info;
+	size_t *indices = NULL;
+	ssize_t i, total;
+	int err, mask;
+
+	// Grab the userdata from Lua's stack
+	lzip_data *self = check_lzip(L, 1);
+	mask = lzip_info_mask(L, 2);
+
+	total = zip_entries_total(self->zip_t);
+	if (total >= 0 && !lua_isnoneornil(L, 3))
+	{
+		size_t count = 0;
+		char **names = lzip_check_names(L, 3, &count);
+
+		indices = malloc(((size_t)total + 1) * sizeof(*indices));
+		if (indices == NULL)
+		{
+			free(names);
+			return luaL_error(L, "out of memory");
+		}
+		total = zip_entries_select(self->zip_t, names, count, indices);
+		free(names);
+	}
+	if (total < 0)
+	{
+		free(indices);
+		lua_pushnil(L);
+		lzip_geterror(L, (int)total);
+		return 2;
+	}
+
+	lua_createtable(L, (int)total, 0);
+	for (i = 0; i < total; i++)
+	{
+		size_t index = indices ? indices[i] : (size_t)i;
+		if ((err = zip_entry_info(self->zip_t, index, &info)) < 0)
+		{
+			free(indices);
+			lua_pushnil(L);
+			lzip_geterror(L, err);
+			return 2;
+		}
+		lua_createtable(L, 0, 9);
+		lzip_push_info(L, &info, index, mask);
+		lua_rawseti(L, -2, (int)i + 1);
+	}
+	free(indices);
+	return 1;
+}
+
+/*
+ * Iterator step for entries(), the record table is an upvalue and is
+ * refilled on every call.
+ */
+static int lzip_entries_next(lua_State *L)
+{
+	struct zip_entry_info_t info;
+	lzip_data *self = check_lzip(L, 1);
+	lua_Integer i = lua_tointeger(L, 2);
+
+	if (i < 0 || zip_entry_info(self->zip_t, (size_t)i, &info) < 0)
+	{
+		return 0;
+	}
+
+	lua_pushinteger(L, i + 1);
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lzip_push_info(L, &info, (size_t)i, (int)lua_tointeger(L, lua_upvalueindex(2)));
+	return 2;
+}
+
+/*
+ * Iterate over every entry in the archive, for use in a generic for loop.
+ * A single record table is reused for every entry, copy any fields you
+ * want to keep.
+ *
+ * Passed:
+ * fields          Optional table of field names to return, defaults to all.
+ */
+static int lzip_entries(lua_State *L)
+{
+	int mask;
+
+	check_lzip(L, 1);
+	mask = lzip_info_mask(L, 2);
+
+	lua_createtable(L, 0, 9);
+	lua_pushinteger(L, mask);
+	lua_pushcclosure(L, lzip_entries_next, 2);
+	lua_pushvalue(L, 1);
+	lua_pushinteger(L, 0);
+	return 3;
+}
+
+//------------------------------------------------------------------------------
+
+/*
+ *	Copy an entry of another archive into this one, as it is stored, without
+ *	inflating and deflating it again.
+ *
+ *	Passed:
+ *	source          Archive opened for reading.
+ *	entry           Name or 0-based index of the entry in source. Looking up a
+ *	                name selects and closes it as the current entry of source.
+ *	name            Optional new name for the copy.
+ *
+ *	Returns true, or nil and an error message.
+ */
+static int lzip_copy_entry_from(lua_State *L)
+{
+	ssize_t index = 0;
+	int result = 0;
+	const char *name = NULL;
+
+	// Grab both archives from Lua's stack
+	lzip_data *self = check_lzip(L, 1);
+	lzip_data *source = check_lzip(L, 2);
+
+	// Get the optional new name from the stack.
+	name = luaL_optstring(L, 4, NULL);
+
+	// Find the entry in the source archive.
+	if (lua_type(L, 3) == LUA_TNUMBER)
+	{
+		index = (ssize_t)lua_tointeger(L, 3);
+		result = index < 0 ? ZIP_EINVIDX : 0;
+	}
+	else
+	{
+		result = zip_entry_open(source->zip_t, luaL_checkstring(L, 3));
+		index = zip_entry_index(source->zip_t);
+		zip_entry_close(source->zip_t);
+	}
+
+	if (result >= 0)
+	{
+		result = zip_entry_copy(self->zip_t, source->zip_t, (size_t)index, name);
+	}
+
+	if (result < 0)
+	{
+		lua_pushnil(L);
+		lzip_geterror(L, result);
+		return 2;
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+//------------------------------------------------------------------------------
+
+/*
+ *	Delete entries from an archive opened with mode "d". The data of the
+ *	entries after them is moved down in large chunks.
+ *
+ *	Passed:
+ *	names           Table of the entry names to delete.
+ *	options         Optional table:
+ *	                - lazy: only drop the entries from the central directory
+ *	                  and leave their data as holes for compact().
+ *
+ *	Returns the number of entries deleted, or nil and an error message.
+ */
+static int lzip_delete(lua_State *L)
+{
+	char **names = NULL;
+	size_t count = 0;
+	ssize_t result = 0;
+	int lazy = 0;
+
+	lzip_data *self = check_lzip(L, 1);
+	if (!lua_isnoneornil(L, 3))
+	{
+		luaL_checktype(L, 3, LUA_TTABLE);
+		lua_getfield(L, 3, "lazy");
+		lazy = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+	names = lzip_check_names(L, 2, &count);
+
+	if (lazy)
+	{
+		result = zip_entries_unlink(self->zip_t, names, count);
+	}
+	else
+	{
+		result = zip_entries_delete(self->zip_t, names, count);
+	}
+	free(names);
+
+	if (result < 0)
+	{
+		lua_pushnil(L);
+		lzip_geterror(L, (int)result);
+		return 2;
+	}
+	lua_pushinteger(L, (lua_Integer)result);
+	return 1;
+}
+
+//------------------------------------------------------------------------------
+
+/*
+ *	Move entries down into the holes lazy deletes left, first to last.
+ *
+ *	Passed:
+ *	budget          Optional number of bytes to move at most, entries are
+ *	                moved whole and the first one always is. Defaults to
+ *	                no limit.
+ *
+ *	Returns the number of bytes moved, or nil and an error message.
+ */
+static int lzip_compact(lua_State *L)
+{
+	ssize_t result = 0;
+	lua_Integer budget = 0;
+
+	lzip_data *self = check_lzip(L, 1);
+	budget = luaL_optinteger(L, 2, 0);
+	luaL_argcheck(L, budget >= 0, 2, "budget must not be negative");
+
+	result = zip_compact(self->zip_t, (size_t)budget);
+	if (result < 0)
+	{
+		lua_pushnil(L);
+		lzip_geterror(L, (int)result);
+		return 2;
+	}
+	lua_pushnumber(L, (lua_Number)result);
+	return 1;
+}
+
+/*
+ *	Write the central directory out so the file on disk holds every entry
+ *	closed so far, and carry on appending. See the autocommit option of
+ *	open() to have this happen by itself.
+ *
+ *	Returns true, or nil and an error message.
+ */
+static int lzip_commit(lua_State *L)
+{
+	int result = 0;
+
+	lzip_data *self = check_lzip(L, 1);
+
+	result = zip_commit(self->zip_t);
+	if (result < 0)
+	{
+		lua_pushnil(L);
+		lzip_geterror(L, result);
+		return 2;
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ *	Replace the data of an entry in an archive opened for writing. The data
+ *	is written over the old one when it fits, otherwise into a hole large
+ *	enough or after the last entry.
+ *
+ *	Passed:
+ *	name            Name of the entry, matched case sensitively.
+ *	data            The new contents as a string.
+ *
+ *	Returns true, or nil and an error message.
+ */
+static int lzip_replace(lua_State *L)
+{
+	size_t size = 0;
+	int result = 0;
+
+	lzip_data *self = check_lzip(L, 1);
+	const char *name = luaL_checkstring(L, 2);
+	const char *data = luaL_checklstring(L, 3, &size);
+
+	result = zip_entry_replace(self->zip_t, name, data, size);
+	if (result < 0)
+	{
+		lua_pushnil(L);
+		lzip_geterror(L, result);
+		return 2;
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ *	Returns how many bytes compact() would reclaim, or nil and an error
+ *	message.
+ */
+static int lzip_reclaimable(lua_State *L)
+{
+	unsigned long long bytes = 0;
+	int result = 0;
+
+	lzip_data *self = check_lzip(L, 1);
+
+	result = zip_reclaimable(self->zip_t, &bytes);
+	if (result < 0)
+	{
+		lua_pushnil(L);
+		lzip_geterror(L, result);
+		return 2;
+	}
+	lua_pushnumber(L, (lua_Number)bytes);
+	return 1;
+}
+
+//------------------------------------------------------------------------------
+
+/*
+ *	Merge a list of archives into a new one. Entries are copied as they are
+ *	stored, nothing is decompressed.
+ *
+ *	Passed:
+ *	zipname         The archive to create.
+ *	inputs          Table of the archives to merge, in order.
+ *
+ *	Returns true, or nil and an error message.
+ */
+static int lzip_merge(lua_State *L)
+{
+	const char **inputs = NULL;
+	size_t count = 0;
+	size_t i = 0;
+	int result = 0;
+	const char *zipname = luaL_checkstring(L, 1);
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	// Collect the names, the strings stay anchored in the table.
+	count = lzip_rawlen(L, 2);
+	inputs = malloc((count + 1) * sizeof(*inputs));
+	if (inputs == NULL)
+	{
+		return luaL_error(L, "out of memory");
+	}
+	for (i = 0; i < count; i++)
+	{
+		lua_rawgeti(L, 2, (int)i + 1);
+		inputs[i] = lua_type(L, -1) == LUA_TSTRING ? lua_tostring(L, -1) : NULL;
+		lua_pop(L, 1);
+	}
+
+	result = zip_merge(zipname, inputs, count);
+	free(inputs);
+
+	if (result < 0)
+	{
+		lua_pushnil(L);
+		lzip_geterror(L, result);
+		return 2;
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+//------------------------------------------------------------------------------
+
+/*
+ *	Tells whether a file name given to compress_files is the name of an entry,
+ *	backslashes in it were stored as slashes.
+ */
+static int lzip_same_name(const char *file, const struct zip_entry_info_t *info)
+{
+  size_t i;
+
+  for (i = 0; i < info->namelen; i++)
+  {
+    char c = file[i] == '\\' ? '/' : file[i];
+    if (c == '\0' || c != info->name[i])
+    {
+      return 0;
+    }
+  }
+  return file[i] == '\0';
+}
+
+//------------------------------------------------------------------------------
+
+/*
+ *	Reads a size limit of a policy rule, a number of bytes or a string such as
+ *	"512K", "64MB" or "1GB". Returns 0 when the field is missing.
+ */
+static unsigned long long lzip_check_size(lua_State *L, int index, const char *field)
+{
+  static const char Units[] = "KMGT";
+  unsigned long long Size = 0;
+  const char *Text, *Unit;
+  char *End;
+  int Shift;
+
+  lua_getfield(L, index, field);
+  if (lua_type(L, -1) == LUA_TNUMBER)
+  {
+    // 2^64 and above do not fit.
+    luaL_argcheck(L, lua_tonumber(L, -1) >= 0, 4, "policy sizes must not be negative");
+    luaL_argcheck(L, lua_tonumber(L, -1) < 18446744073709551616.0, 4, "policy size too large");
+    Size = (unsigned long long)lua_tonumber(L, -1);
+  }
+  else if (lua_type(L, -1) == LUA_TSTRING)
+  {
+    // strtoull would take a sign and wrap a negative size around.
+    Text = lua_tostring(L, -1);
+    luaL_argcheck(L, *Text >= '0' && *Text <= '9', 4, "policy sizes are numbers of bytes or strings such as \"64MB\"");
+    errno = 0;
+    Size = strtoull(Text, &End, 10);
+    luaL_argcheck(L, errno != ERANGE, 4, "policy size too large");
+    Unit = *End != '\0' ? strchr(Units, *End & ~0x20) : NULL;
+    if (Unit != NULL)
+    {
+      // 1024 times for K, twice for M and so on.
+      for (Shift = (int)(Unit - Units); Shift >= 0; Shift--)
+      {
+        luaL_argcheck(L, Size <= (ULLONG_MAX >> 10), 4, "policy size too large");
+        Size *= 1024;
+      }
+      End++;
+    }
+    if ((*End | 0x20) == 'b')
+    {
+      End++;
+    }
+    luaL_argcheck(L, *End == '\0', 4, "policy sizes are numbers of bytes or strings such as \"64MB\"");
+  }
+  lua_pop(L, 1);
+  return Size;
+}
+
+/*
+ *	Collects the policy table given to compress_files into zip rules, one for
+ *	every pattern a rule matches. The rules live in a userdata left on the
+ *	stack, the patterns stay anchored in the policy table.
+ *
+ *	Each rule is a table with any of:
+ *	match      A glob or a list of globs, such as "*.log", matched against the
+ *	           base name of the file ignoring case. Any file without one.
+ *	min_size   Smallest file matched, see lzip_check_size.
+ *	max_size   Largest file matched.
+ *	method     "store" or "deflate".
+ *	level      Compression level (0-10), the archive's level without one.
+ *	strategy   "default", "filtered", "huffman", "rle" or "fixed".
+ *	threads    Deflate each file in blocks on this many threads.
+ */
+static struct zip_rule_t *lzip_check_policy(lua_State *L, int index, size_t *Count)
+{
+  static const char *const Methods[] = {"store", "deflate", NULL};
+  static const char *const Strategies[] = {"default", "filtered", "huffman", "rle", "fixed", NULL};
+  struct zip_rule_t *Rules, Rule;
+  size_t i, j, k, Len = lzip_rawlen(L, index);
+  lua_Integer Threads;
+
+  // Count the rules first, a rule with several patterns becomes several.
+  *Count = 0;
+  for (i = 1; i <= Len; i++)
+  {
+    lua_rawgeti(L, index, (int)i);
+    luaL_argcheck(L, lua_istable(L, -1), 4, "policy rules must be tables");
+    lua_getfield(L, -1, "match");
+    *Count += lua_istable(L, -1) ? lzip_rawlen(L, -1) : 1;
+    lua_pop(L, 2);
+  }
+
+  Rules = (struct zip_rule_t *)lua_newuserdata(L, (*Count + 1) * sizeof(*Rules));
+  for (i = 1, j = 0; i <= Len; i++)
+  {
+    lua_rawgeti(L, index, (int)i);
+
+    memset(&Rule, 0, sizeof(Rule));
+    Rule.level = -1;
+    Rule.min_size = lzip_check_size(L, -1, "min_size");
+    Rule.max_size = lzip_check_size(L, -1, "max_size");
+
+    lua_getfield(L, -1, "level");
+    if (!lua_isnil(L, -1))
+    {
+      Rule.level = (int)luaL_checkinteger(L, -1);
+      luaL_argcheck(L, Rule.level >= 0 && Rule.level <= 10, 4, "policy levels must be between 0 and 10");
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, "method");
+    if (!lua_isnil(L, -1) && luaL_checkoption(L, -1, NULL, Methods) == 0)
+    {
+      Rule.level = 0;
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, "strategy");
+    if (!lua_isnil(L, -1))
+    {
+      Rule.strategy = luaL_checkoption(L, -1, NULL, Strategies);
+    }
+    lua_pop(L, 1);
+
+    // Block threads add to the pool's, keep them within the library's cap.
+    lua_getfield(L, -1, "threads");
+    if (!lua_isnil(L, -1))
+    {
+      Threads = luaL_checkinteger(L, -1);
+      luaL_argcheck(L, Threads >= 1, 4, "policy threads must be at least 1");
+      Rule.threads = (int)(Threads < ZIP_MAX_THREADS ? Threads : ZIP_MAX_THREADS);
+    }
+    lua_pop(L, 1);
+
+    // One zip rule for every pattern.
+    lua_getfield(L, -1, "match");
+    if (lua_istable(L, -1))
+    {
+      for (k = 1; k <= lzip_rawlen(L, -1); k++)
+      {
+        lua_rawgeti(L, -1, (int)k);
+        luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 4, "policy patterns must be strings");
+        Rules[j] = Rule;
+        Rules[j++].pattern = lua_tostring(L, -1);
+        lua_pop(L, 1);
+      }
+    }
+    else
+    {
+      luaL_argcheck(L, lua_isnil(L, -1) || lua_type(L, -1) == LUA_TSTRING, 4, "policy patterns must be strings");
+      Rules[j] = Rule;
+      Rules[j++].pattern = lua_tostring(L, -1);
+    }
+    lua_pop(L, 2);
+  }
+  return Rules;
+}
+
+//------------------------------------------------------------------------------
+
+/*
+ *	Simple wrapper function which takes a list of files in a lua table and compresses 
+ *  them into a zip archive.
+ *
+ *	Options:
+ *	threads         Number of threads to deflate files on, at most 64.
+ *	checkpoint      Table with any of entries, bytes and seconds, the archive
+ *	                is committed whenever that many files were added, it grew
+ *	                by that many bytes or that many seconds passed, so a run
+ *	                that is cut short can be resumed.
+ *	resume          Continue an archive a previous run left behind, the files
+ *	                it holds completely are skipped.
+ *	store_threshold Files whose start deflates by less than this many percent
+ *	                are stored instead, 0 deflates everything.
+ *	policy          List of rules, each file is compressed as the first one it
+ *	                matches says, see lzip_check_policy.
+ */
+int lzipFiles(lua_State *L)
+{
+  // Initialize the zip state.
+  struct zip_t *Zip;
+  
+  int CompressionLevel = ZIP_DEFAULT_COMPRESSION_LEVEL;
+  int Threads = 1;
+  int Resume = 0;
+  lua_Integer StoreThreshold = -1;
+  lua_Integer Checkpoint[3] = {0, 0, 0};
+  static const char *const CheckpointFields[3] = {"entries", "bytes", "seconds"};
+  struct zip_rule_t *Policy = NULL;
+  size_t PolicyLen = 0;
+  const char **FileNames;
+  const char *ZipName = luaL_checkstring(L, 1);
+  size_t Count = 0;
+  size_t Capacity;
+  size_t i, Pending, Entry, Total;
+  struct zip_entry_info_t Info;
+  FILE *Existing;
+  int err;
 
   // Get the compression level required
   if (lua_isnumber(L, 3))
@@ -478,39 +1950,172 @@ int lzipFiles(lua_State *L)
     CompressionLevel = (int) lua_tointeger(L, 3);
   }
 
-  // Check a Lua table was passed.	
-  if (lua_istable(L, 2))
+  // Get the number of worker threads from the options table.
+  if (lua_istable(L, 4))
   {
-    // Push nil onto the stack.
-    lua_pushnil(L);
+    lua_getfield(L, 4, "threads");
+    if (lua_isnumber(L, -1))
+    {
+      lua_Integer Requested = lua_tointeger(L, -1);
+      Threads = (int) (Requested < 1 ? 1 : Requested < ZIP_MAX_THREADS ? Requested : ZIP_MAX_THREADS);
+    }
+    lua_pop(L, 1);
 
-    // Create a zip file using the passed compression level and archive name.
-    Zip = zip_open((char *)lua_tostring(L, 1), CompressionLevel, 'w');
+    lua_getfield(L, 4, "resume");
+    Resume = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, 4, "store_threshold");
+    if (lua_isnumber(L, -1))
+    {
+      StoreThreshold = lua_tointeger(L, -1);
+      luaL_argcheck(L, StoreThreshold >= 0 && StoreThreshold <= 100, 4, "store_threshold must be a percentage");
+    }
+    lua_pop(L, 1);
+
+    // The rules stay on the stack until the files are compressed.
+    lua_getfield(L, 4, "policy");
+    if (lua_istable(L, -1))
+    {
+      Policy = lzip_check_policy(L, lua_gettop(L), &PolicyLen);
+    }
+    else
+    {
+      lua_pop(L, 1);
+    }
 
-    // Loop for each file in the passed table.
-    while (lua_next(L, 2) != 0)
+    lua_getfield(L, 4, "checkpoint");
+    if (lua_istable(L, -1))
     {
-      // Check it's a string (file name) on the stack.
-      if (lua_isstring(L, -1))
+      for (i = 0; i < 3; i++)
       {
-        // Create a entry in the zip for the passed file.
-        zip_entry_open(Zip, (char *)lua_tostring(L, -1));
+        lua_getfield(L, -1, CheckpointFields[i]);
+        Checkpoint[i] = lua_isnumber(L, -1) ? lua_tointeger(L, -1) : 0;
+        luaL_argcheck(L, Checkpoint[i] >= 0, 4, "checkpoint limits must not be negative");
+        lua_pop(L, 1);
+      }
+    }
+    lua_pop(L, 1);
+  }
+  if (Threads < 1)
+  {
+    Threads = 1;
+  }
+
+  // Check a Lua table was passed.	
+  if (!lua_istable(L, 2))
+  {
+    return 0;
+  }
 
-        // Write and compress the file to the archive.
-        zip_entry_fwrite(Zip, (char *)lua_tostring(L, -1));
+  // Collect the file names, the strings stay anchored in the table.
+  Capacity = lzip_rawlen(L, 2) + 1;
+  FileNames = malloc(Capacity * sizeof(*FileNames));
+  if (FileNames == NULL)
+  {
+    return luaL_error(L, "out of memory");
+  }
 
-        // Close the entry.
-        zip_entry_close(Zip);
+  // Push nil onto the stack.
+  lua_pushnil(L);
 
-        // Pop the last entry off the stack.
-        lua_pop(L, 1);
+  // Loop for each file in the passed table.
+  while (lua_next(L, 2) != 0)
+  {
+    // Check it's a string (file name) on the stack.
+    if (lua_type(L, -1) == LUA_TSTRING)
+    {
+      if (Count == Capacity)
+      {
+        // Not a sequence, make room for the rest of the keys.
+        const char **Grown;
+        Capacity *= 2;
+        Grown = realloc(FileNames, Capacity * sizeof(*FileNames));
+        if (Grown == NULL)
+        {
+          free(FileNames);
+          return luaL_error(L, "out of memory");
+        }
+        FileNames = Grown;
       }
+      FileNames[Count++] = lua_tostring(L, -1);
+    }
+
+    // Pop the value off the stack, leaving the key for lua_next.
+    lua_pop(L, 1);
+  }
+
+  // Pick up where a previous run stopped, if there was one.
+  Zip = NULL;
+  if (Resume)
+  {
+    Zip = zip_open_resume(ZipName, CompressionLevel);
+    Existing = Zip == NULL ? fopen(ZipName, "rb") : NULL;
+    if (Existing != NULL)
+    {
+      // Something that is not an archive, leave it be.
+      fclose(Existing);
+      free(FileNames);
+      lua_pushnil(L);
+      lua_pushstring(L, "cannot resume archive");
+      return 2;
+    }
+  }
+
+  // Create a zip file using the passed compression level and archive name.
+  if (Zip == NULL)
+  {
+    Zip = zip_open(ZipName, CompressionLevel, 'w');
+  }
+  if (Zip == NULL)
+  {
+    free(FileNames);
+    lua_pushnil(L);
+    lua_pushstring(L, "cannot open archive");
+    return 2;
+  }
+
+  // Skip the files already in the archive, they were added in the order given.
+  Total = (size_t)zip_entries_total(Zip);
+  for (i = 0, Pending = 0, Entry = 0; i < Count; i++)
+  {
+    if (Entry < Total && zip_entry_info(Zip, Entry, &Info) == 0 && lzip_same_name(FileNames[i], &Info))
+    {
+      Entry++;
+      continue;
     }
+    FileNames[Pending++] = FileNames[i];
+  }
+  Count = Pending;
+
+  if (StoreThreshold >= 0)
+  {
+    zip_set_store_threshold(Zip, (int)StoreThreshold);
+  }
+  if (Policy != NULL)
+  {
+    zip_set_policy(Zip, Policy, PolicyLen);
+  }
+  if (Checkpoint[0] || Checkpoint[1] || Checkpoint[2])
+  {
+    zip_set_autocommit(Zip, (size_t)Checkpoint[0], (unsigned long long)Checkpoint[1], (unsigned int)Checkpoint[2]);
+  }
+
+  // Compress the files, deflating on worker threads when asked to.
+  err = zip_entries_fwrite(Zip, FileNames, Count, Threads);
+  free(FileNames);
 
-    // Close the Zip file.
-    zip_close(Zip);
+  // Close the Zip file.
+  zip_close(Zip);
+
+  if (err < 0)
+  {
+    lua_pushnil(L);
+    lzip_geterror(L, err);
+    return 2;
   }
-  return 0;
+  lua_pushboolean(L, 1);
+  return 1;
 }
 
 //------------------------------------------------------------------------------
@@ -533,6 +2138,7 @@ static int lzip__gc(lua_State *L)
  */
 static const luaL_Reg lzip_method_map[] = {
     {"close", lzip_close},
+    {"finalize", lzip_finalize},
     {"is64", lzip_is64},
     {"entry_opencasesensitive", lzip_entry_opencasesensitive},
     {"entry_openbyindex", lzip_entry_openbyindex},
@@ -546,20 +2152,48 @@ static const luaL_Reg lzip_method_map[] = {
     {"entry_crc32", lzip_entry_crc32},
     {"entry_close", lzip_entry_close},
     {"entries_total", lzip_entries_total},
+    {"list", lzip_list},
+    {"entries", lzip_entries},
     {"entry_fwrite", lzip_entry_fwrite},
     {"entry_fread", lzip_entry_fread},
+    {"entry_read", lzip_entry_read},
+    {"entry_reader", lzip_entry_reader},
+    {"entry_read_raw", lzip_entry_read_raw},
+    {"entry_reader_raw", lzip_entry_reader_raw},
+    {"entry_gzip_frame", lzip_entry_gzip_frame},
     {"entry_write", lzip_entry_write},
+    {"entry_write_raw", lzip_entry_write_raw},
+    {"copy_entry_from", lzip_copy_entry_from},
+    {"delete", lzip_delete},
+    {"replace", lzip_replace},
+    {"compact", lzip_compact},
+    {"reclaimable", lzip_reclaimable},
+    {"commit", lzip_commit},
     {"__gc", lzip__gc},
     {NULL, NULL}};
 
 //------------------------------------------------------------------------------
 
+/*
+ * The methods an entry reader exposes to Lua.
+ */
+static const luaL_Reg lzip_reader_method_map[] = {
+    {"read", lzip_reader_read},
+    {"close", lzip_reader_close},
+    {"__gc", lzip_reader_close},
+    {NULL, NULL}};
+
+//------------------------------------------------------------------------------
+
 /*
  * The methods this module exposes to Lua.
  */
 static const luaL_Reg lzip_module[] = {
     {"open", lzip_open},
+    {"open_memory", lzip_open_memory},
+    {"new_memory", lzip_new_memory},
     {"compress_files", lzipFiles},
+    {"merge", lzip_merge},
     {NULL, NULL}};
 
 //------------------------------------------------------------------------------
@@ -591,6 +2225,26 @@ int luaopen_lzip(lua_State *L)
 	luaL_setfuncs(L, lzip_method_map, 0);
 #endif
 
+  lua_pop(L, 1);
+
+	// Create the entry reader userdata
+	luaL_newmetatable(L, "lzip.reader");
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+
+#if LUA_VERSION_NUM == 501
+	luaL_register(L, NULL, lzip_reader_method_map);
+#else
+	luaL_setfuncs(L, lzip_reader_method_map, 0);
+#endif
+
+  lua_pop(L, 1);
+
+	// Owner of the buffer finalize takes over
+	luaL_newmetatable(L, "lzip.buffer");
+	lua_pushcfunction(L, lzip_buffer__gc);
+	lua_setfield(L, -2, "__gc");
+
   lua_pop(L, 1);
   return 1;
 }